@@ -0,0 +1,262 @@
+//RedRelay load generator, spawns synthetic peers against a server and measures relay throughput and latency
+
+#include <iostream>
+#include <iomanip>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include "RedRelayClient.hpp"
+
+enum Scenario{
+    JoinStorm,     //Connect, set name and join a channel, measures join latency
+    ChannelSend,   //TCP channel broadcast
+    ChannelBlast,  //UDP channel broadcast
+    ReliableBlast, //UDP channel broadcast on a reliable subchannel
+    PeerSend       //TCP private messages to peers from the same channel
+};
+
+struct Options{
+    std::string Host = "127.0.0.1";
+    uint16_t Port = 6121;
+    uint32_t Peers = 100;
+    uint32_t Channels = 1;
+    uint32_t Senders = 0; //0 means every peer sends
+    uint32_t Threads = 4;
+    uint32_t Size = 64;
+    float Rate = 10; //Messages per second per sender
+    float Duration = 10;
+    Scenario Type = ChannelSend;
+};
+
+struct BenchPeer{
+    rc::RedRelayClient Client;
+    uint32_t Index = 0;
+    uint16_t Channel = 65535;
+    bool Joined = false;
+    bool Sender = false;
+    int64_t JoinStart = 0;
+    int64_t NextSend = 0;
+};
+
+struct Stats{ //Owned by a single thread, merged at the end
+    uint64_t Sent = 0, Received = 0, Bytes = 0, Errors = 0;
+    std::vector<uint32_t> Latency; //Microseconds
+};
+
+static std::atomic<uint32_t> JoinedPeers(0);
+static std::atomic<uint64_t> ReceivedTotal(0);
+static std::atomic<bool> Measuring(false), Finished(false);
+
+static int64_t Now(){ //Nanoseconds, steady across threads of this process
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void HandleMessage(const rc::Event& Event, Stats& Stats){
+    if (!Measuring || Event.Size() < 8) return;
+    int64_t stamp;
+    memcpy(&stamp, Event.Address(), 8);
+    int64_t latency = (Now()-stamp)/1000;
+    Stats.Received++;
+    Stats.Bytes += Event.Size();
+    Stats.Latency.push_back(latency > 0 ? latency : 0);
+    ReceivedTotal.fetch_add(1, std::memory_order_relaxed);
+}
+
+static void SendMessage(BenchPeer& Peer, const Options& Options, std::vector<char>& Payload, Stats& Stats){
+    int64_t stamp = Now();
+    memcpy(&Payload[0], &stamp, 8);
+    switch (Options.Type){
+    case ChannelSend:
+        Peer.Client.ChannelSend(&Payload[0], Payload.size(), 1, 2, Peer.Channel);
+        break;
+    case ChannelBlast:
+    case ReliableBlast:
+        Peer.Client.ChannelBlast(&Payload[0], Payload.size(), 1, 2, Peer.Channel);
+        break;
+    case PeerSend:
+        {
+            const std::vector<rc::Peer>& list = Peer.Client.GetChannel(Peer.Channel).GetPeerList();
+            if (list.empty()) return;
+            Peer.Client.PeerSend(&Payload[0], Payload.size(), list[(Stats.Sent+Peer.Index)%list.size()].GetID(), 1, 2, Peer.Channel);
+        }
+        break;
+    default:
+        return;
+    }
+    Stats.Sent++;
+}
+
+static void RunPeers(std::vector<BenchPeer>& Peers, uint32_t Begin, uint32_t End, const Options& Options, Stats& Stats){
+    std::vector<char> Payload(Options.Size);
+    int64_t interval = Options.Rate > 0 ? (int64_t)(1000000000.0/Options.Rate) : 0;
+    for (uint32_t i=Begin; i<End; ++i){
+        Peers[i].Client.SetReliable(1, Options.Type == ReliableBlast);
+        Peers[i].Client.Connect(Options.Host, Options.Port);
+    }
+    while (!Finished){
+        for (uint32_t i=Begin; i<End; ++i){
+            BenchPeer& Peer = Peers[i];
+            Peer.Client.Update();
+            for (const rc::Event& Event : Peer.Client.Events)
+                switch (Event.Type){
+                case rc::Event::Connected:
+                    Peer.Client.SetName("bench_"+std::to_string(Peer.Index));
+                    break;
+                case rc::Event::NameSet:
+                    Peer.JoinStart = Now();
+                    Peer.Client.JoinChannel("bench_"+std::to_string(Peer.Index%Options.Channels));
+                    break;
+                case rc::Event::ChannelJoin:
+                    Peer.Channel = Event.ChannelID();
+                    Peer.Joined = true;
+                    if (Options.Type == JoinStorm){
+                        Stats.Received++;
+                        Stats.Latency.push_back((Now()-Peer.JoinStart)/1000);
+                    }
+                    JoinedPeers++;
+                    break;
+                case rc::Event::ChannelSent:
+                case rc::Event::ChannelBlast:
+                case rc::Event::PeerSent:
+                    if (Event.Subchannel() == 1) HandleMessage(Event, Stats);
+                    break;
+                case rc::Event::Error:
+                case rc::Event::ConnectDenied:
+                case rc::Event::NameDenied:
+                case rc::Event::ChannelDenied:
+                case rc::Event::Disconnected:
+                    Stats.Errors++;
+                    break;
+                default:
+                    break;
+                }
+            Peer.Client.Events.clear();
+            if (!Measuring || !Peer.Sender || !Peer.Joined || interval == 0) continue;
+            if (Peer.NextSend == 0) Peer.NextSend = Now()+interval*Peer.Index/Options.Peers; //Spread senders over the first interval
+            if (Now() >= Peer.NextSend){
+                if ((Options.Type == ChannelBlast || Options.Type == ReliableBlast) && Peer.Client.GetConnectState() != rc::RedRelayClient::Established) continue;
+                SendMessage(Peer, Options, Payload, Stats);
+                Peer.NextSend += interval;
+                if (Peer.NextSend < Now()) Peer.NextSend = Now()+interval; //Can't keep up, don't burst to catch up
+            }
+        }
+        std::this_thread::yield();
+    }
+    for (uint32_t i=Begin; i<End; ++i) Peers[i].Client.Disconnect();
+}
+
+static uint32_t Percentile(const std::vector<uint32_t>& Sorted, double Fraction){
+    if (Sorted.empty()) return 0;
+    std::size_t index = Fraction*(Sorted.size()-1);
+    return Sorted[index];
+}
+
+static void Usage(){
+    std::cout<<"Usage: redrelay-bench [options]\n"
+        "  -h <host>        Server address (127.0.0.1)\n"
+        "  -p <port>        Server port (6121)\n"
+        "  -s <scenario>    join, send, blast, reliable or peer (send)\n"
+        "  -n <peers>       Synthetic peers to spawn (100)\n"
+        "  -c <channels>    Channels to spread peers over (1)\n"
+        "  -S <senders>     Peers that send messages, 0 for all (0)\n"
+        "  -r <hz>          Messages per second per sender (10)\n"
+        "  -b <bytes>       Payload size, at least 8 for the timestamp (64)\n"
+        "  -d <seconds>     Measurement duration (10)\n"
+        "  -t <threads>     Client threads (4)\n";
+}
+
+int main(int argc, char** argv){
+    Options Options;
+    for (int i=1; i<argc; ++i){
+        std::string arg = argv[i];
+        if (i+1 >= argc){
+            Usage();
+            return 1;
+        }
+        std::string val = argv[++i];
+        if (arg == "-h") Options.Host = val;
+        else if (arg == "-p") Options.Port = atoi(val.c_str());
+        else if (arg == "-n") Options.Peers = atoi(val.c_str());
+        else if (arg == "-c") Options.Channels = atoi(val.c_str());
+        else if (arg == "-S") Options.Senders = atoi(val.c_str());
+        else if (arg == "-r") Options.Rate = atof(val.c_str());
+        else if (arg == "-b") Options.Size = atoi(val.c_str());
+        else if (arg == "-d") Options.Duration = atof(val.c_str());
+        else if (arg == "-t") Options.Threads = atoi(val.c_str());
+        else if (arg == "-s"){
+            if (val == "join") Options.Type = JoinStorm;
+            else if (val == "send") Options.Type = ChannelSend;
+            else if (val == "blast") Options.Type = ChannelBlast;
+            else if (val == "reliable") Options.Type = ReliableBlast;
+            else if (val == "peer") Options.Type = PeerSend;
+            else {
+                Usage();
+                return 1;
+            }
+        } else {
+            Usage();
+            return 1;
+        }
+    }
+    if (Options.Peers == 0 || Options.Channels == 0 || Options.Threads == 0){
+        Usage();
+        return 1;
+    }
+    if (Options.Size < 8) Options.Size = 8;
+    if (Options.Threads > Options.Peers) Options.Threads = Options.Peers;
+    if (Options.Senders == 0 || Options.Senders > Options.Peers) Options.Senders = Options.Peers;
+
+    std::vector<BenchPeer> Peers(Options.Peers);
+    for (uint32_t i=0; i<Options.Peers; ++i){
+        Peers[i].Index = i;
+        Peers[i].Sender = i < Options.Senders;
+    }
+    std::vector<Stats> Stats(Options.Threads);
+    std::vector<std::thread> Threads;
+    int64_t start = Now();
+    for (uint32_t i=0; i<Options.Threads; ++i)
+        Threads.emplace_back(RunPeers, std::ref(Peers), Options.Peers*i/Options.Threads, Options.Peers*(i+1)/Options.Threads, std::cref(Options), std::ref(Stats[i]));
+
+    std::cout<<"Spawning "<<Options.Peers<<" peers in "<<Options.Channels<<" channels on "<<Options.Host<<":"<<Options.Port<<std::endl;
+    while (JoinedPeers < Options.Peers && Now()-start < 30000000000LL) std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    double joinTime = (Now()-start)*1e-9;
+    std::cout<<JoinedPeers<<" peers joined in "<<std::fixed<<std::setprecision(2)<<joinTime<<" s"<<std::endl;
+
+    double elapsed = joinTime;
+    if (Options.Type != JoinStorm){
+        Measuring = true;
+        start = Now();
+        uint64_t last = 0;
+        for (int second=1; Now()-start < Options.Duration*1e9; ++second){
+            std::this_thread::sleep_until(std::chrono::steady_clock::time_point(std::chrono::nanoseconds(start+second*1000000000LL)));
+            uint64_t total = ReceivedTotal;
+            std::cout<<"["<<second<<" s] "<<total-last<<" msg/s"<<std::endl;
+            last = total;
+        }
+        Measuring = false;
+        elapsed = (Now()-start)*1e-9;
+    }
+    Finished = true;
+    for (std::thread& Thread : Threads) Thread.join();
+
+    uint64_t sent = 0, received = 0, bytes = 0, errors = 0;
+    std::vector<uint32_t> latency;
+    for (const struct Stats& i : Stats){
+        sent += i.Sent;
+        received += i.Received;
+        bytes += i.Bytes;
+        errors += i.Errors;
+        latency.insert(latency.end(), i.Latency.begin(), i.Latency.end());
+    }
+    std::sort(latency.begin(), latency.end());
+    std::cout<<"Sent: "<<sent<<" messages, received: "<<received<<" messages, errors: "<<errors<<std::endl;
+    std::cout<<"Throughput: "<<received/elapsed<<" msg/s, "<<bytes/elapsed/1048576<<" MB/s"<<std::endl;
+    std::cout<<(Options.Type == JoinStorm ? "Join" : "Relay")<<" latency (ms): p50 "<<Percentile(latency, 0.5)*0.001<<", p99 "<<Percentile(latency, 0.99)*0.001
+        <<", p999 "<<Percentile(latency, 0.999)*0.001<<", max "<<(latency.empty() ? 0 : latency.back()*0.001)<<std::endl;
+    return 0;
+}
@@ -149,7 +149,7 @@ const char* RelayPacket::GetPacket(){
 		return &buffer[2];
 	} else {
 		buffer[0]=type;
-		buffer[1]=(uint8_t)254;
+		buffer[1]=(uint8_t)255;
 		buffer[2]=size&255;
 		buffer[3]=(size>>8)&255;
 		buffer[4]=(size>>16)&255;
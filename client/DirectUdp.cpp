@@ -0,0 +1,168 @@
+////////////////////////////////////////////////////////////
+//
+// RedRelay - a Lacewing Relay protocol reimplementation
+// Copyright (c) 2019 LekKit (LekKit#4400 in Discord)
+//
+// This software is provided 'as-is', without any express or implied
+// warranty. In no event will the authors be held liable for any damages
+// arising from the use of this software.
+//
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+//
+// 1. The origin of this software must not be misrepresented; you must not
+//   claim that you wrote the original software. If you use this software
+//   in a product, an acknowledgment in the product documentation would be
+//   appreciated but is not required.
+// 2. Altered source versions must be plainly marked as such, and must not be
+//   misrepresented as being the original software.
+// 3. This notice may not be removed or altered from any source distribution.
+//
+////////////////////////////////////////////////////////////
+
+
+#include "RedRelayClient.hpp"
+
+namespace rc{
+
+//Introductions travel as type 8 through the server, peers punch and keep the path alive with type 8 datagrams sent to each other
+static const uint8_t Punch = 1;
+static const uint8_t PunchAck = 2;
+static const uint8_t PunchTries = 20;
+static const float PunchInterval = 0.1; //Seconds
+static const float KeepaliveInterval = 2;
+static const float DirectTimeout = 6; //Silent paths fall back to the relay
+static const float IntroductionInterval = 5;
+
+void RedRelayClient::HandleIntroduction(std::size_t received){
+	if (received<9 || !DirectUdp) return;
+	uint16_t peer = (uint8_t)UdpBuffer[1]|(uint8_t)UdpBuffer[2]<<8;
+	sf::IpAddress address((uint32_t)(uint8_t)UdpBuffer[3]<<24|(uint32_t)(uint8_t)UdpBuffer[4]<<16|(uint32_t)(uint8_t)UdpBuffer[5]<<8|(uint8_t)UdpBuffer[6]);
+	uint16_t port = (uint8_t)UdpBuffer[7]|(uint8_t)UdpBuffer[8]<<8;
+	if (!SharesChannel(peer)) return;
+	DirectPath* Path = PathOf(peer);
+	if (Path != NULL && Path->Alive && Path->Address == address && Path->Port == port) return;
+	if (Path == NULL){
+		DirectPath New;
+		New.PeerID = peer;
+		New.LastHeard = 0;
+		New.LastSent = 0;
+		DirectPaths.push_back(New);
+		Path = &DirectPaths.back();
+	}
+	Path->Address = address;
+	Path->Port = port;
+	Path->Alive = false;
+	Path->Punches = PunchTries;
+	Path->NextPunch = Timer();
+}
+
+void RedRelayClient::HandleDirect(std::size_t received, const sf::IpAddress& Address, uint16_t Port){
+	if (received<5) return;
+	DirectPath* Path = NULL;
+	for (DirectPath& i : DirectPaths) if (i.Address == Address && i.Port == Port) Path = &i;
+	if (Path == NULL) return;
+	uint8_t type = ((uint8_t)UdpBuffer[0])>>4;
+	if (type == 8){
+		if (((uint8_t)UdpBuffer[1]|(uint8_t)UdpBuffer[2]<<8) != Path->PeerID || ((uint8_t)UdpBuffer[3]|(uint8_t)UdpBuffer[4]<<8) != PeerID) return;
+		Path->LastHeard = Timer();
+		if ((UdpBuffer[0]&15) == PunchAck) Path->Alive = true;
+		else {
+			SendPunch(*Path, PunchAck);
+			if (!Path->Alive) SendPunch(*Path, Punch); //They hear us now, so ours will get through too
+		}
+		return;
+	}
+	if (received<6 || (type != 2 && type != 3 && (type < 13 || type > 15))) return;
+	//Same layout as relayed by the server, but nobody checked the sender and channel for us
+	if (((uint8_t)UdpBuffer[4]|(uint8_t)UdpBuffer[5]<<8) != Path->PeerID || !SharesChannel(Path->PeerID, (uint8_t)UdpBuffer[2]|(uint8_t)UdpBuffer[3]<<8)) return;
+	Path->LastHeard = Timer();
+	HandleUDP(received);
+}
+
+void RedRelayClient::UpdateDirect(){
+	float now = Timer();
+	if (now >= NextIntroduction){ //Asks again for channels with peers still behind the relay
+		NextIntroduction = now+IntroductionInterval;
+		PrunePaths();
+		for (const Channel& i : Channels){
+			bool relayed = false;
+			for (const Peer& j : i.Peers){
+				DirectPath* Path = PathOf(j.ID);
+				if (Path == NULL || !Path->Alive) relayed = true;
+			}
+			if (!relayed) continue;
+			UdpBuffer[0]=8<<4;
+			UdpBuffer[1]=PeerID&255;
+			UdpBuffer[2]=(PeerID>>8)&255;
+			UdpBuffer[3]=i.ID&255;
+			UdpBuffer[4]=(i.ID>>8)&255;
+			UdpBuffer[5]=(char)255; //Everyone in the channel who opted in
+			UdpBuffer[6]=(char)255;
+			UdpSocket.send(UdpBuffer, 7, TcpSocket.getRemoteAddress(), TcpSocket.getRemotePort());
+		}
+	}
+	for (DirectPath& i : DirectPaths){
+		if (i.Alive && now-i.LastHeard > DirectTimeout){ //NAT mapping is likely gone
+			i.Alive = false;
+			i.Punches = 0;
+		}
+		if (!i.Alive && i.Punches > 0 && now >= i.NextPunch){
+			SendPunch(i, Punch);
+			i.NextPunch = now+PunchInterval;
+			--i.Punches;
+		} else if (i.Alive && now-i.LastSent > KeepaliveInterval) SendPunch(i, Punch);
+	}
+}
+
+void RedRelayClient::SendPunch(DirectPath& Path, uint8_t Variant){
+	char punch[5] = {(char)(8<<4|Variant), (char)(PeerID&255), (char)((PeerID>>8)&255), (char)(Path.PeerID&255), (char)((Path.PeerID>>8)&255)};
+	UdpSocket.send(punch, 5, Path.Address, Path.Port);
+	Path.LastSent = Timer();
+}
+
+bool RedRelayClient::DirectRoute(uint16_t ChannelID, uint16_t Target, std::vector<DirectPath*>& Paths){
+	if (DirectPaths.empty()) return false;
+	if (Target != 65535){
+		DirectPath* Path = PathOf(Target);
+		if (Path == NULL || !Path->Alive) return false;
+		Paths.push_back(Path);
+		return true;
+	}
+	for (const Channel& i : Channels) if (i.ID == ChannelID){
+		for (const Peer& j : i.Peers){ //Broadcast goes direct only if it can reach everyone, the relay would duplicate it otherwise
+			DirectPath* Path = PathOf(j.ID);
+			if (Path == NULL || !Path->Alive) return false;
+			Paths.push_back(Path);
+		}
+	}
+	return !Paths.empty();
+}
+
+bool RedRelayClient::SharesChannel(uint16_t PeerID, uint16_t ChannelID) const {
+	for (const Channel& i : Channels) if (ChannelID == 65535 || i.ID == ChannelID)
+		for (const Peer& j : i.Peers) if (j.ID == PeerID) return true;
+	return false;
+}
+
+void RedRelayClient::PrunePaths(){
+	for (uint32_t i=0; i<DirectPaths.size(); ++i) if (!SharesChannel(DirectPaths[i].PeerID)) DirectPaths.erase(DirectPaths.begin()+i--);
+}
+
+RedRelayClient::DirectPath* RedRelayClient::PathOf(uint16_t PeerID){
+	for (DirectPath& i : DirectPaths) if (i.PeerID == PeerID) return &i;
+	return NULL;
+}
+
+void RedRelayClient::SetDirectUdp(bool Flag){
+	DirectUdp=Flag;
+	if (!Flag) DirectPaths.clear();
+}
+
+bool RedRelayClient::IsDirect(uint16_t PeerID) const {
+	for (const DirectPath& i : DirectPaths) if (i.PeerID == PeerID) return i.Alive;
+	return false;
+}
+
+}
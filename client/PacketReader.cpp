@@ -89,8 +89,9 @@ uint8_t PacketReader::GetPacketType() const {
 }
 
 void PacketReader::NextPacket(){
-	received-=PacketSize()+SizeOffset()+1;
-	packetbegin+=PacketSize()+SizeOffset()+1;
+	std::size_t size=PacketSize()+SizeOffset()+1; //Computed once, the header must be read before received changes
+	received-=size;
+	packetbegin+=size;
 	if (packetbegin>0 && !PacketReady()){
 		memmove(buffer, &buffer[packetbegin], received);
 		packetbegin=0;
@@ -21,11 +21,17 @@
 //
 ////////////////////////////////////////////////////////////
 
+#include <algorithm>
 #include "Platform.hpp"
 #include "RedRelayClient.hpp"
 
 namespace rc{
 
+static const std::size_t FragmentSize = 1400; //Larger datagrams are fragmented by the client instead of IP
+static const std::size_t FragmentHeader = 12;
+static const uint8_t MaxPartialMessages = 64;
+static const float ReassemblyTimeout = 2; //Seconds
+
 RedRelayClient::RedRelayClient(){
 	TcpSocket.setBlocking(false);
 	UdpSocket.setBlocking(false);
@@ -96,6 +102,7 @@ void RedRelayClient::HandleTCP(const char* Msg, std::size_t Size, uint8_t Type){
 					if ((Msg[i+2]&1)!=0) Channels.at(Channels.size()-1).Master=(uint8_t)Msg[i]|(uint8_t)Msg[i+1]<<8;
 				}
 				Events.push_back(Event(Event::ChannelJoin,  Channels.at(Channels.size()-1).Name, 0, SelectedChannel));
+				NextIntroduction=0; //Meet the new channel peers right away
 			} else {
 				Events.push_back(Event(Event::ChannelDenied, std::string(&Msg[3+(uint8_t)Msg[2]], Size-(uint8_t)Msg[2]-3)));
 			}
@@ -107,9 +114,11 @@ void RedRelayClient::HandleTCP(const char* Msg, std::size_t Size, uint8_t Type){
 			}
 			if (Msg[1]){
 				uint16_t ChannelID = (uint8_t)Msg[2]|(uint8_t)Msg[3]<<8;
+				ResetReliable(ChannelID, 65535);
 				for (uint32_t i=0; i<Channels.size(); ++i) if (Channels.at(i).ID == ChannelID){
 					Events.push_back(Event(Event::ChannelLeave, Channels.at(i).Name, 0, Channels.at(i).ID));
 					Channels.erase(Channels.begin()+i);
+					PrunePaths();
 					if (i>0) SelectedChannel=Channels.at(i-1).ID;
 				}
 			} else {
@@ -127,6 +136,10 @@ void RedRelayClient::HandleTCP(const char* Msg, std::size_t Size, uint8_t Type){
 			break;
 		}
 		break;
+	case 1:
+		if (Size<1) break;
+		Events.push_back(Event(Event::ServerSent, std::string(&Msg[1], Size-1), 65535, 65535, (uint8_t)Msg[0]|(Type&15)<<8));
+		break;
 	case 2:
 		if (Size<6) break;
 		Events.push_back(Event(Event::ChannelSent, std::string(&Msg[5], Size-5), (uint8_t)Msg[3]|(uint8_t)Msg[4]<<8, (uint8_t)Msg[1]|(uint8_t)Msg[2]<<8, (uint8_t)Msg[0]|(Type&15)<<8));
@@ -143,9 +156,11 @@ void RedRelayClient::HandleTCP(const char* Msg, std::size_t Size, uint8_t Type){
 			for (Channel&i : Channels) if (i.ID==channel){
 				for (uint32_t j=0; j<i.Peers.size(); ++j) if (i.Peers.at(j).ID==peer){
 					if (Size==4){
+						ResetReliable(channel, peer);
 						if (i.Peers.at(j).ID==i.Master) i.Master=65535;
 						Events.push_back(Event(Event::PeerLeft, i.Peers.at(j).Name, i.Peers.at(j).ID, i.ID, i.Master==65535));
 						i.Peers.erase(i.Peers.begin()+j);
+						PrunePaths();
 						quit=true;
 						break;
 					}
@@ -180,6 +195,10 @@ void RedRelayClient::HandleTCP(const char* Msg, std::size_t Size, uint8_t Type){
 
 void RedRelayClient::HandleUDP(std::size_t received){
 	switch (((unsigned char)UdpBuffer[0])>>4){
+	case 1:
+		if (received<2) return;
+		Events.push_back(Event(Event::ServerBlast, std::string(&UdpBuffer[2], received-2), 65535, 65535, (uint8_t)UdpBuffer[1]|((uint8_t)UdpBuffer[0]&15)<<8));
+		break;
 	case 2:
 		if (received<6) return;
 		Events.push_back(Event(Event::ChannelBlast, std::string(&UdpBuffer[6], received-6), (uint8_t)UdpBuffer[4]|(uint8_t)UdpBuffer[5]<<8, (uint8_t)UdpBuffer[2]|(uint8_t)UdpBuffer[3]<<8, (uint8_t)UdpBuffer[1]|((uint8_t)UdpBuffer[0]&15)<<8));
@@ -187,15 +206,139 @@ void RedRelayClient::HandleUDP(std::size_t received){
 	case 3:
 		if (received<6) return;
 		Events.push_back(Event(Event::PeerBlast, std::string(&UdpBuffer[6], received-6), (uint8_t)UdpBuffer[4]|(uint8_t)UdpBuffer[5]<<8, (uint8_t)UdpBuffer[2]|(uint8_t)UdpBuffer[3]<<8, (uint8_t)UdpBuffer[1]|((uint8_t)UdpBuffer[0]&15)<<8));
+		break;
 	case 10:
 		if (ConnectState==RequestingUdp) Events.push_back(Event::Established);
 		ConnectState=Established;
 		break;
+	case 12: //Channel blasts aggregated by the server over one tick
+	{
+		if (received<3) return;
+		uint16_t channel = (uint8_t)UdpBuffer[1]|(uint8_t)UdpBuffer[2]<<8;
+		std::size_t i = 3;
+		while (i+6 <= received){ //Variant, subchannel, sender and payload size, then the payload
+			uint16_t peer = (uint8_t)UdpBuffer[i+2]|(uint8_t)UdpBuffer[i+3]<<8;
+			std::size_t size = (uint8_t)UdpBuffer[i+4]|(uint8_t)UdpBuffer[i+5]<<8;
+			if (i+6+size > received) return;
+			if (peer != PeerID) Events.push_back(Event(Event::ChannelBlast, std::string(&UdpBuffer[i+6], size), peer, channel, (uint8_t)UdpBuffer[i+1]|((uint8_t)UdpBuffer[i]&15)<<8));
+			i += 6+size;
+		}
+	}
+		break;
+	case 13:
+		HandleReliable(received);
+		break;
+	case 14:
+		HandleReliableAck(received);
+		break;
+	case 15:
+		HandleFragment(received);
+		break;
+	case 8:
+		HandleIntroduction(received);
+		break;
 	default:
 		break;
 	}
 }
 
+void RedRelayClient::HandleFragment(std::size_t received){
+	if (received<10) return;
+	uint16_t sender = (uint8_t)UdpBuffer[4]|(uint8_t)UdpBuffer[5]<<8, id = (uint8_t)UdpBuffer[6]|(uint8_t)UdpBuffer[7]<<8;
+	uint8_t index = UdpBuffer[8], count = UdpBuffer[9];
+	if (count < 2 || index >= count) return;
+	PartialMessage* Message = NULL;
+	for (PartialMessage& i : Fragments) if (i.Sender == sender && i.ID == id) Message = &i;
+	if (Message == NULL){
+		float now = Timer();
+		for (uint32_t i=0; i<Fragments.size(); ++i) if (Fragments[i].Deadline < now) Fragments.erase(Fragments.begin()+i--);
+		if (Fragments.size() >= MaxPartialMessages) Fragments.erase(Fragments.begin()); //Oldest one is the least likely to complete
+		PartialMessage New;
+		New.Sender = sender;
+		New.ID = id;
+		New.Received = 0;
+		New.Deadline = now+ReassemblyTimeout;
+		New.Parts.resize(count);
+		Fragments.push_back(New);
+		Message = &Fragments.back();
+	}
+	if (Message->Parts.size() != count || !Message->Parts[index].empty() || received == 10) return;
+	Message->Parts[index].assign(&UdpBuffer[10], received-10);
+	Message->Deadline = Timer()+ReassemblyTimeout;
+	if (++Message->Received < count) return;
+	std::string message;
+	for (const std::string& i : Message->Parts) message += i;
+	Fragments.erase(Fragments.begin()+(Message-&Fragments[0]));
+	if (message.size() < 6 || ((uint8_t)message[0])>>4 == 15 || message.size() > sizeof(UdpBuffer)) return;
+	message[2] = UdpBuffer[2]; //Channel and sender as checked by the server
+	message[3] = UdpBuffer[3];
+	message[4] = UdpBuffer[4];
+	message[5] = UdpBuffer[5];
+	memcpy(UdpBuffer, message.data(), message.size());
+	HandleUDP(message.size());
+}
+
+void RedRelayClient::SendUdp(std::size_t Size){
+	SendUdp(Size, NextFragmentID++);
+}
+
+void RedRelayClient::SendUdp(std::size_t Size, uint16_t FragmentID){
+	bool addressed = ((uint8_t)UdpBuffer[0])>>4 != 2; //Channel blasts are the only ones without a receiver
+	uint16_t channel = (uint8_t)UdpBuffer[4]|(uint8_t)UdpBuffer[5]<<8, target = addressed ? (uint8_t)UdpBuffer[6]|(uint8_t)UdpBuffer[7]<<8 : 65535;
+	std::vector<DirectPath*> direct;
+	bool routed = DirectUdp && DirectRoute(channel, target, direct);
+	if (!routed && Size <= FragmentSize){
+		UdpSocket.send(UdpBuffer, Size, TcpSocket.getRemoteAddress(), TcpSocket.getRemotePort());
+		return;
+	}
+	//Peers get the message as the server would relay it, fragments carry the routing
+	std::size_t header = addressed ? 8 : 6;
+	std::string message;
+	message.reserve(Size);
+	message += UdpBuffer[0];
+	message.append(&UdpBuffer[3], 3);
+	message.append(&UdpBuffer[1], 2);
+	message.append(&UdpBuffer[header], Size-header);
+	if (routed){
+		for (DirectPath* i : direct) SendDirect(*i, message, FragmentID);
+		return;
+	}
+	char fragment[FragmentSize];
+	fragment[0]=15<<4;
+	memcpy(&fragment[1], &UdpBuffer[1], 5); //Sender, subchannel and channel
+	fragment[6]=addressed ? UdpBuffer[6] : (char)255;
+	fragment[7]=addressed ? UdpBuffer[7] : (char)255;
+	fragment[8]=FragmentID&255;
+	fragment[9]=(FragmentID>>8)&255;
+	SendFragments(message, fragment, FragmentHeader, TcpSocket.getRemoteAddress(), TcpSocket.getRemotePort());
+}
+
+void RedRelayClient::SendFragments(const std::string& Message, char* Fragment, std::size_t Header, const sf::IpAddress& Address, uint16_t Port){
+	std::size_t chunk = FragmentSize-Header;
+	uint8_t count = (Message.size()+chunk-1)/chunk;
+	Fragment[Header-1]=count; //Header ends with the index and count
+	for (uint8_t i=0; i<count; ++i){
+		std::size_t size = std::min(chunk, Message.size()-i*chunk);
+		Fragment[Header-2]=i;
+		memcpy(&Fragment[Header], &Message[i*chunk], size);
+		UdpSocket.send(Fragment, Header+size, Address, Port);
+	}
+}
+
+void RedRelayClient::SendDirect(DirectPath& Path, const std::string& Message, uint16_t FragmentID){
+	Path.LastSent = Timer();
+	if (Message.size() <= FragmentSize){
+		UdpSocket.send(Message.data(), Message.size(), Path.Address, Path.Port);
+		return;
+	}
+	char fragment[FragmentSize];
+	fragment[0]=15<<4;
+	memcpy(&fragment[1], &Message[1], 5); //Subchannel, channel and sender, like a fragment relayed by the server
+	fragment[6]=FragmentID&255;
+	fragment[7]=(FragmentID>>8)&255;
+	SendFragments(Message, fragment, FragmentHeader-2, Path.Address, Path.Port);
+}
+
 float RedRelayClient::Timer(){
 	return (float)(TimerClock.getElapsedTime().asMilliseconds()*0.001);
 }
@@ -220,6 +363,11 @@ void RedRelayClient::Disconnect(){
 	nextevents.push_back(Event(Event::Disconnected, TcpSocket.getRemoteAddress().toString()+":"+std::to_string(TcpSocket.getRemotePort())));
 	TcpSocket.disconnect();
 	Channels.clear();
+	OutStreams.clear();
+	InStreams.clear();
+	Rtts.clear();
+	Fragments.clear();
+	DirectPaths.clear();
 	reader.Clear();
 	ConnectState=Disconnected;
 }
@@ -254,7 +402,12 @@ void RedRelayClient::Update(){
 	} while (status==sf::Socket::Done);
 	if (status==sf::Socket::Disconnected && ConnectState>Connecting) Disconnect();
 	sf::IpAddress UdpAddress; uint16_t UdpPort;
-	while (UdpSocket.receive(UdpBuffer, 65536, received, UdpAddress, UdpPort) == sf::Socket::Done) if (UdpAddress==TcpSocket.getRemoteAddress()) HandleUDP(received);
+	while (UdpSocket.receive(UdpBuffer, 65536, received, UdpAddress, UdpPort) == sf::Socket::Done){
+		if (UdpAddress==TcpSocket.getRemoteAddress() && UdpPort==TcpSocket.getRemotePort()) HandleUDP(received);
+		else if (DirectUdp) HandleDirect(received, UdpAddress, UdpPort);
+	}
+	if (ConnectState>=RequestingUdp) UpdateReliable();
+	if (ConnectState==Established && DirectUdp) UpdateDirect();
 	if (ConnectState<Established && ConnectState>Disconnected){
 		switch (ConnectState){
 		case Connecting:
@@ -417,6 +570,10 @@ void RedRelayClient::ChannelBlast(const void* Data, std::size_t Size, uint8_t Su
 	if (ChannelID==65535) ChannelID=SelectedChannel;
 	if (Size > 65530) Size = 65530;
 	for (const Channel&i : Channels) if (i.ID==ChannelID){
+		if (ReliableSubchannels[Subchannel]){
+			SendReliable(Data, Size > 65490 ? 65490 : Size, ChannelID, 65535, Subchannel, Variant);
+			return;
+		}
 		UdpBuffer[0]=(2<<4)|(Variant&15);
 		UdpBuffer[1]=PeerID&255;
 		UdpBuffer[2]=(PeerID>>8)&255;
@@ -424,7 +581,7 @@ void RedRelayClient::ChannelBlast(const void* Data, std::size_t Size, uint8_t Su
 		UdpBuffer[4]=ChannelID&255;
 		UdpBuffer[5]=(ChannelID>>8)&255;
 		memcpy(&UdpBuffer[6], Data, Size);
-		UdpSocket.send(UdpBuffer, 6+Size, TcpSocket.getRemoteAddress(), TcpSocket.getRemotePort());
+		SendUdp(6+Size);
 		return;
 	}
 }
@@ -438,6 +595,10 @@ void RedRelayClient::PeerBlast(const void* Data, std::size_t Size, uint16_t Peer
 	if (ChannelID==65535) ChannelID=SelectedChannel;
 	if (Size > 65528) Size = 65528;
 	for (const Channel&i : Channels) if (i.ID==ChannelID) for (const Peer&j : i.Peers) if (j.ID==PeerID){
+		if (ReliableSubchannels[Subchannel]){
+			SendReliable(Data, Size > 65490 ? 65490 : Size, ChannelID, PeerID, Subchannel, Variant);
+			return;
+		}
 		UdpBuffer[0]=(3<<4)|(Variant&15);
 		UdpBuffer[1]=this->PeerID&255;
 		UdpBuffer[2]=(this->PeerID>>8)&255;
@@ -447,7 +608,7 @@ void RedRelayClient::PeerBlast(const void* Data, std::size_t Size, uint16_t Peer
 		UdpBuffer[6]=PeerID&255;
 		UdpBuffer[7]=(PeerID>>8)&255;
 		memcpy(&UdpBuffer[8], Data, Size);
-		UdpSocket.send(UdpBuffer, 8+Size, TcpSocket.getRemoteAddress(), TcpSocket.getRemotePort());
+		SendUdp(8+Size);
 		return;
 	}
 }
@@ -456,6 +617,35 @@ void RedRelayClient::PeerBlast(const Binary& Binary, uint16_t PeerID, uint8_t Su
 	PeerBlast(Binary.GetAddress(), Binary.GetSize(), PeerID, Subchannel, Variant, ChannelID);
 }
 
+void RedRelayClient::ServerSend(const void* Data, std::size_t Size, uint8_t Subchannel, uint8_t Variant){
+	if (ConnectState<RequestingUdp) return;
+	packet.Clear();
+	packet.SetType(1);
+	packet.SetVariant(Variant);
+	packet.AddByte(Subchannel);
+	packet.AddBinary(Data, Size);
+	SendTcp(packet.GetPacket(), packet.GetPacketSize());
+}
+
+void RedRelayClient::ServerSend(const Binary& Binary, uint8_t Subchannel, uint8_t Variant){
+	ServerSend(Binary.GetAddress(), Binary.GetSize(), Subchannel, Variant);
+}
+
+void RedRelayClient::ServerBlast(const void* Data, std::size_t Size, uint8_t Subchannel, uint8_t Variant){
+	if (ConnectState<RequestingUdp) return;
+	if (Size > 65503) Size = 65503;
+	UdpBuffer[0]=(1<<4)|(Variant&15);
+	UdpBuffer[1]=PeerID&255;
+	UdpBuffer[2]=(PeerID>>8)&255;
+	UdpBuffer[3]=Subchannel;
+	memcpy(&UdpBuffer[4], Data, Size);
+	UdpSocket.send(UdpBuffer, 4+Size, TcpSocket.getRemoteAddress(), TcpSocket.getRemotePort()); //Nobody else could reassemble fragments
+}
+
+void RedRelayClient::ServerBlast(const Binary& Binary, uint8_t Subchannel, uint8_t Variant){
+	ServerBlast(Binary.GetAddress(), Binary.GetSize(), Subchannel, Variant);
+}
+
 const Channel RedRelayClient::defchannel(0, "", 0);
 
 }
@@ -27,6 +27,9 @@
 #include <string>
 #include <cstring>
 #include <vector>
+#include <deque>
+#include <map>
+#include <bitset>
 #include <SFML/Network.hpp>
 
 #define REDRELAY_CLIENT_BUILD 10
@@ -109,7 +112,9 @@ public:
         ChannelBlast,       //A peer from of the channels you were in issued a blast (UDP) broadcast to the channel
         ChannelSent,        //A peer from of the channels you were in issued a send (TCP) broadcast to the channel
         PeerBlast,          //A peer from of the channels you were in blast you a private message
-        PeerSent            //A peer from of the channels you were in sent you a private message
+        PeerSent,           //A peer from of the channels you were in sent you a private message
+        ServerBlast,        //The server blast you a message
+        ServerSent          //The server sent you a message
     };
     std::string ErrorMessage() const;
     std::string DenyMessage() const;
@@ -218,10 +223,92 @@ private:
     sf::Clock TimerClock;
     float LastTimer=0;
 
+    //Reliable UDP subchannels, sequenced and acknowledged end to end through the server
+    struct ReliableMessage{
+        uint16_t Seq=0;
+        uint8_t Variant=0;
+        std::string Payload;
+        std::vector<uint16_t> Pending; //Receivers that didn't acknowledge it yet
+        float Sent=0; //Last transmission
+        uint8_t Tries=0;
+        uint16_t FragmentID=0; //Kept across retransmissions, so fragments delivered by earlier tries still count
+    };
+    struct ReliableReceiver{
+        uint16_t PeerID;
+        uint16_t Start; //First message of the stream the receiver gets
+        bool Synced; //Receiver acknowledged something, so it knows where the stream starts
+    };
+    struct OutStream{
+        uint16_t ChannelID=0, Target=65535; //Target is 65535 for streams broadcast to the channel
+        uint8_t Subchannel=0, Epoch=0;
+        uint16_t NextSeq=0;
+        std::vector<ReliableReceiver> Receivers;
+        std::deque<ReliableMessage> Unacked;
+    };
+    struct InStream{
+        uint16_t ChannelID=0, Sender=0;
+        uint8_t Subchannel=0, Epoch=0;
+        bool Private=false, AckPending=false;
+        uint16_t Expected=0;
+        std::map<uint16_t, Event> Buffered; //Arrived ahead of a missing message
+    };
+    struct RttEstimate{
+        uint16_t PeerID;
+        float Srtt, Rttvar, Rto; //Seconds
+    };
+    std::bitset<256> ReliableSubchannels;
+    std::vector<OutStream> OutStreams;
+    std::vector<InStream> InStreams;
+    std::vector<RttEstimate> Rtts;
+    uint8_t NextEpoch=0;
+
+    //Blasts that wouldn't fit a typical MTU are split into fragments, the server relays them one by one
+    struct PartialMessage{
+        uint16_t Sender, ID;
+        uint8_t Received;
+        float Deadline; //Dropped if the rest doesn't arrive in time
+        std::vector<std::string> Parts;
+    };
+    std::vector<PartialMessage> Fragments;
+    uint16_t NextFragmentID=0;
+
+    //Peers introduced by the server talk straight to each other, the relay stays the fallback
+    struct DirectPath{
+        uint16_t PeerID;
+        sf::IpAddress Address;
+        uint16_t Port;
+        bool Alive; //Punches went through both ways
+        uint8_t Punches; //Left before waiting for the next introduction
+        float NextPunch, LastHeard, LastSent;
+    };
+    bool DirectUdp=false;
+    std::vector<DirectPath> DirectPaths;
+    float NextIntroduction=0;
+
     void SendTcp(const void* data, std::size_t size);
     void HandleTCP(const char* Msg, std::size_t Size, uint8_t Type);
     void HandleUDP(std::size_t received);
+    void HandleFragment(std::size_t received);
+    void SendUdp(std::size_t Size); //Sends a message built in UdpBuffer
+    void SendUdp(std::size_t Size, uint16_t FragmentID);
+    void SendFragments(const std::string& Message, char* Fragment, std::size_t Header, const sf::IpAddress& Address, uint16_t Port);
+    void SendDirect(DirectPath& Path, const std::string& Message, uint16_t FragmentID);
     float Timer();
+    void SendReliable(const void* Data, std::size_t Size, uint16_t ChannelID, uint16_t Target, uint8_t Subchannel, uint8_t Variant);
+    void TransmitReliable(const OutStream& Stream, const ReliableMessage& Message, uint16_t Receiver); //65535 broadcasts to the channel
+    void HandleReliable(std::size_t received);
+    void HandleReliableAck(std::size_t received);
+    void UpdateReliable(); //Acknowledgements and retransmissions, once per Update()
+    void ResetReliable(uint16_t ChannelID, uint16_t PeerID); //PeerID 65535 for the whole channel
+    RttEstimate& RttOf(uint16_t PeerID);
+    void HandleIntroduction(std::size_t received);
+    void HandleDirect(std::size_t received, const sf::IpAddress& Address, uint16_t Port); //Datagrams from anyone but the server
+    void UpdateDirect(); //Introductions, punches and keepalives, once per Update()
+    void SendPunch(DirectPath& Path, uint8_t Variant);
+    bool DirectRoute(uint16_t ChannelID, uint16_t Target, std::vector<DirectPath*>& Paths); //False if any receiver needs the relay
+    bool SharesChannel(uint16_t PeerID, uint16_t ChannelID=65535) const;
+    void PrunePaths(); //Forgets peers no longer in any of our channels
+    DirectPath* PathOf(uint16_t PeerID);
 public:
     enum ConnectState{
         Disconnected,   //Not connected to server
@@ -259,6 +346,13 @@ public:
     void ChannelBlast(const Binary& Binary, uint8_t Subchannel, uint8_t Variant=2, uint16_t ChannelID=65535);
     void PeerBlast(const void* Data, std::size_t Size, uint16_t PeerID, uint8_t Subchannel, uint8_t Variant=2, uint16_t ChannelID=65535);
     void PeerBlast(const Binary& Binary, uint16_t PeerID, uint8_t Subchannel, uint8_t Variant=2, uint16_t ChannelID=65535);
+    void ServerSend(const void* Data, std::size_t Size, uint8_t Subchannel, uint8_t Variant=2); //Handled by the application hosting the server
+    void ServerSend(const Binary& Binary, uint8_t Subchannel, uint8_t Variant=2);
+    void ServerBlast(const void* Data, std::size_t Size, uint8_t Subchannel, uint8_t Variant=2); //Never fragmented, up to 65503 bytes
+    void ServerBlast(const Binary& Binary, uint8_t Subchannel, uint8_t Variant=2);
+    void SetReliable(uint8_t Subchannel, bool Flag); //Blasts on the subchannel are acknowledged, retransmitted and delivered in order
+    void SetDirectUdp(bool Flag); //Blasts go straight to peers once the server introduced them and NAT let punches through
+    bool IsDirect(uint16_t PeerID) const;
 };
 
 }
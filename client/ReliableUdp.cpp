@@ -0,0 +1,258 @@
+////////////////////////////////////////////////////////////
+//
+// RedRelay - a Lacewing Relay protocol reimplementation
+// Copyright (c) 2019 LekKit (LekKit#4400 in Discord)
+//
+// This software is provided 'as-is', without any express or implied
+// warranty. In no event will the authors be held liable for any damages
+// arising from the use of this software.
+//
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+//
+// 1. The origin of this software must not be misrepresented; you must not
+//   claim that you wrote the original software. If you use this software
+//   in a product, an acknowledgment in the product documentation would be
+//   appreciated but is not required.
+// 2. Altered source versions must be plainly marked as such, and must not be
+//   misrepresented as being the original software.
+// 3. This notice may not be removed or altered from any source distribution.
+//
+////////////////////////////////////////////////////////////
+
+
+#include <algorithm>
+#include "RedRelayClient.hpp"
+
+namespace rc{
+
+//Reliable blasts travel as type 13, acknowledgements as type 14, both relayed by the server without keeping any state
+//Each stream (channel, subchannel and a single peer or the whole channel) has its own sequence numbers,
+//so a lost message only holds back later messages of the same stream
+static const uint16_t ReliableWindow = 1024; //Messages in flight per stream, also how far ahead a receiver buffers
+static const uint8_t ReliableTries = 12; //Transmissions before a receiver is given up on
+static const float MinRto = 0.03, MaxRto = 2; //Seconds
+static const uint8_t PrivateFlag = 1, SynFlag = 2; //SynFlag carries the first sequence number the receiver gets
+
+void RedRelayClient::SetReliable(uint8_t Subchannel, bool Flag){
+	ReliableSubchannels[Subchannel] = Flag;
+}
+
+RedRelayClient::RttEstimate& RedRelayClient::RttOf(uint16_t PeerID){
+	for (RttEstimate& i : Rtts) if (i.PeerID == PeerID) return i;
+	RttEstimate Rtt = {PeerID, 0, 0, 0.2};
+	Rtts.push_back(Rtt);
+	return Rtts.back();
+}
+
+void RedRelayClient::SendReliable(const void* Data, std::size_t Size, uint16_t ChannelID, uint16_t Target, uint8_t Subchannel, uint8_t Variant){
+	OutStream* Stream = NULL;
+	for (OutStream& i : OutStreams) if (i.ChannelID == ChannelID && i.Target == Target && i.Subchannel == Subchannel) Stream = &i;
+	if (Stream == NULL){
+		OutStream New;
+		New.ChannelID = ChannelID;
+		New.Target = Target;
+		New.Subchannel = Subchannel;
+		New.Epoch = NextEpoch++; //Receivers still holding an older stream of ours start over
+		New.NextSeq = 0;
+		OutStreams.push_back(New);
+		Stream = &OutStreams.back();
+	}
+	if (Stream->Unacked.size() >= ReliableWindow){
+		nextevents.push_back(Event(Event::Error, "Reliable send error - too many unacknowledged messages"));
+		return;
+	}
+	ReliableMessage Message;
+	Message.Seq = Stream->NextSeq;
+	Message.Variant = Variant;
+	Message.Payload.assign((const char*)Data, Size);
+	Message.Sent = Timer();
+	Message.Tries = 1;
+	Message.FragmentID = NextFragmentID;
+	NextFragmentID += 2; //Second one for the variant carrying the stream start
+	for (const Channel& i : Channels) if (i.ID == ChannelID) for (const Peer& j : i.Peers) if (Target == 65535 || j.ID == Target){
+		bool known = false;
+		for (const ReliableReceiver& k : Stream->Receivers) if (k.PeerID == j.ID) known = true;
+		if (!known){
+			ReliableReceiver Receiver = {j.ID, Message.Seq, false};
+			Stream->Receivers.push_back(Receiver);
+		}
+		Message.Pending.push_back(j.ID);
+	}
+	if (Message.Pending.empty()) return;
+	Stream->NextSeq++;
+	if (Target == 65535) TransmitReliable(*Stream, Message, 65535);
+	for (const ReliableReceiver& i : Stream->Receivers) //Receivers that don't know where the stream starts yet get a copy telling them
+		if ((Target != 65535 || !i.Synced) && std::find(Message.Pending.begin(), Message.Pending.end(), i.PeerID) != Message.Pending.end())
+			TransmitReliable(*Stream, Message, i.PeerID);
+	Stream->Unacked.push_back(Message);
+}
+
+void RedRelayClient::TransmitReliable(const OutStream& Stream, const ReliableMessage& Message, uint16_t Receiver){
+	std::size_t header = 12;
+	UdpBuffer[0]=(13<<4)|(Message.Variant&15);
+	UdpBuffer[1]=PeerID&255;
+	UdpBuffer[2]=(PeerID>>8)&255;
+	UdpBuffer[3]=Stream.Subchannel;
+	UdpBuffer[4]=Stream.ChannelID&255;
+	UdpBuffer[5]=(Stream.ChannelID>>8)&255;
+	UdpBuffer[6]=Receiver&255;
+	UdpBuffer[7]=(Receiver>>8)&255;
+	UdpBuffer[8]=Stream.Target != 65535 ? PrivateFlag : 0;
+	UdpBuffer[9]=Stream.Epoch;
+	UdpBuffer[10]=Message.Seq&255;
+	UdpBuffer[11]=(Message.Seq>>8)&255;
+	if (Receiver != 65535) for (const ReliableReceiver& i : Stream.Receivers) if (i.PeerID == Receiver && !i.Synced){
+		UdpBuffer[8]|=SynFlag;
+		UdpBuffer[12]=i.Start&255;
+		UdpBuffer[13]=(i.Start>>8)&255;
+		header = 14;
+	}
+	memcpy(&UdpBuffer[header], Message.Payload.data(), Message.Payload.size());
+	SendUdp(header+Message.Payload.size(), Message.FragmentID+(header == 14));
+}
+
+void RedRelayClient::HandleReliable(std::size_t received){
+	if (received<10) return;
+	uint8_t flags = UdpBuffer[6], epoch = UdpBuffer[7];
+	uint16_t channel = (uint8_t)UdpBuffer[2]|(uint8_t)UdpBuffer[3]<<8, sender = (uint8_t)UdpBuffer[4]|(uint8_t)UdpBuffer[5]<<8;
+	uint16_t seq = (uint8_t)UdpBuffer[8]|(uint8_t)UdpBuffer[9]<<8, start = 0;
+	std::size_t header = 10;
+	if (flags&SynFlag){
+		if (received<12) return;
+		start = (uint8_t)UdpBuffer[10]|(uint8_t)UdpBuffer[11]<<8;
+		header = 12;
+	}
+	bool known = false;
+	for (const Channel& i : Channels) if (i.ID == channel) for (const Peer& j : i.Peers) if (j.ID == sender) known = true;
+	if (!known) return; //Sender left the channel meanwhile
+	InStream* Stream = NULL;
+	for (InStream& i : InStreams) if (i.ChannelID == channel && i.Sender == sender && i.Subchannel == (uint8_t)UdpBuffer[1] && i.Private == ((flags&PrivateFlag) != 0)) Stream = &i;
+	if (Stream == NULL || Stream->Epoch != epoch){
+		if ((flags&SynFlag) == 0) return; //Can't tell where the stream starts, the sender repeats it with SynFlag
+		if (Stream == NULL){
+			InStream New;
+			New.ChannelID = channel;
+			New.Sender = sender;
+			New.Subchannel = UdpBuffer[1];
+			New.Private = (flags&PrivateFlag) != 0;
+			InStreams.push_back(New);
+			Stream = &InStreams.back();
+		}
+		Stream->Epoch = epoch;
+		Stream->Expected = start;
+		Stream->Buffered.clear();
+	}
+	uint16_t skip = Stream->Expected; //A later start within the epoch means the sender gave up on what's missing before it
+	if ((flags&SynFlag) != 0 && (int16_t)(start-skip) > 0 && (int16_t)(start-skip) < ReliableWindow) skip = start;
+	Stream->AckPending = true; //Duplicates are acknowledged too, the previous acknowledgement may have been lost
+	int16_t ahead = seq-Stream->Expected;
+	if (ahead >= 0 && ahead < ReliableWindow && !Stream->Buffered.count(seq))
+		Stream->Buffered[seq] = Event(Stream->Private ? Event::PeerBlast : Event::ChannelBlast, std::string(&UdpBuffer[header], received-header), sender, channel, (uint8_t)UdpBuffer[1]|((uint8_t)UdpBuffer[0]&15)<<8);
+	for (std::map<uint16_t, Event>::iterator it = Stream->Buffered.find(Stream->Expected); it != Stream->Buffered.end() || (int16_t)(skip-Stream->Expected) > 0; it = Stream->Buffered.find(Stream->Expected)){
+		if (it != Stream->Buffered.end()){
+			Events.push_back(it->second);
+			Stream->Buffered.erase(it);
+		}
+		Stream->Expected++;
+	}
+}
+
+void RedRelayClient::HandleReliableAck(std::size_t received){
+	if (received<14) return;
+	uint8_t flags = UdpBuffer[6], epoch = UdpBuffer[7];
+	uint16_t channel = (uint8_t)UdpBuffer[2]|(uint8_t)UdpBuffer[3]<<8, acker = (uint8_t)UdpBuffer[4]|(uint8_t)UdpBuffer[5]<<8;
+	uint16_t next = (uint8_t)UdpBuffer[8]|(uint8_t)UdpBuffer[9]<<8;
+	uint32_t sack = (uint8_t)UdpBuffer[10]|(uint8_t)UdpBuffer[11]<<8|(uint8_t)UdpBuffer[12]<<16|(uint32_t)(uint8_t)UdpBuffer[13]<<24;
+	uint16_t target = (flags&PrivateFlag) ? acker : 65535;
+	for (OutStream& Stream : OutStreams) if (Stream.ChannelID == channel && Stream.Target == target && Stream.Subchannel == (uint8_t)UdpBuffer[1]){
+		if (Stream.Epoch != epoch) return;
+		for (ReliableReceiver& i : Stream.Receivers) if (i.PeerID == acker && (int16_t)(next-i.Start) >= 0) i.Synced = true; //Older acknowledgements don't prove it knows the start
+		float now = Timer();
+		for (ReliableMessage& Message : Stream.Unacked){
+			int16_t ahead = Message.Seq-next; //Everything before next arrived, then sack has a bit for each of the following 32
+			if (ahead >= 0 && (ahead == 0 || ahead > 32 || ((sack>>(ahead-1))&1) == 0)) continue;
+			std::vector<uint16_t>::iterator it = std::find(Message.Pending.begin(), Message.Pending.end(), acker);
+			if (it == Message.Pending.end()) continue;
+			Message.Pending.erase(it);
+			if (Message.Tries == 1){ //Retransmitted messages give ambiguous samples
+				RttEstimate& Rtt = RttOf(acker);
+				float sample = now-Message.Sent;
+				if (Rtt.Srtt == 0 && Rtt.Rttvar == 0){
+					Rtt.Srtt = sample;
+					Rtt.Rttvar = sample/2;
+				} else {
+					Rtt.Rttvar = 0.75*Rtt.Rttvar+0.25*(Rtt.Srtt > sample ? Rtt.Srtt-sample : sample-Rtt.Srtt);
+					Rtt.Srtt = 0.875*Rtt.Srtt+0.125*sample;
+				}
+				Rtt.Rto = std::min(std::max(Rtt.Srtt+4*Rtt.Rttvar, MinRto), MaxRto);
+			}
+		}
+		while (!Stream.Unacked.empty() && Stream.Unacked.front().Pending.empty()) Stream.Unacked.pop_front();
+		return;
+	}
+}
+
+void RedRelayClient::UpdateReliable(){
+	for (InStream& Stream : InStreams) if (Stream.AckPending){ //One acknowledgement per stream and update, however many messages arrived
+		uint32_t sack = 0;
+		for (uint8_t i=0; i<32; ++i) if (Stream.Buffered.count(Stream.Expected+1+i)) sack |= 1u<<i;
+		UdpBuffer[0]=14<<4;
+		UdpBuffer[1]=PeerID&255;
+		UdpBuffer[2]=(PeerID>>8)&255;
+		UdpBuffer[3]=Stream.Subchannel;
+		UdpBuffer[4]=Stream.ChannelID&255;
+		UdpBuffer[5]=(Stream.ChannelID>>8)&255;
+		UdpBuffer[6]=Stream.Sender&255;
+		UdpBuffer[7]=(Stream.Sender>>8)&255;
+		UdpBuffer[8]=Stream.Private ? PrivateFlag : 0;
+		UdpBuffer[9]=Stream.Epoch;
+		UdpBuffer[10]=Stream.Expected&255;
+		UdpBuffer[11]=(Stream.Expected>>8)&255;
+		for (uint8_t i=0; i<4; ++i) UdpBuffer[12+i]=(sack>>(i*8))&255;
+		SendUdp(16);
+		Stream.AckPending = false;
+	}
+	float now = Timer();
+	for (OutStream& Stream : OutStreams){
+		for (ReliableMessage& Message : Stream.Unacked){
+			if (Message.Pending.empty()) continue;
+			float rto = 0;
+			for (uint16_t i : Message.Pending) rto = std::max(rto, RttOf(i).Rto);
+			if (now < Message.Sent+std::min(rto*(1<<std::min(Message.Tries-1, 6)), MaxRto)) continue; //Exponential backoff
+			if (Message.Tries >= ReliableTries){
+				for (uint16_t i : Message.Pending){
+					Events.push_back(Event(Event::Error, "Reliable send error - peer "+std::to_string(i)+" stopped acknowledging messages"));
+					for (ReliableReceiver& j : Stream.Receivers) if (j.PeerID == i){ //Later messages tell it to skip this one
+						if ((int16_t)(Message.Seq+1-j.Start) > 0) j.Start = Message.Seq+1;
+						j.Synced = false;
+					}
+				}
+				Message.Pending.clear();
+				continue;
+			}
+			for (uint16_t i : Message.Pending) TransmitReliable(Stream, Message, i);
+			Message.Tries++;
+			Message.Sent = now;
+		}
+		while (!Stream.Unacked.empty() && Stream.Unacked.front().Pending.empty()) Stream.Unacked.pop_front();
+	}
+}
+
+void RedRelayClient::ResetReliable(uint16_t ChannelID, uint16_t PeerID){
+	for (uint32_t i=0; i<InStreams.size(); ++i) if (InStreams[i].ChannelID == ChannelID && (PeerID == 65535 || InStreams[i].Sender == PeerID))
+		InStreams.erase(InStreams.begin()+i--);
+	for (uint32_t i=0; i<OutStreams.size(); ++i) if (OutStreams[i].ChannelID == ChannelID){
+		OutStream& Stream = OutStreams[i];
+		if (PeerID == 65535 || Stream.Target == PeerID){
+			OutStreams.erase(OutStreams.begin()+i--);
+			continue;
+		}
+		for (uint32_t j=0; j<Stream.Receivers.size(); ++j) if (Stream.Receivers[j].PeerID == PeerID) Stream.Receivers.erase(Stream.Receivers.begin()+j--);
+		for (ReliableMessage& Message : Stream.Unacked) Message.Pending.erase(std::remove(Message.Pending.begin(), Message.Pending.end(), PeerID), Message.Pending.end());
+		while (!Stream.Unacked.empty() && Stream.Unacked.front().Pending.empty()) Stream.Unacked.pop_front();
+	}
+}
+
+}
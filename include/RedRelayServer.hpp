@@ -28,17 +28,26 @@
 
 #include <ctime>
 #include <unordered_map>
+#include <unordered_set>
 #include <string>
 #include <vector>
+#include <bitset>
+#include <deque>
+#include <memory>
+#include <atomic>
+#include <thread>
+#include <fstream>
 #include "IDPool.hpp"
+#include "TimingWheel.hpp"
 #include <SFML/Network.hpp>
 
 #ifdef REDRELAY_EPOLL
 #include "EpollSelector.hpp"
 #endif
 
-#ifdef REDRELAY_MULTITHREAD
-#include <thread>
+#if defined(REDRELAY_EPOLL) && defined(__linux__)
+#define REDRELAY_MMSG
+#include "UdpBatch.hpp"
 #endif
 
 namespace rs{
@@ -64,44 +73,287 @@ public:
     void Clear();
 };
 
+typedef std::shared_ptr<const std::vector<char>> SharedBuffer; //Message referenced by several send queues
+
+class SendQueue{ //Outbound data as a list of segments, either copied or shared with other queues
+private:
+    struct Segment{
+        SharedBuffer Shared;
+        std::vector<char> Owned; //Used when Shared is empty
+        std::size_t Begin=0;
+        bool Sealed=false; //Handed to an asynchronous send, must not move
+    };
+    std::deque<Segment> segments;
+    std::size_t size=0;
+public:
+    bool Push(const char* Data, std::size_t Size, std::size_t Limit);
+    bool Push(const SharedBuffer& Data, std::size_t Offset, std::size_t Limit); //Only a reference is queued
+    const char* Front(std::size_t& Size) const; //Returns the first contiguous chunk of queued data
+    std::size_t Gather(const char** Data, std::size_t* Sizes, std::size_t Count) const; //Fills up to Count chunks for a vectored send
+    void Pop(std::size_t Size);
+    void Seal(); //Later copies start a new segment, so gathered data stays in place
+    void Move(SendQueue& To, std::size_t Size); //Appends the first Size bytes to another queue, shared data stays shared
+    std::size_t Size() const;
+    bool Empty() const;
+    void Clear();
+};
+
+class BufferPool{ //Receive buffers in power of two size classes, shared between reactors
+public:
+    static const uint32_t MinSize = 4096; //Held by every peer, bigger buffers are returned once drained
+    ~BufferPool();
+    char* Acquire(uint32_t& Size); //Rounds Size up to its class
+    void Release(char* Buffer, uint32_t Size);
+private:
+    static const uint8_t Classes = 9; //Up to 1 MB, larger buffers aren't cached
+    std::vector<char*> Free[Classes];
+    static uint8_t SizeClass(uint32_t Size); //Returns Classes for sizes that aren't cached
+    sf::Mutex Mutex;
+};
+
+class Metrics{ //Runtime statistics, updated from any thread with relaxed atomics
+public:
+    enum Event{
+        Connects, Disconnects, ConnectDenies, NameDenies, ChannelDenies,
+        PingTimeouts, HandshakeTimeouts, SlowPeerDrops, OversizedDrops, ConflatedBlasts,
+        FloodDrops, FloodThrottles, FloodDisconnects, PacedDrops, Events
+    };
+    enum Gauge{
+        Connections, Peers, Channels, QueuedBytes, PacedBytes, PendingDecisions, Gauges
+    };
+    enum Histogram{
+        LoopTime,   //Handling of a single wakeup of an event loop
+        TcpHandler, //Handling of a single TCP message
+        UdpHandler, //Handling of a single datagram
+        Histograms
+    };
+    static uint64_t Now(); //Nanoseconds, for measuring durations
+    void TcpIn(uint8_t Type, std::size_t Size);
+    void TcpOut(uint8_t Type, std::size_t Size);
+    void UdpIn(uint8_t Type, std::size_t Size);
+    void UdpOut(uint8_t Type, std::size_t Size);
+    void Count(Event Event);
+    void Adjust(Gauge Gauge, int64_t Delta);
+    void ResetGauges();
+    void Observe(Histogram Histogram, uint64_t Nanoseconds);
+    std::string Export() const; //Prometheus text exposition format
+private:
+    enum Kind{ //Traffic breakdown by message type
+        Control, ChannelMessage, PeerMessage, Kinds
+    };
+    static const uint8_t Shards = 16; //Threads are spread over shards so they rarely touch the same cache lines
+    static const uint8_t Buckets = 22; //Powers of two from 1 us to about 1 s, the last one is +Inf
+    struct Shard{
+        std::atomic<uint64_t> MessagesIn[2][Kinds], BytesIn[2][Kinds], MessagesOut[2][Kinds], BytesOut[2][Kinds]; //Indexed by TCP/UDP first
+        std::atomic<uint64_t> EventCount[Events];
+        std::atomic<int64_t> GaugeValue[Gauges];
+        std::atomic<uint64_t> Bucket[Histograms][Buckets], Sum[Histograms];
+        char Padding[64];
+    };
+    Shard Data[Shards] = {};
+    Shard& Local();
+    static Kind KindOf(uint8_t Type);
+    void Traffic(std::atomic<uint64_t> (&Messages)[2][Kinds], std::atomic<uint64_t> (&Bytes)[2][Kinds], uint8_t Protocol, uint8_t Type, std::size_t Size);
+};
+
+class Logger{ //Lines are queued without locking and written in batches by a background thread
+public:
+    enum Level{
+        Error, Warning, Info, Debug
+    };
+    Logger();
+    ~Logger();
+    void Push(uint8_t Color, std::string& Message); //Takes the contents of Message, the level is filtered by the caller
+    void Flush(); //Waits until every queued line is written
+    void SetLevel(uint8_t Level);
+    uint8_t GetLevel() const;
+    void SetConsole(bool Flag);
+    void SetFile(const std::string& Path); //Empty path closes the file
+    void SetRotation(uint32_t Size, uint8_t Count); //Rotates the file once it grows over Size bytes, 0 disables
+    void SetQueueLimit(uint32_t Lines);
+    void SetDropOnOverflow(bool Flag); //Otherwise a full queue blocks the caller
+    uint64_t Dropped() const;
+private:
+    struct Entry{
+        std::atomic<Entry*> next;
+        time_t Time=0;
+        uint8_t Color=15;
+        std::string Message;
+    };
+    std::atomic<Entry*> head; //Last pushed line, shared by producers
+    Entry* tail; //Dummy node preceding the next line, used by the writer only
+    std::atomic<uint32_t> pending;
+    std::atomic<uint64_t> pushed, written, dropped;
+    std::atomic<bool> running;
+    uint8_t level=Info;
+    uint32_t queueLimit=65536;
+    bool dropOnOverflow=true;
+
+    sf::Mutex Mutex; //Guards the sinks below
+    bool console=true;
+    std::string path;
+    std::ofstream file;
+    uint64_t fileSize=0, reported=0;
+    uint32_t rotateSize=0;
+    uint8_t rotateCount=0;
+    std::thread writer;
+
+    void Run();
+    bool WriteBatch();
+    void Rotate();
+};
+
+struct RateLimit{ //Per peer and second, 0 disables
+    uint32_t Messages=0, Bytes=0;
+};
+
+class TokenBuckets{ //Messages and bytes buckets holding up to a second of the limit, a big message may leave them in debt
+friend class RedRelayServer;
+private:
+    double Messages=0, Bytes=0;
+    uint64_t Updated=0; //Milliseconds
+    bool Ready(const RateLimit& Limit, uint64_t Now, double Window=1); //Refills up to Window seconds of the limit and checks for tokens left
+    void Take(std::size_t Size);
+    uint64_t Wait(const RateLimit& Limit) const; //Milliseconds until Ready passes again
+};
+
+enum SendLaneID{ //Outbound TCP classes, scheduled by deficit round robin so bulk data can't hold back the rest
+                 //Control frames may overtake laned messages, except leaves and peer list changes which keep their order
+    ControlLane,  //Responses, peer list changes and pings
+    PriorityLane, //Messages on subchannels with a priority
+    BulkLane,     //Other messages
+    LaneCount
+};
+
+struct SendLane{ //Whole frames waiting for their turn
+    SendQueue Data;
+    std::deque<std::size_t> Frames; //Size of each frame in Data
+    std::size_t Deficit=0;
+};
+
+struct ParkedRequest{ //Connect, name, join, leave or list request waiting for the host to complete its ticket
+    uint32_t Ticket;
+    uint16_t ID; //Connection for connect requests, peer otherwise
+    uint32_t Serial; //0 for connect requests
+    uint8_t Type;
+    std::vector<char> Message; //Handled again once decided, whatever changed meanwhile is checked anew
+};
+
+struct Decision{
+    uint32_t Ticket=0;
+    bool Accept=false;
+    std::string DenyReason;
+};
+
+struct ForwardedFrame{ //Large message passed on to its receivers while it arrives
+    std::vector<uint16_t> Receivers;
+    std::vector<uint32_t> Serials; //Receivers gone meanwhile are skipped
+    uint32_t Left=0; //Payload bytes still to come from the sender, 0 when nothing is forwarded
+};
+
+struct RelayTarget{ //Receiver of a channel or peer message, taken from the membership under the lock
+    uint16_t PeerID;
+    uint32_t Serial;
+    uint8_t ReactorID;
+};
+
+struct QueuedDatagram{ //Waiting for the egress bucket of its receiver
+    std::vector<char> Data;
+    uint8_t Priority;
+};
+
+struct IngressCounters{ //Traffic received from a peer and what flood protection did with it
+    uint64_t TcpMessages=0, TcpBytes=0, UdpMessages=0, UdpBytes=0; //Handled
+    uint64_t DroppedMessages=0, DroppedBytes=0;
+    uint32_t Throttles=0; //Times reading was paused
+};
+
 class Peer{
 friend class RedRelayServer;
 private:
     static sf::TcpSocket defsocket;
 
-    char buffer[65536];
+    char* buffer=NULL;
+    uint32_t buffsize=0;
     uint32_t packetsize=0;
     uint32_t buffbegin=0;
     sf::TcpSocket* Socket=&defsocket;
     uint32_t IpAddr=0;
     uint16_t UdpPort=0;
     uint8_t PingTries=0;
+    uint64_t LastSeen=0; //Milliseconds, when the last message from the peer arrived
+    uint8_t ReactorID=0; //Reactor thread owning the socket
+    uint32_t Serial=0; //Tells apart peers reusing the same ID
+    std::atomic<bool> Dropping{false}; //Peer is scheduled to be dropped at the end of loop iteration, set under StateMutex but read without it
+    bool Backlogged=false; //Read budget ran out with data left in the socket
+    bool Sending=false; //Queued data waits for the end of loop iteration (coalesced writes) or is in flight (io_uring)
+    bool Blocked=false; //Socket is full, waiting to become writable
+    bool DirectUdp=false; //Asked to be introduced to other peers, so its address may be given out
+    bool Throttled=false; //Reads are paused until the ingress buckets refill
+    uint64_t ResumeAt=0; //Milliseconds
+    TokenBuckets TcpIngress, UdpIngress;
+    std::unordered_map<uint8_t, TokenBuckets> SubchannelIngress; //Only subchannels with a limit
+    IngressCounters Ingress;
+    uint32_t EgressRate=0; //UDP bytes per second towards the peer, 0 uses the server default
+    TokenBuckets UdpEgress;
+    std::deque<QueuedDatagram> UdpQueue; //Oldest first
+    std::size_t UdpQueued=0; //Bytes in UdpQueue
+    bool Paced=false; //Listed for pacing
+    std::size_t Submitted=0; //Bytes offered to the kernel by the send in flight (io_uring)
+    SendQueue Outgoing; //Stream being written, whole frames are moved here from the lanes
+    SendLane Lanes[LaneCount];
+    std::size_t Laned=0; //Bytes waiting in the lanes
+    bool Streamed=false; //Receiving a forwarded message, other frames wait in the lanes until it ends
+    ForwardedFrame Forward;
     std::string Name;
     std::vector<uint16_t> Channels; //Channels used by peer, represented as ID
+    std::unordered_set<uint16_t> Joined; //Same channels, for constant time lookups
 
     uint32_t MessageSize() const;
     uint8_t SizeOffset() const;
     bool MessageReady() const;
     void EraseChannel(uint16_t ChannelID);
     void AddChannel(uint16_t ChannelID);
+    std::size_t Queued() const; //Outbound bytes not written yet
+    void ScheduleLanes(); //Refills the stream from the lanes
+    void PromoteLanes(); //Appends the data lanes to the control lane
+    void ClearOutgoing();
 
 public:
     std::string GetName() const;
     const std::vector<uint16_t>& GetJoinedChannels() const;
     sf::IpAddress GetIP() const;
     bool IsInChannel(uint16_t ChannelID) const;
+    const IngressCounters& GetIngress() const;
 };
 
 class Channel{
 friend class RedRelayServer;
 private:
     std::string Name;
-    std::vector<uint16_t> Peers; //Peers in channel, represented as ID
+    std::vector<uint16_t> Peers; //Peers in channel, represented as ID, in join order
+    std::unordered_set<uint16_t> Members; //Same peers, for constant time lookups
+    std::unordered_map<std::string, uint16_t> Names; //Peer names in channel, to check collisions
     bool HideFromList=false, CloseOnLeave=false; //Channel flags
     uint16_t Master; //Channel master ID
+    uint32_t Ticket=0; //Creator's join is waiting for this decision, the channel is hidden and empty until then
+    uint16_t TickRate=0; //Blasts are aggregated and sent this many times per second, 0 relays them right away
+    uint64_t NextTick=0; //Milliseconds
+    std::vector<char> Blasts; //Aggregated datagrams of the current tick, back to back
+    std::vector<uint32_t> Datagrams; //Offset of each datagram in Blasts
+    std::vector<uint16_t> Owners; //Only sender with blasts in each datagram, 65535 for several
+    std::vector<uint8_t> Priorities; //Highest subchannel priority in each datagram
+    std::bitset<256> Conflated; //Subchannels where only the newest blast of each sender matters
+    std::vector<std::vector<char>> Slots; //Newest blast per sender and conflated subchannel, reused between flushes
+    std::unordered_map<uint32_t, uint32_t> SlotIndex; //Sender<<8|Subchannel to index in Slots
+    uint32_t SlotsUsed=0;
+    std::size_t SlotBytes=0;
     
-    void ErasePeer(uint16_t PeerID);
-    void AddPeer(uint16_t PeerID);
+    void ErasePeer(uint16_t PeerID, const std::string& Name);
+    void AddPeer(uint16_t PeerID, const std::string& Name);
+    void RenamePeer(uint16_t PeerID, const std::string& OldName, const std::string& NewName);
+    void ClearSlots();
+    void PurgeBlasts(uint16_t PeerID); //Drops blasts of a leaving peer held for the next flush
 public:
     std::string GetName() const;
     bool IsHidden() const;
@@ -109,7 +361,10 @@ public:
     const std::vector<uint16_t>& GetPeerList() const;
     uint16_t GetPeersCount() const;
     uint16_t GetMasterID() const;
+    uint16_t GetTickRate() const;
+    bool IsConflated(uint8_t Subchannel) const;
     bool HasPeer(uint16_t PeerID) const;
+    uint16_t GetPeerByName(const std::string& Name) const; //Returns 65535 if there's no such peer
 };
 
 class Connection{ //Used for clients before handshake
@@ -118,8 +373,57 @@ private:
     sf::TcpSocket* Socket=NULL;
     std::size_t received=0;
     char buffer[14];
+    uint32_t Ticket=0; //Connect decision is deferred
+    uint16_t PeerID=65535; //Held for the connection until it's decided
+};
+
+#ifdef REDRELAY_EPOLL
+class ReactorMessage{ //Work handed over to the reactor owning a peer
+public:
+    enum Types{
+        Adopt, //Peer was assigned to the reactor, start polling its socket
+        Data   //Outbound data for the peer
+    };
+    std::atomic<ReactorMessage*> next;
+    uint8_t Type=Data;
+    uint16_t PeerID=0;
+    uint32_t Serial=0;
+    SharedBuffer Buffer;
+};
+
+class MessageQueue{ //Lock-free multi-producer single-consumer queue
+private:
+    std::atomic<ReactorMessage*> head; //Last pushed message, shared by producers
+    ReactorMessage* tail; //Dummy node preceding the next message, used by consumer only
+public:
+    MessageQueue();
+    ~MessageQueue();
+    void Push(ReactorMessage* Message);
+    bool Pop(ReactorMessage& Message);
 };
 
+class Reactor{ //Event loop owning a share of peers, reactor 0 is the loop in Start()
+friend class RedRelayServer;
+private:
+    EpollSelector* Selector;
+    bool OwnsSelector;
+    MessageQueue Inbox;
+    sf::UdpSocket Waker; //Datagrams sent here interrupt Selector.wait()
+    uint16_t WakerPort=0;
+    std::atomic<bool> Signaled;
+    std::vector<uint32_t> Owned; //Serial of every owned peer, indexed by peer ID
+    std::vector<uint16_t> Backlog; //Peers to read again, edge-triggered sockets won't report them twice
+    std::vector<uint16_t> Unsent; //Peers with data to write at the end of loop iteration
+    std::thread Thread;
+
+    Reactor(EpollSelector* MainSelector=NULL);
+    ~Reactor();
+    void Post(ReactorMessage* Message);
+    void Wake();
+    void Drain();
+};
+#endif
+
 class RedRelayServer{
 private:
     struct callstruct{
@@ -139,24 +443,52 @@ private:
 
     //Server configuration
     uint16_t ConnectionsLimit, PeersLimit, ChannelsLimit, PeerChannelsLimit;
-    bool GiveNewMaster, LoggingEnabled;
-    uint8_t PingInterval;
-    std::string WelcomeMessage;
-    #ifdef REDRELAY_MULTITHREAD
+    uint32_t SendQueueLimit, MaxMessageSize;
+    uint8_t WorkerThreads;
+    bool GiveNewMaster, LoggingEnabled, DisconnectSlowPeers, CoalesceWrites, PeerIntroductions;
+    uint8_t PingInterval, HandshakeTimeout;
+    uint16_t MetricsPort, BlastTickRate;
+    std::bitset<256> ConflatedSubchannels;
+    RateLimit TcpLimit, UdpLimit;
+    std::vector<RateLimit> SubchannelLimits; //Indexed by subchannel
+    uint8_t FloodAction;
+    uint32_t UdpEgressRate, UdpQueueLimit;
+    uint32_t CutThroughSize;
+    std::vector<uint8_t> SubchannelPriorities; //Indexed by subchannel
+    std::string WelcomeMessage, MetricsFile;
     volatile bool Running, Destructible;
-    #else
-    bool Running, Destructible;
-    #endif
 
     //Packet buffer
     RelayPacket packet;
+    BufferPool Buffers;
+#ifdef REDRELAY_MMSG
+    UdpBatch Batch;
+#else
     char UdpBuffer[65536];
+#endif
 
     //Data containers for peers, channels
     std::unordered_map<std::string, uint16_t> ChannelNames;
     IndexedPool<Connection> ConnectionsPool;
     IndexedPool<Peer> PeersPool;
     IndexedPool<Channel> ChannelsPool;
+    std::vector<uint16_t> DropQueue; //Peers to be dropped once it's safe to modify pools
+    std::vector<uint16_t> TickChannels; //Channels aggregating blasts, closed ones are dropped lazily
+    std::vector<uint16_t> Conflating; //Channels without a tick holding conflated blasts of the current receive batch
+    std::vector<uint16_t> ThrottledPeers; //Peers with paused reads, each reactor resumes its own
+    std::vector<uint16_t> PacedPeers; //Peers with datagrams waiting for their egress bucket
+    std::vector<ParkedRequest> Parked; //Requests with a deferred decision
+    std::vector<Decision> Decided; //Completed by the host from any thread, drained by the main loop
+    sf::Mutex DecidedMutex;
+    Decision Verdict; //Decision of the parked request being handled again
+    uint32_t DeferredTicket=0, NextTicket=1;
+    uint32_t NextSerial=0;
+    sf::Mutex StateMutex; //Guards membership, pools and callbacks shared between reactors, a reactor writes to its own peers without it
+    Metrics Stats;
+    Logger Logs;
+#ifndef REDRELAY_EPOLL
+    bool PendingData=false; //Some peers have queued outbound data, flushed each loop iteration
+#endif
 
     //Network interfaces
     sf::TcpListener TcpListener;
@@ -171,37 +503,147 @@ private:
     void UdpHandler();
 #endif
 
-    //Timers
-    sf::Clock DeltaClock;
-    float DeltaTime();
-    float Timer();
+    //Metrics endpoint, runs in its own thread
+    void MetricsHandler();
+    void ServeMetrics(sf::TcpListener& Listener);
+    void WriteMetrics();
+
+#ifdef REDRELAY_EPOLL
+    std::vector<Reactor*> Reactors;
+    uint8_t NextReactor=0;
+    EpollSelector& SelectorOf(uint16_t PeerID);
+    void AssignReactor(uint16_t PeerID);
+    void HandleInbox(uint8_t Index);
+    void PostTcp(const RelayTarget& Target, const char* Data, std::size_t Size, const char* Payload, std::size_t PayloadSize, SharedBuffer& Shared); //Hands outbound data to the reactor owning the peer
+    void ReadBacklog(uint8_t Index);
+    void RunReactor(uint8_t Index);
+    void PeerEvent(EpollSelector& Selector, uint32_t Index);
+    void SubmitSends(uint8_t Index);
+#endif
+#ifdef REDRELAY_URING
+    void FlushPeer(uint16_t PeerID, int Sent);
+    void ReceiveTcp(uint16_t PeerID, const char* Data, std::size_t Size);
+    void NewConnection(int Handle);
+#endif
+
+    //Timers, keepalive deadlines by peer ID followed by handshake deadlines by connection ID
+    TimingWheel Timers;
+    std::vector<uint32_t> Expired;
+    uint32_t WaitTime(); //Milliseconds until the nearest deadline
+    void HandleTimers();
+
+    //Channel ticks, blasts collected in between go out as one datagram per receiver
+    void AggregateBlast(uint16_t ChannelID, const char* Msg, std::size_t Size);
+    void AppendBlast(Channel& Channel, const char* Msg, std::size_t Size);
+    void ConflateBlast(uint16_t ChannelID, const char* Msg, std::size_t Size);
+    void SendTick(uint16_t ChannelID);
+    void SendConflated();
+    void HandleTicks();
+
+    //Decisions deferred by callbacks
+    int8_t Settle(uint16_t ID, bool Accept, std::string& DenyReason, const char* Msg, std::size_t Size, uint8_t Type); //1 accepts, 0 denies, -1 parks the request, Msg is NULL for connects
+    void Unpark(uint16_t ID, uint32_t Serial); //Forgets the requests of a peer or connection that's gone
+    void HandleDecisions();
+    uint16_t ReservedChannel(uint32_t Ticket); //Channel created by a deferred join, ChannelsLimit if there's none
+    void ReleaseChannel(uint32_t Ticket);
 
     //Peers and connections related stuff
+    uint16_t FreePeerID(); //Skips IDs held by connections waiting for their connect decision
+    void AdmitConnection(uint16_t ConnectionID);
     void DropConnection(uint16_t ID);
     void DenyConnection(uint16_t ID, const std::string& Reason);
     void DenyNameChange(uint16_t ID, const std::string& Name, const std::string& Reason);
     void DenyChannelJoin(uint16_t ID, const std::string& Name, const std::string& Reason);
     void PeerLeftChannel(uint16_t Channel, uint16_t Peer);
     void PeerDroppedFromChannel(uint16_t Channel, uint16_t Peer);
+    void ScheduleDrop(uint16_t ID);
+    void DropScheduled();
+
+    //Flood protection, checked for every message before it's handled
+    bool AdmitIngress(uint16_t PeerID, bool Udp, int Subchannel, std::size_t Size); //False if the message isn't handled now
+    void PauseReads(uint16_t PeerID, uint64_t Until);
+    void ResumeReads();
+    uint64_t NextResume();
+
+    //Cut-through forwarding of large messages
+    bool BeginForward(uint16_t PeerID); //False if the frame in the buffer is handled once complete
+    void ForwardPayload(uint16_t PeerID);
+    void EndForward(uint16_t PeerID); //Receivers get the rest as zeros if the sender is gone midway
+    void SendStream(uint16_t PeerID, const SharedBuffer& Data, std::size_t Offset=0); //Continues the forwarded frame, ahead of the lanes
+    void WakeWriter(uint16_t PeerID);
+
+    //Outbound data
+    void SendTcp(uint16_t PeerID, const char* Data, std::size_t Size, const char* Payload=NULL, std::size_t PayloadSize=0, SharedBuffer* Shared=NULL);
+    void BroadcastTcp(uint16_t ChannelID, uint16_t Sender, const char* Header, std::size_t HeaderSize, const char* Payload, std::size_t PayloadSize);
+    void FlushPeer(uint16_t PeerID);
+    void WaitWritable(uint16_t PeerID);
+    void WriteCoalesced(uint16_t PeerID);
+    uint8_t LaneOf(const char* Frame, std::size_t Size) const; //Frame header has to be in Frame
 
     //Handling messages
     void HandleTCP(uint16_t ID, char* Msg, std::size_t Size, uint8_t Type);
+    bool CollectReceivers(uint16_t ID, const char* Msg, std::size_t Size, uint8_t Type); //Channel or peer message, false if nobody gets it
+    void RelayTCP(uint16_t ID, const char* Msg, std::size_t Size, uint8_t Type); //Writes it to the collected receivers, doesn't need the lock
     void NewConnection();
+    void AddConnection(sf::TcpSocket* Socket);
+    void HandleUDP(char* Msg, std::size_t Size, uint32_t Address, uint16_t Port);
+    void SendUdp(const char* Data, std::size_t Size, uint32_t Address, uint16_t Port);
+    void SendUdp(uint16_t PeerID, const char* Data, std::size_t Size, uint8_t Priority); //Paced by the egress rate of the receiver
+    void PaceUdp(); //Sends queued datagrams as egress buckets refill
+    uint64_t NextPaced();
+    void IntroducePeer(uint16_t PeerID, uint16_t About); //Sends the UDP address of one peer to the other
     void ReceiveUdp();
-    void ReceiveTcp(uint16_t PeerID);
+    void ResizeBuffer(Peer& Peer, uint32_t Size);
+    bool PrepareBuffer(uint16_t PeerID);
+    void ProcessBuffer(uint16_t PeerID);
+    bool ReceiveTcp(uint16_t PeerID);
     void HandleConnection(uint16_t ConnectionID);
 public:
+    enum FloodActions{ //What happens to messages over the rate limit
+        DropMessages,  //Discarded
+        ThrottleReads, //TCP reads are paused until the peer is back under the limit, datagrams are dropped
+        Disconnect     //Peer is dropped
+    };
     RedRelayServer();
     ~RedRelayServer();
     std::string GetVersion() const;
-    void Log(std::string message, uint8_t colour=15);
+    void Log(std::string message, uint8_t colour=15, uint8_t Level=Logger::Info);
     void SetPingInterval(uint8_t Interval);
+    void SetHandshakeTimeout(uint8_t Seconds); //Drops connections that didn't introduce themselves in time, 0 disables
     void SetConnectionsLimit(uint16_t Limit);
     void SetPeersLimit(uint16_t Limit);
     void SetChannelsLimit(uint16_t Limit);
     void SetChannelsPerPeerLimit(uint16_t Limit);
+    void SetSendQueueLimit(uint32_t Bytes);
+    void SetMaxMessageSize(uint32_t Bytes);
+    void SetDisconnectSlowPeers(bool Flag);
+    void SetCoalesceWrites(bool Flag); //Small messages are written once per loop iteration instead of one by one
+    void SetBlastTickRate(uint16_t Rate); //Tick rate of newly created channels, 0 disables
+    void SetChannelTickRate(uint16_t ChannelID, uint16_t Rate); //Blasts to the channel are aggregated this many times per second, 0 disables
+    void SetConflatedSubchannel(uint8_t Subchannel, bool Flag); //Default for newly created channels
+    void SetChannelConflated(uint16_t ChannelID, uint8_t Subchannel, bool Flag); //Stale blasts on the subchannel are replaced by newer ones before being sent
+    void SetPeerIntroductions(bool Flag); //Peers opting into direct UDP learn each other's address and punch through NAT
+    void SetTcpRateLimit(uint32_t Messages, uint32_t Bytes); //Per peer and second, 0 disables
+    void SetUdpRateLimit(uint32_t Messages, uint32_t Bytes);
+    void SetSubchannelRateLimit(uint8_t Subchannel, uint32_t Messages, uint32_t Bytes); //Channel and peer messages on the subchannel, TCP and UDP together
+    void SetFloodAction(uint8_t Action);
+    void SetUdpEgressRate(uint32_t Bytes); //UDP bytes per second relayed to each peer, 0 disables pacing
+    void SetPeerEgressRate(uint16_t PeerID, uint32_t Bytes); //Overrides the default for a constrained or fast peer, 0 goes back to it
+    void SetUdpQueueLimit(uint32_t Bytes); //Datagrams held for each paced peer, the lowest priority ones are dropped first
+    void SetCutThroughSize(uint32_t Bytes); //Channel and peer messages this big are forwarded while they arrive, 0 disables
+    void SetSubchannelPriority(uint8_t Subchannel, uint8_t Priority); //Higher is kept longer by UDP pacing, TCP messages with any priority skip the bulk lane
+    void SetWorkerThreads(uint8_t Threads); //Reactors share socket I/O and relaying, control messages stay serialized by one lock
     void SetWelcomeMessage(const std::string& String);
     void SetLogEnabled(bool Flag);
+    void SetLogLevel(uint8_t Level); //Lines above the level are discarded before queueing
+    void SetLogConsole(bool Flag);
+    void SetLogFile(const std::string& Path);
+    void SetLogRotation(uint32_t Size, uint8_t Count);
+    void SetLogQueueLimit(uint32_t Lines);
+    void SetLogDropOnOverflow(bool Flag);
+    void SetMetricsPort(uint16_t Port); //Serves metrics over HTTP on localhost, 0 disables
+    void SetMetricsFile(const std::string& Path); //Rewrites metrics to a file every second, empty disables
+    std::string GetMetrics() const; //Prometheus text exposition format
     const Peer& GetPeer(uint16_t PeerID);
     const Channel& GetChannel(uint16_t ChannelID);
     void SetErrorCallback(void(*Error)(const std::string& ErrorMessage));
@@ -215,7 +657,14 @@ public:
     void SetChannelsListRequestCallback(bool(*ChannelsListRequest)(uint16_t, std::string&));
     void SetServerSentCallback(void(*ServerMessageSent)(uint16_t, uint8_t, const char*, std::size_t));
     void SetServerBlastCallback(void(*ServerMessageBlast)(uint16_t, uint8_t, const char*, std::size_t));
+    uint32_t DeferDecision(); //Only from connect, name, join, leave and channel list callbacks, their result is ignored and the request waits for the ticket
+    void CompleteDecision(uint32_t Ticket, bool Accept, const std::string& DenyReason=""); //From any thread, waiting connections don't time out but are dropped if they hang up
     void DropPeer(uint16_t ID);
+    //Messages from the server itself, encoded once for every receiver. Safe from callbacks, and from any thread with extended polling
+    void SendToPeer(uint16_t PeerID, uint8_t Subchannel, const char* Data, std::size_t Size, uint8_t Variant=2);
+    void SendToMany(const uint16_t* PeerIDs, std::size_t Count, uint8_t Subchannel, const char* Data, std::size_t Size, uint8_t Variant=2);
+    void SendToChannel(uint16_t ChannelID, uint8_t Subchannel, const char* Data, std::size_t Size, uint8_t Variant=2);
+    void BlastToChannel(uint16_t ChannelID, uint8_t Subchannel, const char* Data, std::size_t Size, uint8_t Variant=2); //Unfragmented, up to 65505 bytes
     void Start(uint16_t Port=6121);
     void Stop(bool Block=false);
     bool IsRunning();
@@ -0,0 +1,68 @@
+////////////////////////////////////////////////////////////
+//
+// RedRelay - a Lacewing Relay protocol reimplementation
+// Copyright (c) 2019 LekKit (LekKit#4400 in Discord)
+//
+// This software is provided 'as-is', without any express or implied
+// warranty. In no event will the authors be held liable for any damages
+// arising from the use of this software.
+//
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+//
+// 1. The origin of this software must not be misrepresented; you must not
+//   claim that you wrote the original software. If you use this software
+//   in a product, an acknowledgment in the product documentation would be
+//   appreciated but is not required.
+// 2. Altered source versions must be plainly marked as such, and must not be
+//   misrepresented as being the original software.
+// 3. This notice may not be removed or altered from any source distribution.
+//
+////////////////////////////////////////////////////////////
+
+
+#include "RedRelayServer.hpp"
+
+namespace rs{
+
+static const std::size_t CacheLimit = 4194304; //Bytes kept per size class, the rest goes back to the system
+
+uint8_t BufferPool::SizeClass(uint32_t Size){
+	uint8_t index = 0;
+	while (index < Classes && (MinSize<<index) < Size) index++;
+	return index;
+}
+
+BufferPool::~BufferPool(){
+	for (uint8_t i=0; i<Classes; ++i) for (char* Buffer : Free[i]) delete[] Buffer;
+}
+
+char* BufferPool::Acquire(uint32_t& Size){
+	uint8_t index = SizeClass(Size);
+	if (index >= Classes) return new char[Size];
+	Size = MinSize<<index;
+	{
+		sf::Lock lock(Mutex);
+		if (!Free[index].empty()){
+			char* Buffer = Free[index].back();
+			Free[index].pop_back();
+			return Buffer;
+		}
+	}
+	return new char[Size];
+}
+
+void BufferPool::Release(char* Buffer, uint32_t Size){
+	uint8_t index = SizeClass(Size);
+	if (index < Classes && (MinSize<<index) == Size){
+		sf::Lock lock(Mutex);
+		if ((Free[index].size()+1)*Size <= CacheLimit){
+			Free[index].push_back(Buffer);
+			return;
+		}
+	}
+	delete[] Buffer;
+}
+
+}
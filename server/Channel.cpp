@@ -21,6 +21,7 @@
 //
 ////////////////////////////////////////////////////////////
 
+#include <algorithm>
 #include "RedRelayServer.hpp"
 
 namespace rs{
@@ -53,17 +54,96 @@ uint16_t Channel::GetMasterID() const {
 	return Master;
 }
 
+uint16_t Channel::GetTickRate() const {
+	return TickRate;
+}
+
+bool Channel::IsConflated(uint8_t Subchannel) const {
+	return Conflated[Subchannel];
+}
+
 bool Channel::HasPeer(uint16_t PeerID) const {
-    for (uint16_t peer : Peers) if (peer == PeerID) return true;
-	return false;
+	return Members.count(PeerID) != 0;
+}
+
+uint16_t Channel::GetPeerByName(const std::string& Name) const {
+	std::unordered_map<std::string, uint16_t>::const_iterator it = Names.find(Name);
+	return it == Names.end() ? 65535 : it->second;
+}
+
+void Channel::ErasePeer(uint16_t PeerID, const std::string& Name){
+	if (Members.erase(PeerID) == 0) return;
+	Names.erase(Name);
+	PurgeBlasts(PeerID); //They would arrive after the peer left
+	for (uint32_t i=0; i<Peers.size(); ++i) if (Peers[i] == PeerID){ //Join order is kept, master goes to the oldest peer
+		Peers.erase(Peers.begin() + i);
+		break;
+	}
 }
 
-void Channel::ErasePeer(uint16_t PeerID){
-    for (uint32_t i=0; i<Peers.size(); ++i) if (Peers[i] == PeerID) Peers.erase(Peers.begin() + i);
+void Channel::ClearSlots(){ //Slot buffers are kept for the next flush
+	SlotsUsed = 0;
+	SlotBytes = 0;
+	SlotIndex.clear();
 }
 
-void Channel::AddPeer(uint16_t PeerID){
-    Peers.push_back(PeerID);
+void Channel::PurgeBlasts(uint16_t PeerID){
+	uint32_t kept=0;
+	for (uint32_t i=0; i<SlotsUsed; ++i){
+		std::vector<char>& slot = Slots[i];
+		if (((uint8_t)slot[4]|(uint8_t)slot[5]<<8) == PeerID){
+			SlotBytes -= slot.size();
+			continue;
+		}
+		if (kept != i) Slots[kept].swap(slot);
+		++kept;
+	}
+	if (kept != SlotsUsed){ //Slots moved, index them again
+		SlotsUsed = kept;
+		SlotIndex.clear();
+		for (uint32_t i=0; i<SlotsUsed; ++i) SlotIndex[((uint8_t)Slots[i][4]|(uint8_t)Slots[i][5]<<8)<<8|(uint8_t)Slots[i][1]] = i;
+	}
+	if (std::find(Owners.begin(), Owners.end(), PeerID) == Owners.end() && std::find(Owners.begin(), Owners.end(), 65535) == Owners.end()) return;
+	std::vector<char> blasts;
+	std::vector<uint32_t> datagrams;
+	std::vector<uint16_t> owners;
+	std::vector<uint8_t> priorities;
+	for (std::size_t i=0; i<Datagrams.size(); ++i){ //Aggregated datagrams are rebuilt without its entries
+		std::size_t begin = Datagrams[i], end = i+1<Datagrams.size() ? Datagrams[i+1] : Blasts.size(), start = blasts.size();
+		uint16_t owner = 65535;
+		blasts.insert(blasts.end(), &Blasts[begin], &Blasts[begin+3]);
+		for (std::size_t pos=begin+3; pos<end; ){
+			uint16_t sender = (uint8_t)Blasts[pos+2]|(uint8_t)Blasts[pos+3]<<8;
+			std::size_t entry = 6+((uint8_t)Blasts[pos+4]|(uint8_t)Blasts[pos+5]<<8);
+			if (sender != PeerID){
+				owner = blasts.size() == start+3 ? sender : owner == sender ? owner : 65535;
+				blasts.insert(blasts.end(), &Blasts[pos], &Blasts[pos+entry]);
+			}
+			pos += entry;
+		}
+		if (blasts.size() == start+3){
+			blasts.resize(start);
+			continue;
+		}
+		datagrams.push_back(start);
+		owners.push_back(owner);
+		priorities.push_back(Priorities[i]);
+	}
+	Blasts.swap(blasts);
+	Datagrams.swap(datagrams);
+	Owners.swap(owners);
+	Priorities.swap(priorities);
+}
+
+void Channel::AddPeer(uint16_t PeerID, const std::string& Name){
+	if (!Members.insert(PeerID).second) return;
+	Peers.push_back(PeerID);
+	Names[Name] = PeerID;
+}
+
+void Channel::RenamePeer(uint16_t PeerID, const std::string& OldName, const std::string& NewName){
+	Names.erase(OldName);
+	Names[NewName] = PeerID;
 }
 
 //////////
@@ -99,18 +179,102 @@ sf::IpAddress Peer::GetIP() const {
 }
 
 bool Peer::IsInChannel(uint16_t ChannelID) const {
-    for (uint16_t channel : Channels) if (channel == ChannelID) return true;
-	return false;
+	return Joined.count(ChannelID) != 0;
+}
+
+const IngressCounters& Peer::GetIngress() const {
+	return Ingress;
 }
 
 void Peer::EraseChannel(uint16_t ChannelID){
-    for (uint32_t i=0; i<Channels.size(); ++i) if (Channels[i] == ChannelID) Channels.erase(Channels.begin() + i);
+	if (Joined.erase(ChannelID) == 0) return;
+	for (uint32_t i=0; i<Channels.size(); ++i) if (Channels[i] == ChannelID){
+		Channels.erase(Channels.begin() + i);
+		break;
+	}
 }
 
 void Peer::AddChannel(uint16_t ChannelID){
-    Channels.push_back(ChannelID);
+	if (Joined.insert(ChannelID).second) Channels.push_back(ChannelID);
+}
+
+static const std::size_t LaneQuantum[LaneCount] = {65536, 16384, 4096}; //Bytes each lane may send per round
+static const std::size_t ScheduleBatch = 65536; //Stream is refilled up to this much, bounding the wait of later control messages
+
+std::size_t Peer::Queued() const {
+	return Outgoing.Size()+Laned;
+}
+
+void Peer::ScheduleLanes(){ //Deficit round robin, a frame leaves its lane once the lane has saved up enough quanta for it
+	while (Laned && !Streamed && Outgoing.Size() < ScheduleBatch)
+		for (uint8_t i=0; i<LaneCount; ++i){
+			SendLane& lane = Lanes[i];
+			if (lane.Frames.empty()) continue;
+			lane.Deficit += LaneQuantum[i];
+			while (!lane.Frames.empty() && lane.Frames.front() <= lane.Deficit){
+				lane.Deficit -= lane.Frames.front();
+				lane.Data.Move(Outgoing, lane.Frames.front());
+				Laned -= lane.Frames.front();
+				lane.Frames.pop_front();
+			}
+			if (lane.Frames.empty()) lane.Deficit = 0; //Idle lanes don't save up
+		}
+}
+
+void Peer::PromoteLanes(){ //Control frames queued next wait behind every message already laned
+	SendLane& control = Lanes[ControlLane];
+	for (uint8_t i=ControlLane+1; i<LaneCount; ++i){
+		SendLane& lane = Lanes[i];
+		if (lane.Frames.empty()) continue;
+		lane.Data.Move(control.Data, lane.Data.Size());
+		control.Frames.insert(control.Frames.end(), lane.Frames.begin(), lane.Frames.end());
+		lane.Data.Clear();
+		lane.Frames.clear();
+		lane.Deficit = 0;
+	}
+}
+
+void Peer::ClearOutgoing(){
+	Outgoing.Clear();
+	for (uint8_t i=0; i<LaneCount; ++i){
+		Lanes[i].Data.Clear();
+		Lanes[i].Frames.clear();
+		Lanes[i].Deficit = 0;
+	}
+	Laned = 0;
 }
 
 sf::TcpSocket Peer::defsocket;
 
+///////////////////
+// Token buckets //
+///////////////////
+
+bool TokenBuckets::Ready(const RateLimit& Limit, uint64_t Now, double Window){
+	if (Updated == 0){ //Starts full
+		Messages = Limit.Messages*Window;
+		Bytes = Limit.Bytes*Window;
+	} else {
+		double elapsed = (Now-Updated)*0.001;
+		Messages = std::min<double>(Messages+elapsed*Limit.Messages, Limit.Messages*Window);
+		Bytes = std::min<double>(Bytes+elapsed*Limit.Bytes, Limit.Bytes*Window);
+	}
+	if (Limit.Messages == 0) Messages = 0; //Unlimited ones don't run into debt, should a limit be set later
+	if (Limit.Bytes == 0) Bytes = 0;
+	Updated = Now;
+	return (Limit.Messages == 0 || Messages > 0) && (Limit.Bytes == 0 || Bytes > 0);
+}
+
+void TokenBuckets::Take(std::size_t Size){
+	Messages -= 1;
+	Bytes -= Size;
+}
+
+uint64_t TokenBuckets::Wait(const RateLimit& Limit) const {
+	double wait = 0;
+	if (Limit.Messages != 0 && Messages <= 0) wait = std::max(wait, -Messages/Limit.Messages);
+	if (Limit.Bytes != 0 && Bytes <= 0) wait = std::max(wait, -Bytes/Limit.Bytes);
+	return wait*1000+1;
+}
+
 }
@@ -41,13 +41,17 @@ EpollSelector::~EpollSelector(){
     delete[] events;
 }
 
-void EpollSelector::add(const sf::Socket& sock, uint32_t id){
+void EpollSelector::add(const sf::Socket& sock, uint32_t id, bool write, bool edge){
 	epoll_event event = epoll_event();
     #ifdef KQUEUE
-    EV_SET(&event, sock.GetHandle(), EVFILT_READ, EV_ADD, 0, 0, (void*)id);
+    EV_SET(&event, sock.GetHandle(), EVFILT_READ, EV_ADD|(edge ? EV_CLEAR : 0), 0, 0, (void*)id);
     kevent(epoll_fd, &event, 1, NULL, 0, NULL);
+    if (write){
+        EV_SET(&event, sock.GetHandle(), EVFILT_WRITE, EV_ADD|(edge ? EV_CLEAR : 0), 0, 0, (void*)id);
+        kevent(epoll_fd, &event, 1, NULL, 0, NULL);
+    }
     #else
-    event.events=EPOLLIN|EPOLLHUP|EPOLLRDHUP;
+    event.events=EPOLLIN|EPOLLHUP|EPOLLRDHUP|(write ? (uint32_t)EPOLLOUT : 0u)|(edge && EdgeTriggered ? (uint32_t)EPOLLET : 0u);
     event.data.u32=id;
     epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sock.GetHandle(), &event);
     #endif
@@ -63,13 +67,15 @@ void EpollSelector::remove(const sf::Socket& sock){
     #endif
 }
 
-void EpollSelector::mod(const sf::Socket& sock, uint32_t id){
+void EpollSelector::mod(const sf::Socket& sock, uint32_t id, bool write, bool edge, bool read){
 	epoll_event event = epoll_event();
     #ifdef KQUEUE
-    EV_SET(&event, sock.GetHandle(), EVFILT_READ, EV_ADD, 0, 0, (void*)id);
+    EV_SET(&event, sock.GetHandle(), EVFILT_READ, EV_ADD|(read ? EV_ENABLE : EV_DISABLE)|(edge ? EV_CLEAR : 0), 0, 0, (void*)id);
+    kevent(epoll_fd, &event, 1, NULL, 0, NULL);
+    EV_SET(&event, sock.GetHandle(), EVFILT_WRITE, write ? EV_ADD|(edge ? EV_CLEAR : 0) : EV_DELETE, 0, 0, (void*)id);
     kevent(epoll_fd, &event, 1, NULL, 0, NULL);
     #else
-    event.events=EPOLLIN|EPOLLHUP|EPOLLRDHUP;
+    event.events=(read ? (uint32_t)(EPOLLIN|EPOLLRDHUP) : 0u)|EPOLLHUP|(write ? (uint32_t)EPOLLOUT : 0u)|(edge && EdgeTriggered ? (uint32_t)EPOLLET : 0u);
     event.data.u32=id;
     epoll_ctl(epoll_fd, EPOLL_CTL_MOD, sock.GetHandle(), &event);
     #endif
@@ -95,3 +101,19 @@ uint32_t EpollSelector::at(uint32_t id) const {
     return events[id].data.u32;
     #endif
 }
+
+bool EpollSelector::readable(uint32_t id) const {
+    #ifdef KQUEUE
+    return events[id].filter != EVFILT_WRITE;
+    #else
+    return (events[id].events & (EPOLLIN|EPOLLHUP|EPOLLRDHUP|EPOLLERR)) != 0;
+    #endif
+}
+
+bool EpollSelector::writable(uint32_t id) const {
+    #ifdef KQUEUE
+    return events[id].filter == EVFILT_WRITE;
+    #else
+    return (events[id].events & EPOLLOUT) != 0;
+    #endif
+}
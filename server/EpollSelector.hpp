@@ -50,19 +50,75 @@
     #error Extended polling not supported on target platform
 #endif
 
+#ifdef REDRELAY_URING
+    #include <vector>
+    struct io_uring_sqe;
+    struct io_uring_cqe;
+    struct io_uring_buf_ring;
+#endif
+
 class EpollSelector{
+public:
+    //Edge-triggered sockets are reported once per readiness change, so their reads must drain until EAGAIN
+#ifdef _WIN32
+    static const bool EdgeTriggered = false; //Not supported by wepoll, level-triggered is used instead
+#else
+    static const bool EdgeTriggered = true;
+#endif
 private:
     std::size_t maxevents;
+#ifdef REDRELAY_URING //Implemented in UringSelector.cpp, edge-triggered sockets get their data by multishot recv
+    struct Registration; //Multishot request armed for a descriptor
+    struct Event{
+        uint32_t id;
+        uint8_t type;
+        int32_t result;
+        int fd;
+        const char* data;
+    };
+    int ring_fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *cq_head, *cq_tail, *cq_mask;
+    unsigned sq_entries, tail;
+    io_uring_sqe* sqes;
+    io_uring_cqe* cqes;
+    void *sq_ring, *cq_ring;
+    std::size_t sq_ring_size, cq_ring_size;
+    io_uring_buf_ring* buffer_ring; //Provided receive buffers, the kernel picks one per completion
+    char* buffers;
+    uint16_t buffer_tail;
+    std::vector<uint16_t> consumed; //Buffers handed out with the current batch of events
+    std::vector<Registration*> registrations; //Indexed by descriptor
+    Event* events;
+    uint32_t count;
+
+    Registration& slot(int fd);
+    io_uring_sqe* sqe();
+    void submit(unsigned wait=0, int timeout=-1);
+    void arm(int fd);
+    void cancel(int fd);
+    void recycle(uint16_t bid);
+    void complete(const io_uring_cqe& cqe);
+#else
     epolld epoll_fd;
     epoll_event* events;
+#endif
 public:
     EpollSelector(std::size_t Size=1024);
     ~EpollSelector();
-    void add(const sf::Socket& sock, uint32_t id);
+    void add(const sf::Socket& sock, uint32_t id, bool write=false, bool edge=false);
     void remove(const sf::Socket& sock);
-    void mod(const sf::Socket& sock, uint32_t id);
+    void mod(const sf::Socket& sock, uint32_t id, bool write=false, bool edge=false, bool read=true); //Reads can be paused without losing the registration
     int wait(int timeout=-1);
     uint32_t at(uint32_t index) const;
+    bool readable(uint32_t index) const;
+    bool writable(uint32_t index) const;
+#ifdef REDRELAY_URING
+    void listen(const sf::Socket& sock, uint32_t id); //Multishot accept, each connection is an event
+    bool send(const sf::Socket& sock, const char** Data, const std::size_t* Sizes, std::size_t Count); //False if a send is in flight already
+    int accepted(uint32_t index) const; //Accepted descriptor, or -1
+    const char* data(uint32_t index, std::size_t& size) const; //Received data, valid until the next wait()
+    bool sent(uint32_t index, int& result) const; //Send completion, result is the bytes written or a negative error
+#endif
 };
 
 #endif
@@ -26,6 +26,8 @@
 
 #include <vector>
 #include <iostream>
+#include <new>
+#include <atomic>
 
 namespace rs{
 
@@ -40,27 +42,28 @@ public:
 
 
 template<typename T>
-class IndexedPool{
+class IndexedPool{ //Elements live in fixed-size slabs, so they never move while allocated
 public:
 	~IndexedPool(){
 		Clear();
 	}
 
-    bool AutoScale=true; //If our vector is too small, creates empty cells to prevent "out of range"
+    bool AutoScale=true; //If our slab table is too small, extends it to prevent "out of range"
 
     T& operator[](unsigned int index){
-        if (index>=m_pool.size() || m_pool.at(index)==NULL){ //If requested element doesn't exist, returns empty type to prevent segmentation fault
+        if (!Allocated(index)){ //If requested element doesn't exist, returns empty type to prevent segmentation fault
             std::cout<<"SEGFAULT prevented in pool "<<this<<" at index "<<index<<", execution continues"<<std::endl;
             std::cout<<"Please report this incident to LekKit#4400 in Discord! (this is important, yea)"<<std::endl;
-            emptytype=T();
+            emptytype.~T(); //Elements may not be assignable
+            new (&emptytype) T;
             return emptytype;
         }
-        return *m_pool.at(index);
+        return *cell(index).element();
     }
 
     T* at(unsigned int index){
-        if (AutoScale) while (index>=m_pool.size()) m_pool.push_back(NULL);
-        return m_pool.at(index);
+        if (AutoScale) Reserve(index+1);
+        return Allocated(index) ? cell(index).element() : NULL;
     }
 
 	std::size_t Size() const {
@@ -71,39 +74,136 @@ public:
         return m_allocated;
     }
 
+    void Reserve(unsigned int size){ //Creates the slab table up front, so it never moves while in use
+        //Once every ID is covered, allocated elements may be looked up alongside Allocate and Deallocate of other IDs
+        unsigned int slabs = (size+SlabSize-1)/SlabSize;
+        if (slabs>m_slabs.size()) m_slabs.resize(slabs, NULL);
+    }
+
     bool Allocated(unsigned int index) const { //Check if specified ID is busy
-        return !(index>=m_pool.size() || m_pool.at(index)==NULL);
+        return index/SlabSize<m_slabs.size() && m_slabs[index/SlabSize]!=NULL && cell(index).used.load(std::memory_order_acquire);
+    }
+
+    unsigned int FreeIndex(unsigned int limit){ //Returns a free ID below limit without allocating it, or limit if there's none
+        if (limit>m_parkedlimit){ //Limit was raised, parked IDs may be usable again
+            for (unsigned int index : m_parked){
+                cell(index).parked = false;
+                Link(index);
+            }
+            m_parked.clear();
+            m_parkedlimit = (unsigned int)-1;
+        }
+        while (m_freecount>0){
+            if (m_free<limit) return m_free;
+            unsigned int index = m_free; //Out of the limit, set aside so later calls don't walk past it again
+            Unlink(index);
+            cell(index).parked = true;
+            m_parked.push_back(index);
+            if (limit<m_parkedlimit) m_parkedlimit = limit;
+        }
+        while (m_fresh<m_slabs.size() && m_slabs[m_fresh]!=NULL) ++m_fresh;
+        return m_fresh*SlabSize<limit ? m_fresh*SlabSize : limit;
     }
 
     void Allocate(unsigned int index){ //Allocate element with given ID
-        if (AutoScale) while (index>=m_pool.size()) m_pool.push_back(NULL);
-        if (m_pool.at(index)==NULL){ //Only if our ID isn't busy already
-            m_pool.at(index)=new T;
+        if (AutoScale) Reserve(index+1);
+        Cell*& slab = m_slabs.at(index/SlabSize);
+        if (slab==NULL){
+            slab = new Cell[SlabSize];
+            for (unsigned int i=SlabSize; i>0; --i) Link(index/SlabSize*SlabSize+i-1); //Lowest IDs end up first
+        }
+        Cell& Cell = cell(index);
+        if (!Cell.used.load(std::memory_order_relaxed)){ //Only if our ID isn't busy already
+            if (Cell.parked) Unpark(index);
+            else Unlink(index);
+            new (Cell.storage) T;
+            Cell.used.store(true, std::memory_order_release);
+            Cell.dense = m_allocated.size();
             IndexedElement<T> IndexedElement;
             IndexedElement.index = index;
-            IndexedElement.element = m_pool.at(index);
+            IndexedElement.element = Cell.element();
             m_allocated.push_back(IndexedElement);
         }
     }
 
     void Deallocate(unsigned int index){ //Destroy element at given ID
-        if (index<m_pool.size() && m_pool.at(index)!=NULL){ //Only if this element exists
-            for (unsigned int i=0; i<m_allocated.size(); ++i) if (m_allocated.at(i).index==index) m_allocated.erase(m_allocated.begin()+i);
-            delete m_pool.at(index);
-            m_pool.at(index) = NULL;
+        if (Allocated(index)){ //Only if this element exists
+            Cell& Cell = cell(index);
+            m_allocated[Cell.dense] = m_allocated.back(); //Last element takes the freed spot
+            cell(m_allocated[Cell.dense].index).dense = Cell.dense;
+            m_allocated.pop_back();
+            Cell.element()->~T();
+            Cell.used.store(false, std::memory_order_release);
+            Link(index);
         }
     }
 
 	void Clear(){
-		m_pool.clear();
-		m_pool.shrink_to_fit();
-		for (uint32_t i=0; i<m_allocated.size(); ++i) delete m_allocated.at(i).element;
+		for (unsigned int i=0; i<m_allocated.size(); ++i) m_allocated[i].element->~T();
 		m_allocated.clear();
 		m_allocated.shrink_to_fit();
+		for (unsigned int i=0; i<m_slabs.size(); ++i) delete[] m_slabs[i];
+		m_slabs.clear();
+		m_slabs.shrink_to_fit();
+		m_free = m_freecount = m_fresh = 0;
+		m_parked.clear();
+		m_parkedlimit = (unsigned int)-1;
 	}
 private:
-    std::vector<T*> m_pool;
+    static const unsigned int SlabSize = 64;
+
+    struct Cell{
+        alignas(T) unsigned char storage[sizeof(T)];
+        std::atomic<bool> used{false}; //Read by reactor threads without the server lock
+        unsigned int dense; //Position in m_allocated while used
+        unsigned int prev, next; //Free list links while unused
+        bool parked=false; //Free, but held in m_parked instead of the free list
+        T* element(){
+            return reinterpret_cast<T*>(storage);
+        }
+    };
+
+    Cell& cell(unsigned int index) const {
+        return m_slabs[index/SlabSize][index%SlabSize];
+    }
+
+    void Link(unsigned int index){ //Puts ID at the head of the free list
+        Cell& Cell = cell(index);
+        if (m_freecount==0) Cell.prev = Cell.next = index;
+        else {
+            Cell.next = m_free;
+            Cell.prev = cell(m_free).prev;
+            cell(Cell.prev).next = index;
+            cell(m_free).prev = index;
+        }
+        m_free = index;
+        m_freecount++;
+    }
+
+    void Unpark(unsigned int index){
+        cell(index).parked = false;
+        for (unsigned int i=0; i<m_parked.size(); ++i) if (m_parked[i]==index){
+            m_parked[i] = m_parked.back();
+            m_parked.pop_back();
+            break;
+        }
+    }
+
+    void Unlink(unsigned int index){
+        Cell& Cell = cell(index);
+        cell(Cell.prev).next = Cell.next;
+        cell(Cell.next).prev = Cell.prev;
+        if (m_free==index) m_free = Cell.next;
+        m_freecount--;
+    }
+
+    std::vector<Cell*> m_slabs;
     std::vector<IndexedElement<T>> m_allocated;
+    unsigned int m_free=0; //Head of the free list
+    unsigned int m_freecount=0;
+    unsigned int m_fresh=0; //Every slab below this one is in use
+    std::vector<unsigned int> m_parked; //Free IDs at or above a limit FreeIndex was called with
+    unsigned int m_parkedlimit=(unsigned int)-1; //Lowest such limit
     T emptytype;
 };
 
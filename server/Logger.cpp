@@ -0,0 +1,191 @@
+////////////////////////////////////////////////////////////
+//
+// RedRelay - a Lacewing Relay protocol reimplementation
+// Copyright (c) 2019 LekKit (LekKit#4400 in Discord)
+//
+// This software is provided 'as-is', without any express or implied
+// warranty. In no event will the authors be held liable for any damages
+// arising from the use of this software.
+//
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+//
+// 1. The origin of this software must not be misrepresented; you must not
+//   claim that you wrote the original software. If you use this software
+//   in a product, an acknowledgment in the product documentation would be
+//   appreciated but is not required.
+// 2. Altered source versions must be plainly marked as such, and must not be
+//   misrepresented as being the original software.
+// 3. This notice may not be removed or altered from any source distribution.
+//
+////////////////////////////////////////////////////////////
+
+
+#include "RedRelayServer.hpp"
+#include <iostream>
+#include <cstdio>
+#include "ConsoleColors.hpp"
+
+namespace rs{
+
+static std::string DualDigit(uint8_t num){
+	std::string str = std::to_string(num);
+	return ("00"+str).substr(str.length(), 2);
+}
+
+Logger::Logger(){
+	tail = new Entry;
+	tail->next.store(NULL, std::memory_order_relaxed);
+	head.store(tail, std::memory_order_relaxed);
+	pending.store(0);
+	pushed.store(0);
+	written.store(0);
+	dropped.store(0);
+	running.store(true);
+	writer = std::thread(&Logger::Run, this);
+}
+
+Logger::~Logger(){
+	running.store(false);
+	writer.join(); //Writer drains the queue before leaving
+	while (tail != NULL){
+		Entry* next = tail->next.load(std::memory_order_relaxed);
+		delete tail;
+		tail = next;
+	}
+}
+
+void Logger::Push(uint8_t Color, std::string& Message){
+	if (pending.fetch_add(1, std::memory_order_relaxed) >= queueLimit){
+		if (dropOnOverflow){ //Losing a line is better than stalling the event loop
+			pending.fetch_sub(1, std::memory_order_relaxed);
+			dropped.fetch_add(1, std::memory_order_relaxed);
+			return;
+		}
+		while (pending.load(std::memory_order_relaxed) > queueLimit && running.load()) sf::sleep(sf::milliseconds(1));
+	}
+	Entry* entry = new Entry;
+	entry->Time = time(0);
+	entry->Color = Color;
+	entry->Message.swap(Message);
+	entry->next.store(NULL, std::memory_order_relaxed);
+	pushed.fetch_add(1, std::memory_order_relaxed);
+	Entry* prev = head.exchange(entry, std::memory_order_acq_rel);
+	prev->next.store(entry, std::memory_order_release);
+}
+
+void Logger::Flush(){
+	uint64_t target = pushed.load();
+	while (written.load() < target && running.load()) sf::sleep(sf::milliseconds(1));
+}
+
+void Logger::SetLevel(uint8_t Level){
+	level = Level;
+}
+
+uint8_t Logger::GetLevel() const {
+	return level;
+}
+
+void Logger::SetConsole(bool Flag){
+	sf::Lock lock(Mutex);
+	console = Flag;
+}
+
+void Logger::SetFile(const std::string& Path){
+	sf::Lock lock(Mutex);
+	if (file.is_open()) file.close();
+	path = Path;
+	fileSize = 0;
+	if (path.empty()) return;
+	file.open(path.c_str(), std::ofstream::app);
+	if (file.is_open()){
+		file.seekp(0, std::ofstream::end);
+		fileSize = file.tellp();
+	}
+}
+
+void Logger::SetRotation(uint32_t Size, uint8_t Count){
+	sf::Lock lock(Mutex);
+	rotateSize = Size;
+	rotateCount = Count;
+}
+
+void Logger::SetQueueLimit(uint32_t Lines){
+	if (Lines>0) queueLimit = Lines;
+}
+
+void Logger::SetDropOnOverflow(bool Flag){
+	dropOnOverflow = Flag;
+}
+
+uint64_t Logger::Dropped() const {
+	return dropped.load(std::memory_order_relaxed);
+}
+
+void Logger::Rotate(){ //path -> path.1 -> path.2 ... the oldest one is removed
+	file.close();
+	for (uint8_t i=rotateCount; i>0; --i){
+		std::string from = i>1 ? path+"."+std::to_string(i-1) : path, to = path+"."+std::to_string(i);
+		std::remove(to.c_str());
+		std::rename(from.c_str(), to.c_str());
+	}
+	file.open(path.c_str(), rotateCount ? std::ofstream::app : std::ofstream::trunc);
+	fileSize = 0;
+}
+
+bool Logger::WriteBatch(){
+	std::string text, colored;
+	time_t last = 0;
+	std::string stamp;
+	uint64_t count = 0;
+	sf::Lock lock(Mutex);
+	for (Entry* next = tail->next.load(std::memory_order_acquire); next != NULL; next = tail->next.load(std::memory_order_acquire)){
+		if (next->Time != last){ //Formatted once per second at most
+			last = next->Time;
+			struct tm* time = localtime(&last);
+			stamp = "["+DualDigit(time->tm_hour)+":"+DualDigit(time->tm_min)+":"+DualDigit(time->tm_sec)+"] ";
+		}
+		if (file.is_open()) text += stamp+next->Message+"\n";
+		if (console){
+		#ifdef _WIN32
+			ChangeConsoleColor(15); //Colors are set on the console itself, every line is written separately
+			std::cout<<stamp;
+			ChangeConsoleColor(next->Color);
+			std::cout<<next->Message<<"\n";
+		#else
+			colored += ConsoleColors[15]+stamp+ConsoleColors[next->Color]+next->Message+"\n";
+		#endif
+		}
+		delete tail;
+		tail = next; //Written node becomes the new dummy
+		next->Message.clear();
+		count++;
+	}
+	uint64_t lost = dropped.load(std::memory_order_relaxed);
+	if (lost != reported){
+		std::string notice = std::to_string(lost-reported)+" log lines dropped, queue is full\n";
+		if (file.is_open()) text += notice;
+		if (console) colored += notice;
+		reported = lost;
+	}
+	if (!colored.empty()) std::cout.write(colored.data(), colored.size());
+	if (console && count) std::cout.flush();
+	if (!text.empty()){
+		file.write(text.data(), text.size());
+		file.flush();
+		fileSize += text.size();
+		if (rotateSize && fileSize >= rotateSize) Rotate();
+	}
+	pending.fetch_sub(count, std::memory_order_relaxed);
+	written.fetch_add(count, std::memory_order_release);
+	return count != 0;
+}
+
+void Logger::Run(){
+	while (running.load()) if (!WriteBatch()) sf::sleep(sf::milliseconds(20)); //Lines arriving meanwhile are written together
+	WriteBatch();
+}
+
+}
@@ -6,13 +6,39 @@
 rs::RedRelayServer& Server = *new rs::RedRelayServer;
 std::fstream config;
 uint16_t Port = 6121;
+uint32_t LogRotateSize = 0;
+uint8_t LogRotateCount = 5;
+uint32_t TcpMessageRate = 0, TcpByteRate = 0, UdpMessageRate = 0, UdpByteRate = 0;
 bool PortSet = false,
      PingIntervalSet = false,
+     HandshakeTimeoutSet = false,
      LogEnabledSet = false,
+     LogLevelSet = false,
+     LogConsoleSet = false,
+     LogRotateSizeSet = false,
+     LogRotateCountSet = false,
+     LogQueueLimitSet = false,
+     LogDropOnOverflowSet = false,
      ConnectionsLimitSet = false,
      PeersLimitSet = false,
      ChannelsLimitSet = false,
-     ChannelsPerPeerLimitSet = false;
+     ChannelsPerPeerLimitSet = false,
+     SendQueueLimitSet = false,
+     MaxMessageSizeSet = false,
+     DisconnectSlowPeersSet = false,
+     CoalesceWritesSet = false,
+     BlastTickRateSet = false,
+     PeerIntroductionsSet = false,
+     TcpMessageRateSet = false,
+     TcpByteRateSet = false,
+     UdpMessageRateSet = false,
+     UdpByteRateSet = false,
+     FloodActionSet = false,
+     UdpEgressRateSet = false,
+     UdpQueueLimitSet = false,
+     CutThroughSizeSet = false,
+     WorkerThreadsSet = false,
+     MetricsPortSet = false;
 
 bool LoadConfig(){
     config.open("redrelay.cfg", std::fstream::out | std::fstream::in);
@@ -31,9 +57,33 @@ Port = 6121\n\
 #Set to 0 to disable\n\
 PingInterval = 3\n\
 \n\
+#Drops connections that didn't complete the handshake in time (in seconds)\n\
+#Set to 0 to disable\n\
+HandshakeTimeout = 5\n\
+\n\
 #Logging\n\
 LogEnabled = true\n\
 \n\
+#Most verbose messages logged: error, warning, info or debug\n\
+LogLevel = info\n\
+\n\
+#Print log to the console\n\
+LogConsole = true\n\
+\n\
+#Also write log to a file\n\
+#LogFile = \"redrelay.log\"\n\
+\n\
+#Rotate log file once it's bigger than this (in bytes), keeping a number of old files\n\
+#Set size to 0 to disable\n\
+LogRotateSize = 0\n\
+LogRotateCount = 5\n\
+\n\
+#Log lines waiting to be written, the event loop never waits for the console or disk\n\
+LogQueueLimit = 65536\n\
+\n\
+#Drop log lines once the queue is full, otherwise wait for the writer\n\
+LogDropOnOverflow = true\n\
+\n\
 #Limits unauthorised connections\n\
 ConnectionsLimit = 16\n\
 \n\
@@ -46,6 +96,68 @@ ChannelsLimit = 32\n\
 #Limits channels in which peer can be at once\n\
 ChannelsPerPeerLimit = 4\n\
 \n\
+#Limits outbound data queued for a single peer (in bytes)\n\
+SendQueueLimit = 1048576\n\
+\n\
+#Limits the size of a single message received from a peer (in bytes)\n\
+MaxMessageSize = 16777216\n\
+\n\
+#Disconnect peers exceeding the send queue limit, otherwise excess messages are dropped\n\
+DisconnectSlowPeers = true\n\
+\n\
+#Collect small messages to each peer and write them once per event loop iteration\n\
+#Fewer system calls for chatty channels, at the cost of a slight delay\n\
+CoalesceWrites = false\n\
+\n\
+#Channels collect UDP blasts and send them this many times per second, one datagram per receiver\n\
+#Fewer packets for game channels where every peer blasts each frame, needs clients that support it\n\
+#Set to 0 to relay blasts right away\n\
+BlastTickRate = 0\n\
+\n\
+#Subchannels carrying state where only the newest blast of each peer matters\n\
+#Stale blasts are dropped once a newer one arrives before the next tick or receive batch\n\
+#ConflatedSubchannels = \"1, 2\"\n\
+\n\
+#Introduce peers that opt into direct UDP to each other, their blasts then skip the relay where NAT allows\n\
+#Gives out peer addresses to other peers in the same channel\n\
+PeerIntroductions = false\n\
+\n\
+#Messages and bytes each peer may send per second, set to 0 for no limit\n\
+TcpMessageRate = 0\n\
+TcpByteRate = 0\n\
+UdpMessageRate = 0\n\
+UdpByteRate = 0\n\
+\n\
+#Limits for single subchannels, TCP and UDP together, as triplets of subchannel, messages and bytes per second\n\
+#SubchannelRateLimits = \"5 20 4096\"\n\
+\n\
+#What happens to messages over a rate limit: drop, throttle (pause reading from the peer) or disconnect\n\
+#UDP messages are dropped when throttling\n\
+FloodAction = drop\n\
+\n\
+#UDP bytes per second relayed to each peer, datagrams above the rate wait in a small queue per peer\n\
+#Keeps bursts from overflowing the links of slow peers, set to 0 to relay right away\n\
+UdpEgressRate = 0\n\
+UdpQueueLimit = 65536\n\
+\n\
+#Channel and peer messages this big are passed on while they arrive instead of being buffered whole\n\
+#Lowers latency and memory for large transfers, set to 0 to disable\n\
+CutThroughSize = 0\n\
+\n\
+#Subchannels which lose datagrams last when a paced queue is full, as pairs of subchannel and priority (0-255)\n\
+#SubchannelPriorities = \"1 200, 2 100\"\n\
+\n\
+#Event loop threads, peers are spread evenly between them\n\
+#Socket I/O and relaying of channel and peer messages run in parallel, control messages are still handled one at a time\n\
+WorkerThreads = 1\n\
+\n\
+#Serves runtime metrics in Prometheus format at http://127.0.0.1:<port>/metrics\n\
+#Set to 0 to disable\n\
+MetricsPort = 0\n\
+\n\
+#Rewrites the same metrics to a file every second\n\
+#MetricsFile = \"redrelay.prom\"\n\
+\n\
 #WelcomeMessage = \"\"";
         tmp.close();
         config.open("redrelay.cfg", std::fstream::out | std::fstream::in);
@@ -61,9 +173,34 @@ void SetProp(const std::string& PropName, const std::string& PropVal){
     } else if (PropName == "PingInterval"){
         Server.SetPingInterval(std::stoi(PropVal));
         PingIntervalSet = true;
+    } else if (PropName == "HandshakeTimeout"){
+        Server.SetHandshakeTimeout(std::stoi(PropVal));
+        HandshakeTimeoutSet = true;
     } else if (PropName == "LogEnabled"){
         Server.SetLogEnabled(PropVal=="true");
         LogEnabledSet = true;
+    } else if (PropName == "LogLevel"){
+        if (PropVal == "error") Server.SetLogLevel(rs::Logger::Error);
+        else if (PropVal == "warning") Server.SetLogLevel(rs::Logger::Warning);
+        else if (PropVal == "debug") Server.SetLogLevel(rs::Logger::Debug);
+        else Server.SetLogLevel(rs::Logger::Info);
+        LogLevelSet = true;
+    } else if (PropName == "LogConsole"){
+        Server.SetLogConsole(PropVal=="true");
+        LogConsoleSet = true;
+    } else if (PropName == "LogFile") Server.SetLogFile(PropVal);
+    else if (PropName == "LogRotateSize"){
+        LogRotateSize = std::stoul(PropVal);
+        LogRotateSizeSet = true;
+    } else if (PropName == "LogRotateCount"){
+        LogRotateCount = std::stoi(PropVal);
+        LogRotateCountSet = true;
+    } else if (PropName == "LogQueueLimit"){
+        Server.SetLogQueueLimit(std::stoul(PropVal));
+        LogQueueLimitSet = true;
+    } else if (PropName == "LogDropOnOverflow"){
+        Server.SetLogDropOnOverflow(PropVal=="true");
+        LogDropOnOverflowSet = true;
     } else if (PropName == "ConnectionsLimit"){
         Server.SetConnectionsLimit(std::stoi(PropVal));
         ConnectionsLimitSet = true;
@@ -76,7 +213,80 @@ void SetProp(const std::string& PropName, const std::string& PropVal){
     } else if (PropName == "ChannelsPerPeerLimit"){
         Server.SetChannelsPerPeerLimit(std::stoi(PropVal));
         ChannelsPerPeerLimitSet = true;
-    } else if (PropName == "WelcomeMessage") Server.SetWelcomeMessage(PropVal);
+    } else if (PropName == "SendQueueLimit"){
+        Server.SetSendQueueLimit(std::stoul(PropVal));
+        SendQueueLimitSet = true;
+    } else if (PropName == "MaxMessageSize"){
+        Server.SetMaxMessageSize(std::stoul(PropVal));
+        MaxMessageSizeSet = true;
+    } else if (PropName == "DisconnectSlowPeers"){
+        Server.SetDisconnectSlowPeers(PropVal=="true");
+        DisconnectSlowPeersSet = true;
+    } else if (PropName == "CoalesceWrites"){
+        Server.SetCoalesceWrites(PropVal=="true");
+        CoalesceWritesSet = true;
+    } else if (PropName == "BlastTickRate"){
+        Server.SetBlastTickRate(std::stoi(PropVal));
+        BlastTickRateSet = true;
+    } else if (PropName == "ConflatedSubchannels"){
+        std::size_t pos = 0, length;
+        while ((pos = PropVal.find_first_of("0123456789", pos)) != std::string::npos){
+            Server.SetConflatedSubchannel(std::stoi(PropVal.substr(pos), &length), true);
+            pos += length;
+        }
+    } else if (PropName == "PeerIntroductions"){
+        Server.SetPeerIntroductions(PropVal=="true");
+        PeerIntroductionsSet = true;
+    } else if (PropName == "TcpMessageRate"){
+        TcpMessageRate = std::stoul(PropVal);
+        TcpMessageRateSet = true;
+    } else if (PropName == "TcpByteRate"){
+        TcpByteRate = std::stoul(PropVal);
+        TcpByteRateSet = true;
+    } else if (PropName == "UdpMessageRate"){
+        UdpMessageRate = std::stoul(PropVal);
+        UdpMessageRateSet = true;
+    } else if (PropName == "UdpByteRate"){
+        UdpByteRate = std::stoul(PropVal);
+        UdpByteRateSet = true;
+    } else if (PropName == "SubchannelRateLimits"){
+        std::size_t pos = 0, length;
+        std::vector<uint32_t> values;
+        while ((pos = PropVal.find_first_of("0123456789", pos)) != std::string::npos){
+            values.push_back(std::stoul(PropVal.substr(pos), &length));
+            pos += length;
+        }
+        for (std::size_t i=0; i+2<values.size(); i+=3) Server.SetSubchannelRateLimit(values[i], values[i+1], values[i+2]);
+    } else if (PropName == "FloodAction"){
+        if (PropVal == "throttle") Server.SetFloodAction(rs::RedRelayServer::ThrottleReads);
+        else if (PropVal == "disconnect") Server.SetFloodAction(rs::RedRelayServer::Disconnect);
+        else Server.SetFloodAction(rs::RedRelayServer::DropMessages);
+        FloodActionSet = true;
+    } else if (PropName == "UdpEgressRate"){
+        Server.SetUdpEgressRate(std::stoul(PropVal));
+        UdpEgressRateSet = true;
+    } else if (PropName == "UdpQueueLimit"){
+        Server.SetUdpQueueLimit(std::stoul(PropVal));
+        UdpQueueLimitSet = true;
+    } else if (PropName == "CutThroughSize"){
+        Server.SetCutThroughSize(std::stoul(PropVal));
+        CutThroughSizeSet = true;
+    } else if (PropName == "SubchannelPriorities"){
+        std::size_t pos = 0, length;
+        std::vector<uint32_t> values;
+        while ((pos = PropVal.find_first_of("0123456789", pos)) != std::string::npos){
+            values.push_back(std::stoul(PropVal.substr(pos), &length));
+            pos += length;
+        }
+        for (std::size_t i=0; i+1<values.size(); i+=2) Server.SetSubchannelPriority(values[i], values[i+1]);
+    } else if (PropName == "WorkerThreads"){
+        Server.SetWorkerThreads(std::stoi(PropVal));
+        WorkerThreadsSet = true;
+    } else if (PropName == "MetricsPort"){
+        Server.SetMetricsPort(std::stoi(PropVal));
+        MetricsPortSet = true;
+    } else if (PropName == "MetricsFile") Server.SetMetricsFile(PropVal);
+    else if (PropName == "WelcomeMessage") Server.SetWelcomeMessage(PropVal);
 }
 
 bool running = true;
@@ -125,12 +335,38 @@ int main(){
         config.clear();
         if (!PortSet) config<<"\nPort = 6121";
         if (!PingIntervalSet) config<<"\nPingInterval = 3";
+        if (!HandshakeTimeoutSet) config<<"\nHandshakeTimeout = 5";
         if (!LogEnabledSet) config<<"\nLogEnabled = true";
+        if (!LogLevelSet) config<<"\nLogLevel = info";
+        if (!LogConsoleSet) config<<"\nLogConsole = true";
+        if (!LogRotateSizeSet) config<<"\nLogRotateSize = 0";
+        if (!LogRotateCountSet) config<<"\nLogRotateCount = 5";
+        if (!LogQueueLimitSet) config<<"\nLogQueueLimit = 65536";
+        if (!LogDropOnOverflowSet) config<<"\nLogDropOnOverflow = true";
         if (!ConnectionsLimitSet) config<<"\nConnectionsLimit = 16";
         if (!PeersLimitSet) config<<"\nPeersLimit = 128";
         if (!ChannelsLimitSet) config<<"\nChannelsLimit = 32";
         if (!ChannelsPerPeerLimitSet) config<<"\nChannelsPerPeerLimit = 4";
+        if (!SendQueueLimitSet) config<<"\nSendQueueLimit = 1048576";
+        if (!MaxMessageSizeSet) config<<"\nMaxMessageSize = 16777216";
+        if (!DisconnectSlowPeersSet) config<<"\nDisconnectSlowPeers = true";
+        if (!CoalesceWritesSet) config<<"\nCoalesceWrites = false";
+        if (!BlastTickRateSet) config<<"\nBlastTickRate = 0";
+        if (!PeerIntroductionsSet) config<<"\nPeerIntroductions = false";
+        if (!TcpMessageRateSet) config<<"\nTcpMessageRate = 0";
+        if (!TcpByteRateSet) config<<"\nTcpByteRate = 0";
+        if (!UdpMessageRateSet) config<<"\nUdpMessageRate = 0";
+        if (!UdpByteRateSet) config<<"\nUdpByteRate = 0";
+        if (!FloodActionSet) config<<"\nFloodAction = drop";
+        if (!UdpEgressRateSet) config<<"\nUdpEgressRate = 0";
+        if (!UdpQueueLimitSet) config<<"\nUdpQueueLimit = 65536";
+        if (!CutThroughSizeSet) config<<"\nCutThroughSize = 0";
+        if (!WorkerThreadsSet) config<<"\nWorkerThreads = 1";
+        if (!MetricsPortSet) config<<"\nMetricsPort = 0";
         config.close();
+        Server.SetLogRotation(LogRotateSize, LogRotateCount);
+        Server.SetTcpRateLimit(TcpMessageRate, TcpByteRate);
+        Server.SetUdpRateLimit(UdpMessageRate, UdpByteRate);
     }
 
     signal(SIGINT, sig_handler);
@@ -0,0 +1,189 @@
+////////////////////////////////////////////////////////////
+//
+// RedRelay - a Lacewing Relay protocol reimplementation
+// Copyright (c) 2019 LekKit (LekKit#4400 in Discord)
+//
+// This software is provided 'as-is', without any express or implied
+// warranty. In no event will the authors be held liable for any damages
+// arising from the use of this software.
+//
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+//
+// 1. The origin of this software must not be misrepresented; you must not
+//   claim that you wrote the original software. If you use this software
+//   in a product, an acknowledgment in the product documentation would be
+//   appreciated but is not required.
+// 2. Altered source versions must be plainly marked as such, and must not be
+//   misrepresented as being the original software.
+// 3. This notice may not be removed or altered from any source distribution.
+//
+////////////////////////////////////////////////////////////
+
+
+#include "RedRelayServer.hpp"
+#include <chrono>
+#include <cstdio>
+
+namespace rs{
+
+static std::atomic<uint8_t> NextShard(0);
+static thread_local uint8_t ShardIndex = 255; //Assigned on the first update made by a thread
+
+static const char* EventNames[Metrics::Events][2] = {
+	{"redrelay_connects_total", "Peers that completed the handshake"},
+	{"redrelay_disconnects_total", "Peers that left the server"},
+	{"redrelay_connect_denies_total", "Connections denied by the server or the connect callback"},
+	{"redrelay_name_denies_total", "Denied name changes"},
+	{"redrelay_channel_denies_total", "Denied channel joins"},
+	{"redrelay_ping_timeouts_total", "Peers dropped for not answering pings"},
+	{"redrelay_handshake_timeouts_total", "Connections dropped for not completing the handshake in time"},
+	{"redrelay_slow_peer_drops_total", "Peers dropped for exceeding the send queue limit"},
+	{"redrelay_oversized_drops_total", "Peers dropped for sending a message above the size limit"},
+	{"redrelay_conflated_blasts_total", "Blasts superseded by a newer one on a conflated subchannel before being sent"},
+	{"redrelay_flood_drops_total", "Messages dropped for exceeding an ingress rate limit"},
+	{"redrelay_flood_throttles_total", "Times reading from a peer was paused for exceeding an ingress rate limit"},
+	{"redrelay_flood_disconnects_total", "Peers dropped for exceeding an ingress rate limit"},
+	{"redrelay_paced_drops_total", "Datagrams dropped from full egress queues of paced peers"}
+};
+
+static const char* GaugeNames[Metrics::Gauges][2] = {
+	{"redrelay_connections", "Connections waiting for the handshake"},
+	{"redrelay_peers", "Connected peers"},
+	{"redrelay_channels", "Open channels"},
+	{"redrelay_queued_bytes", "Outbound data waiting in peer send queues"},
+	{"redrelay_paced_bytes", "Datagrams waiting for the egress rate of their receivers"},
+	{"redrelay_pending_decisions", "Requests waiting for the host to complete a deferred decision"}
+};
+
+static const char* HistogramNames[Metrics::Histograms][2] = {
+	{"redrelay_loop_seconds", "Time spent handling a single event loop wakeup"},
+	{"redrelay_tcp_handler_seconds", "Time spent handling a single TCP message"},
+	{"redrelay_udp_handler_seconds", "Time spent handling a single datagram"}
+};
+
+static const char* KindNames[] = {"control", "channel", "peer"};
+static const char* ProtocolNames[] = {"tcp", "udp"};
+
+uint64_t Metrics::Now(){
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+Metrics::Shard& Metrics::Local(){
+	if (ShardIndex == 255) ShardIndex = NextShard.fetch_add(1, std::memory_order_relaxed)%Shards;
+	return Data[ShardIndex];
+}
+
+Metrics::Kind Metrics::KindOf(uint8_t Type){ //Message type is kept in the high nibble
+	if (Type>>4 == 2 || Type>>4 == 12) return ChannelMessage; //Including blasts aggregated over a channel tick
+	if (Type>>4 == 3) return PeerMessage;
+	return Control;
+}
+
+void Metrics::Traffic(std::atomic<uint64_t> (&Messages)[2][Kinds], std::atomic<uint64_t> (&Bytes)[2][Kinds], uint8_t Protocol, uint8_t Type, std::size_t Size){
+	Kind kind = KindOf(Type);
+	Messages[Protocol][kind].fetch_add(1, std::memory_order_relaxed);
+	Bytes[Protocol][kind].fetch_add(Size, std::memory_order_relaxed);
+}
+
+void Metrics::TcpIn(uint8_t Type, std::size_t Size){
+	Shard& shard = Local();
+	Traffic(shard.MessagesIn, shard.BytesIn, 0, Type, Size);
+}
+
+void Metrics::TcpOut(uint8_t Type, std::size_t Size){
+	Shard& shard = Local();
+	Traffic(shard.MessagesOut, shard.BytesOut, 0, Type, Size);
+}
+
+void Metrics::UdpIn(uint8_t Type, std::size_t Size){
+	Shard& shard = Local();
+	Traffic(shard.MessagesIn, shard.BytesIn, 1, Type, Size);
+}
+
+void Metrics::UdpOut(uint8_t Type, std::size_t Size){
+	Shard& shard = Local();
+	Traffic(shard.MessagesOut, shard.BytesOut, 1, Type, Size);
+}
+
+void Metrics::Count(Event Event){
+	Local().EventCount[Event].fetch_add(1, std::memory_order_relaxed);
+}
+
+void Metrics::Adjust(Gauge Gauge, int64_t Delta){
+	Local().GaugeValue[Gauge].fetch_add(Delta, std::memory_order_relaxed);
+}
+
+void Metrics::ResetGauges(){
+	for (uint8_t i=0; i<Shards; ++i) for (uint8_t j=0; j<Gauges; ++j) Data[i].GaugeValue[j].store(0, std::memory_order_relaxed);
+}
+
+void Metrics::Observe(Histogram Histogram, uint64_t Nanoseconds){
+	uint64_t micros = Nanoseconds/1000;
+	uint8_t bucket = 0;
+	while (bucket < Buckets-1 && (1ULL<<bucket) < micros) bucket++;
+	Shard& shard = Local();
+	shard.Bucket[Histogram][bucket].fetch_add(1, std::memory_order_relaxed);
+	shard.Sum[Histogram].fetch_add(Nanoseconds, std::memory_order_relaxed);
+}
+
+static void Header(std::string& Out, const char* Name, const char* Help, const char* Type){
+	Out += std::string("# HELP ")+Name+" "+Help+"\n# TYPE "+Name+" "+Type+"\n";
+}
+
+std::string Metrics::Export() const {
+	std::string out;
+	static const char* TrafficNames[4][2] = {
+		{"redrelay_messages_in_total", "Messages received from peers"},
+		{"redrelay_bytes_in_total", "Payload bytes received from peers"},
+		{"redrelay_messages_out_total", "Messages sent to peers, including queued ones"},
+		{"redrelay_bytes_out_total", "Bytes sent to peers, including queued ones"}
+	};
+	for (uint8_t t=0; t<4; ++t){
+		Header(out, TrafficNames[t][0], TrafficNames[t][1], "counter");
+		for (uint8_t protocol=0; protocol<2; ++protocol) for (uint8_t kind=0; kind<Kinds; ++kind){
+			uint64_t total = 0;
+			for (uint8_t i=0; i<Shards; ++i){
+				const Shard& shard = Data[i];
+				const std::atomic<uint64_t> (&value)[2][Kinds] = t==0 ? shard.MessagesIn : t==1 ? shard.BytesIn : t==2 ? shard.MessagesOut : shard.BytesOut;
+				total += value[protocol][kind].load(std::memory_order_relaxed);
+			}
+			out += std::string(TrafficNames[t][0])+"{protocol=\""+ProtocolNames[protocol]+"\",type=\""+KindNames[kind]+"\"} "+std::to_string(total)+"\n";
+		}
+	}
+	for (uint8_t e=0; e<Events; ++e){
+		uint64_t total = 0;
+		for (uint8_t i=0; i<Shards; ++i) total += Data[i].EventCount[e].load(std::memory_order_relaxed);
+		Header(out, EventNames[e][0], EventNames[e][1], "counter");
+		out += std::string(EventNames[e][0])+" "+std::to_string(total)+"\n";
+	}
+	for (uint8_t g=0; g<Gauges; ++g){
+		int64_t total = 0;
+		for (uint8_t i=0; i<Shards; ++i) total += Data[i].GaugeValue[g].load(std::memory_order_relaxed);
+		Header(out, GaugeNames[g][0], GaugeNames[g][1], "gauge");
+		out += std::string(GaugeNames[g][0])+" "+std::to_string(total > 0 ? total : 0)+"\n"; //Shards are read one by one, the sum may be briefly off
+	}
+	for (uint8_t h=0; h<Histograms; ++h){
+		uint64_t cumulative = 0, sum = 0;
+		Header(out, HistogramNames[h][0], HistogramNames[h][1], "histogram");
+		for (uint8_t b=0; b<Buckets; ++b){
+			for (uint8_t i=0; i<Shards; ++i) cumulative += Data[i].Bucket[h][b].load(std::memory_order_relaxed);
+			std::string bound = "+Inf";
+			if (b < Buckets-1){
+				char tmp[32];
+				snprintf(tmp, sizeof(tmp), "%g", (1ULL<<b)*1e-6);
+				bound = tmp;
+			}
+			out += std::string(HistogramNames[h][0])+"_bucket{le=\""+bound+"\"} "+std::to_string(cumulative)+"\n";
+		}
+		for (uint8_t i=0; i<Shards; ++i) sum += Data[i].Sum[h].load(std::memory_order_relaxed);
+		char tmp[32];
+		snprintf(tmp, sizeof(tmp), "%.9f", sum*1e-9);
+		out += std::string(HistogramNames[h][0])+"_sum "+tmp+"\n";
+		out += std::string(HistogramNames[h][0])+"_count "+std::to_string(cumulative)+"\n";
+	}
+	return out;
+}
+
+}
@@ -2,8 +2,8 @@
 //
 // This is an altered "Socket.hpp" header of SFML Network library.
 // Modified by LekKit for Epoll support in RedRelay Server.
-// Purpose: public access & inlining getHandle() 
-// Altered lines: 149 - 153
+// Purpose: public access & inlining getHandle(), wrapping accepted handles
+// Altered lines: 149 - 156
 //
 ////////////////////////////////////////////////////////////
 
@@ -151,6 +151,9 @@ public:
 	inline SocketHandle GetHandle() const{
 		return m_socket;
 	}
+	inline void Adopt(SocketHandle handle){
+		create(handle);
+	}
 protected:
 
     ////////////////////////////////////////////////////////////
@@ -0,0 +1,102 @@
+////////////////////////////////////////////////////////////
+//
+// RedRelay - a Lacewing Relay protocol reimplementation
+// Copyright (c) 2019 LekKit (LekKit#4400 in Discord)
+//
+// This software is provided 'as-is', without any express or implied
+// warranty. In no event will the authors be held liable for any damages
+// arising from the use of this software.
+//
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+//
+// 1. The origin of this software must not be misrepresented; you must not
+//   claim that you wrote the original software. If you use this software
+//   in a product, an acknowledgment in the product documentation would be
+//   appreciated but is not required.
+// 2. Altered source versions must be plainly marked as such, and must not be
+//   misrepresented as being the original software.
+// 3. This notice may not be removed or altered from any source distribution.
+//
+////////////////////////////////////////////////////////////
+
+
+#include "RedRelayServer.hpp"
+
+namespace rs{
+
+//////////////////
+// MessageQueue //
+//////////////////
+
+MessageQueue::MessageQueue(){
+	tail = new ReactorMessage;
+	tail->next.store(NULL, std::memory_order_relaxed);
+	head.store(tail, std::memory_order_relaxed);
+}
+
+MessageQueue::~MessageQueue(){
+	while (tail != NULL){
+		ReactorMessage* next = tail->next.load(std::memory_order_relaxed);
+		delete tail;
+		tail = next;
+	}
+}
+
+void MessageQueue::Push(ReactorMessage* Message){
+	Message->next.store(NULL, std::memory_order_relaxed);
+	ReactorMessage* prev = head.exchange(Message, std::memory_order_acq_rel);
+	prev->next.store(Message, std::memory_order_release);
+}
+
+bool MessageQueue::Pop(ReactorMessage& Message){
+	ReactorMessage* next = tail->next.load(std::memory_order_acquire);
+	if (next == NULL) return false;
+	Message.Type = next->Type;
+	Message.PeerID = next->PeerID;
+	Message.Serial = next->Serial;
+	Message.Buffer.swap(next->Buffer);
+	delete tail;
+	tail = next; //Popped node becomes the new dummy
+	return true;
+}
+
+/////////////
+// Reactor //
+/////////////
+
+Reactor::Reactor(EpollSelector* MainSelector){
+	OwnsSelector = MainSelector == NULL;
+	Selector = OwnsSelector ? new EpollSelector : MainSelector;
+	Signaled.store(false);
+	Waker.setBlocking(false);
+	if (Waker.bind(sf::Socket::AnyPort, sf::IpAddress::LocalHost) == sf::Socket::Done) WakerPort = Waker.getLocalPort();
+	Selector->add(Waker, 2);
+}
+
+Reactor::~Reactor(){
+	Selector->remove(Waker);
+	if (OwnsSelector) delete Selector;
+}
+
+void Reactor::Post(ReactorMessage* Message){
+	Inbox.Push(Message);
+	Wake();
+}
+
+void Reactor::Wake(){
+	if (Signaled.exchange(true)) return; //Wakeup is pending already
+	char tmp = 0;
+	Waker.send(&tmp, 1, sf::IpAddress::LocalHost, WakerPort);
+}
+
+void Reactor::Drain(){
+	char tmp[16];
+	std::size_t received;
+	sf::IpAddress Address; uint16_t Port;
+	while (Waker.receive(tmp, sizeof(tmp), received, Address, Port) == sf::Socket::Done);
+	Signaled.store(false);
+}
+
+}
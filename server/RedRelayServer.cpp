@@ -21,45 +21,142 @@
 //
 ////////////////////////////////////////////////////////////
 
+#include "ModSocket.hpp"
 #include "RedRelayServer.hpp"
 #include "Platform.hpp"
-#include "ConsoleColors.hpp"
 #include <streambuf>
+#include <algorithm>
 #include <iostream>
+#include <fstream>
+#include <cstdio>
 #include <cstring>
 #include <csignal>
+#ifdef _WIN32
+#include <winsock2.h>
+#else
+#include <cerrno>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#endif
+
+#ifndef MSG_NOSIGNAL
+    #define MSG_NOSIGNAL 0
+#endif
+
+static const uint32_t ReadBudget = 262144; //Bytes read from one peer per wakeup, so a fast sender can't starve the rest
+#ifndef REDRELAY_EPOLL
+static const uint64_t DecisionPoll = 10; //Milliseconds between checks for completed decisions, nothing wakes the loop up
+#endif
+static const uint32_t CutThroughChunk = 65536; //Receive buffer of a peer sending a forwarded message
+static const uint32_t CutThroughWindow = 1048576; //Forwarded data queued for a receiver before reading from the sender pauses
+static const uint64_t ForwardPoll = 5; //Milliseconds between checks of a paused sender's receivers
+static const uint32_t WriteBudget = 262144; //Bytes written to one peer per turn, peers with more queued take turns round robin
+static const uint32_t AcceptBudget = 64; //Connections accepted per wakeup
+static const uint32_t CoalesceSize = 4096; //Larger messages are written right away even with coalescing enabled
+static const uint32_t CoalesceLimit = 65536; //Coalesced data written before the end of loop iteration once this much is queued
+static const uint32_t TickDatagramSize = 1400; //Aggregated blasts are split into datagrams that fit a typical MTU
+static const uint32_t TickBacklogLimit = 262144; //Blasts held by a channel before its tick is sent early
+static const double EgressBurst = 0.1; //Seconds of its egress rate a peer may get at once after being idle
+static const uint32_t HeldBlastSize = 65500; //Bigger blasts wouldn't fit with the tick header, they are relayed right away
 
 #ifdef REDRELAY_DEVBUILD
-    #define DebugLog(a) Log(a, 12)
+    #define DebugLog(a) Log(a, 12, Logger::Debug)
 #else
     #define DebugLog
 #endif
 namespace rs{
 
-float RedRelayServer::DeltaTime(){
-	return DeltaClock.restart().asMilliseconds()*0.001f;
+//Writes several buffers with a single syscall, so headers and payloads leave in the same segment
+static sf::Socket::Status SendVector(sf::TcpSocket& Socket, const char** Data, const std::size_t* Sizes, std::size_t Count, std::size_t& Sent){
+	std::size_t total = 0;
+	Sent = 0;
+#ifdef _WIN32
+	WSABUF buffers[16];
+	for (std::size_t i=0; i<Count; ++i){
+		buffers[i].buf = (char*)Data[i];
+		buffers[i].len = Sizes[i];
+		total += Sizes[i];
+	}
+	DWORD written = 0;
+	if (WSASend(Socket.GetHandle(), buffers, Count, &written, 0, NULL, NULL) == SOCKET_ERROR)
+		return WSAGetLastError() == WSAEWOULDBLOCK ? sf::Socket::NotReady : sf::Socket::Disconnected;
+	Sent = written;
+#else
+	iovec buffers[16];
+	for (std::size_t i=0; i<Count; ++i){
+		buffers[i].iov_base = (void*)Data[i];
+		buffers[i].iov_len = Sizes[i];
+		total += Sizes[i];
+	}
+	msghdr message;
+	memset(&message, 0, sizeof(message));
+	message.msg_iov = buffers;
+	message.msg_iovlen = Count;
+	ssize_t written;
+	do written = sendmsg(Socket.GetHandle(), &message, MSG_NOSIGNAL);
+	while (written < 0 && errno == EINTR);
+	if (written < 0) return (errno == EAGAIN || errno == EWOULDBLOCK) ? sf::Socket::NotReady : sf::Socket::Disconnected;
+	Sent = written;
+#endif
+	return Sent == total ? sf::Socket::Done : sf::Socket::Partial;
+}
+
+static SharedBuffer MakeShared(const char* Data, std::size_t Size, const char* Payload, std::size_t PayloadSize){
+	std::vector<char>* Buffer = new std::vector<char>(Size+PayloadSize);
+	memcpy(&(*Buffer)[0], Data, Size);
+	if (PayloadSize) memcpy(&(*Buffer)[Size], Payload, PayloadSize);
+	return SharedBuffer(Buffer);
+}
+
+static uint8_t FrameHeader(char* Header, uint8_t Type, uint32_t Size){ //Returns the header size
+	Header[0]=Type;
+	if (Size<254){
+		Header[1]=Size;
+		return 2;
+	}
+	if (Size<65535){
+		Header[1]=(uint8_t)254;
+		Header[2]=Size&255;
+		Header[3]=(Size>>8)&255;
+		return 4;
+	}
+	Header[1]=(uint8_t)255;
+	Header[2]=Size&255;
+	Header[3]=(Size>>8)&255;
+	Header[4]=(Size>>16)&255;
+	Header[5]=(Size>>24)&255;
+	return 6;
+}
+
+static bool ChangesMembership(const char* Frame, std::size_t Size){ //Leave responses and peer list changes
+	uint8_t type = (uint8_t)Frame[0]>>4;
+	if (type == 9) return true;
+	std::size_t offset = Size > 1 ? ((uint8_t)Frame[1] < 254 ? 2 : (uint8_t)Frame[1] == 254 ? 4 : 6) : Size;
+	return type == 0 && offset < Size && Frame[offset] == 3;
 }
 
-static std::string DualDigit(uint8_t num){
-	std::string str = std::to_string(num);
-	return ("00"+str).substr(str.length(), 2);
+#ifdef REDRELAY_EPOLL
+static thread_local uint8_t CurrentReactor = 255; //Reactor running in the calling thread, 255 for foreign threads
+#endif
+static thread_local std::vector<RelayTarget> Relayed; //Receivers of the message being relayed by the calling thread
+
+static uint64_t Milliseconds(){
+	return Metrics::Now()/1000000;
 }
 
-void RedRelayServer::Log(std::string message, uint8_t color){
-	if (!LoggingEnabled) return;
-	ChangeConsoleColor(15);
-	time_t now = time(0);
-    struct tm* time = localtime(&now);
-	std::cout<<"["<<DualDigit(time->tm_hour)<<":"<<DualDigit(time->tm_min)<<":"<<DualDigit(time->tm_sec)<<"] ";
-	ChangeConsoleColor(color);
-	std::cout<<message<<std::endl;
+void RedRelayServer::Log(std::string message, uint8_t color, uint8_t Level){
+	if (!LoggingEnabled || Level > Logs.GetLevel()) return;
+	Logs.Push(color, message); //Formatted and written by the logger thread
 }
 
 void RedRelayServer::DropConnection(uint16_t ID){
 	if (!ConnectionsPool.Allocated(ID)) return;
+	if (ConnectionsPool[ID].Ticket != 0) Unpark(ID, 0);
+	Timers.Cancel(PeersLimit+ID);
 	Selector.remove(*ConnectionsPool[ID].Socket);
 	delete ConnectionsPool[ID].Socket;
 	ConnectionsPool.Deallocate(ID);
+	Stats.Adjust(Metrics::Connections, -1);
 }
 
 void RedRelayServer::DenyConnection(uint16_t ID, const std::string& Reason){
@@ -68,6 +165,7 @@ void RedRelayServer::DenyConnection(uint16_t ID, const std::string& Reason){
 	packet.AddByte(0);
 	packet.AddByte(false);
 	packet.AddString(Reason);
+	Stats.Count(Metrics::ConnectDenies);
 	ConnectionsPool[ID].Socket->send(packet.GetPacket(), packet.GetPacketSize());
 	DropConnection(ID);
 }
@@ -80,7 +178,8 @@ void RedRelayServer::DenyNameChange(uint16_t ID, const std::string& Name, const
 	packet.AddByte(Name.length());
 	packet.AddString(Name);
 	packet.AddString(Reason);
-	PeersPool[ID].Socket->send(packet.GetPacket(), packet.GetPacketSize());
+	Stats.Count(Metrics::NameDenies);
+	SendTcp(ID, packet.GetPacket(), packet.GetPacketSize());
 }
 
 void RedRelayServer::DenyChannelJoin(uint16_t ID, const std::string& Name, const std::string& Reason){
@@ -91,7 +190,8 @@ void RedRelayServer::DenyChannelJoin(uint16_t ID, const std::string& Name, const
 	packet.AddByte(Name.length());
 	packet.AddString(Name);
 	packet.AddString(Reason);
-	PeersPool[ID].Socket->send(packet.GetPacket(), packet.GetPacketSize());
+	Stats.Count(Metrics::ChannelDenies);
+	SendTcp(ID, packet.GetPacket(), packet.GetPacketSize());
 }
 
 void RedRelayServer::PeerLeftChannel(uint16_t Channel, uint16_t Peer){
@@ -100,7 +200,7 @@ void RedRelayServer::PeerLeftChannel(uint16_t Channel, uint16_t Peer){
 	packet.AddShort(Channel);
 	packet.AddShort(Peer);
 	for (uint16_t peerID : ChannelsPool[Channel].Peers)
-		PeersPool[peerID].Socket->send(packet.GetPacket(), packet.GetPacketSize());
+		SendTcp(peerID, packet.GetPacket(), packet.GetPacketSize());
 }
 
 void RedRelayServer::PeerDroppedFromChannel(uint16_t Channel, uint16_t Peer){
@@ -109,9 +209,332 @@ void RedRelayServer::PeerDroppedFromChannel(uint16_t Channel, uint16_t Peer){
 	packet.AddByte(3);
 	packet.AddByte(true);
 	packet.AddShort(Channel);
-	PeersPool[Peer].Socket->send(packet.GetPacket(), packet.GetPacketSize());
+	SendTcp(Peer, packet.GetPacket(), packet.GetPacketSize());
+}
+
+void RedRelayServer::ScheduleDrop(uint16_t ID){
+	sf::Lock lock(StateMutex);
+	if (!PeersPool.Allocated(ID) || PeersPool[ID].Dropping.load(std::memory_order_acquire)) return;
+	PeersPool[ID].Dropping.store(true, std::memory_order_release);
+	DropQueue.push_back(ID);
+#ifdef REDRELAY_EPOLL
+	if (PeersPool[ID].ReactorID != CurrentReactor) Reactors[PeersPool[ID].ReactorID]->Wake();
+#endif
+}
+
+void RedRelayServer::DropScheduled(){ //Each reactor drops its own peers only
+	uint32_t kept=0;
+	for (uint32_t i=0; i<DropQueue.size(); ++i){
+		uint16_t peerID = DropQueue[i];
+		if (!PeersPool.Allocated(peerID) || !PeersPool[peerID].Dropping.load(std::memory_order_acquire)) continue;
+	#ifdef REDRELAY_EPOLL
+		if (PeersPool[peerID].ReactorID != CurrentReactor){
+			DropQueue[kept++] = peerID;
+			continue;
+		}
+	#endif
+		DropPeer(peerID);
+	}
+	DropQueue.resize(kept);
+}
+
+#ifdef REDRELAY_EPOLL
+EpollSelector& RedRelayServer::SelectorOf(uint16_t PeerID){
+	return *Reactors[PeersPool[PeerID].ReactorID]->Selector;
+}
+
+void RedRelayServer::AssignReactor(uint16_t PeerID){ //Round-robin handoff of a new peer
+	Peer& Peer = PeersPool[PeerID];
+	Peer.ReactorID = NextReactor;
+	NextReactor = (NextReactor+1)%Reactors.size();
+	if (Peer.ReactorID == 0){
+		Reactors[0]->Owned[PeerID] = Peer.Serial;
+		Selector.mod(*Peer.Socket, PeerID|0x20000, false, true);
+	} else {
+		Selector.remove(*Peer.Socket);
+		ReactorMessage* Message = new ReactorMessage;
+		Message->Type = ReactorMessage::Adopt;
+		Message->PeerID = PeerID;
+		Message->Serial = Peer.Serial;
+		Reactors[Peer.ReactorID]->Post(Message);
+	}
+}
+
+void RedRelayServer::HandleInbox(uint8_t Index){
+	Reactor& Reactor = *Reactors[Index];
+	ReactorMessage Message;
+	while (Reactor.Inbox.Pop(Message)){
+		if (Message.Type == ReactorMessage::Adopt){
+			Reactor.Owned[Message.PeerID] = Message.Serial;
+			Reactor.Selector->add(*PeersPool[Message.PeerID].Socket, Message.PeerID|0x20000, false, true);
+		} else if (Reactor.Owned[Message.PeerID] == Message.Serial) //Otherwise the peer is gone already
+			SendTcp(Message.PeerID, &(*Message.Buffer)[0], Message.Buffer->size(), NULL, 0, &Message.Buffer);
+	}
+}
+
+void RedRelayServer::PostTcp(const RelayTarget& Target, const char* Data, std::size_t Size, const char* Payload, std::size_t PayloadSize, SharedBuffer& Shared){
+	if (!Shared) Shared = MakeShared(Data, Size, Payload, PayloadSize);
+	ReactorMessage* Message = new ReactorMessage;
+	Message->PeerID = Target.PeerID;
+	Message->Serial = Target.Serial;
+	Message->Buffer = Shared;
+	Reactors[Target.ReactorID]->Post(Message);
+}
+
+void RedRelayServer::ReadBacklog(uint8_t Index){ //Peers which still had data after their read budget, served after fresh events
+	Reactor& Reactor = *Reactors[Index];
+	std::vector<uint16_t> pending;
+	pending.swap(Reactor.Backlog);
+	for (uint16_t peerID : pending){
+		if (Reactor.Owned[peerID] == 0 || !PeersPool[peerID].Backlogged) continue; //Dropped or replaced meanwhile
+		PeersPool[peerID].Backlogged = false;
+		ReceiveTcp(peerID);
+	}
+}
+
+void RedRelayServer::RunReactor(uint8_t Index){
+	CurrentReactor = Index;
+	Reactor& Reactor = *Reactors[Index];
+	while (Running){
+		SubmitSends(Index);
+		uint32_t timeout = 1000;
+		if (!Reactor.Backlog.empty() || !Reactor.Unsent.empty()) timeout = 0;
+		else {
+			sf::Lock lock(StateMutex);
+			uint64_t now = Milliseconds(), next = NextResume();
+			if (next < now+timeout) timeout = next > now ? next-now : 1;
+		}
+		uint32_t events = Reactor.Selector->wait(timeout);
+		uint64_t start = Metrics::Now();
+		for (uint32_t i=0; i<events; ++i){
+			uint32_t id = Reactor.Selector->at(i);
+			if (id == 2) Reactor.Drain();
+			else if ((id&0x20000) != 0) PeerEvent(*Reactor.Selector, i);
+		}
+		ReadBacklog(Index);
+		HandleInbox(Index);
+		sf::Lock lock(StateMutex);
+		DropScheduled();
+		ResumeReads();
+		Stats.Observe(Metrics::LoopTime, Metrics::Now()-start);
+	}
+}
+
+void RedRelayServer::PeerEvent(EpollSelector& Selector, uint32_t Index){
+	uint16_t peerID = Selector.at(Index)&65535;
+#ifdef REDRELAY_URING //Completions carry the data, the socket isn't touched
+	int sent;
+	std::size_t size;
+	const char* data = Selector.data(Index, size);
+	if (Selector.sent(Index, sent)) FlushPeer(peerID, sent);
+	else if (data != NULL) ReceiveTcp(peerID, data, size);
+	else if (Selector.readable(Index)){ //Connection closed
+		sf::Lock lock(StateMutex);
+		DropPeer(peerID);
+	}
+#else
+	if (Selector.writable(Index)) FlushPeer(peerID);
+	if (Selector.readable(Index)) ReceiveTcp(peerID);
+#endif
+}
+
+void RedRelayServer::SubmitSends(uint8_t Index){ //Fan-out of the whole loop iteration is written together before the next wait
+	Reactor& Reactor = *Reactors[Index];
+	std::vector<uint16_t> pending;
+	pending.swap(Reactor.Unsent); //Peers out of write budget line up again for the next turn
+	for (uint16_t peerID : pending){
+		if (Reactor.Owned[peerID] == 0) continue; //Dropped meanwhile
+		Peer& Peer = PeersPool[peerID];
+	#ifndef REDRELAY_URING
+		Peer.Sending = false;
+		if (Peer.Blocked) FlushPeer(peerID); //Used up its write budget, the socket may well be writable still
+		else WriteCoalesced(peerID);
+	#else
+		if (Peer.Outgoing.Empty()) Peer.ScheduleLanes();
+		if (Peer.Outgoing.Empty()){
+			Peer.Sending = false;
+			continue;
+		}
+		const char* data[16];
+		std::size_t sizes[16];
+		std::size_t count = Peer.Outgoing.Gather(data, sizes, 16);
+		if (!Reactor.Selector->send(*Peer.Socket, data, sizes, count)) continue; //In flight already
+		Peer.Outgoing.Seal();
+		Peer.Submitted = 0;
+		for (std::size_t i=0; i<count; ++i) Peer.Submitted += sizes[i];
+	#endif
+	}
+}
+#endif
+
+void RedRelayServer::SendTcp(uint16_t PeerID, const char* Data, std::size_t Size, const char* Payload, std::size_t PayloadSize, SharedBuffer* Shared){
+	Peer& Peer = PeersPool[PeerID];
+	if (Peer.Dropping.load(std::memory_order_acquire)) return;
+	SharedBuffer Local;
+	if (Shared == NULL) Shared = &Local;
+#ifdef REDRELAY_EPOLL
+	if (Peer.ReactorID != CurrentReactor){ //Socket belongs to another thread, pass a reference over
+		RelayTarget Target = {PeerID, Peer.Serial, Peer.ReactorID};
+		PostTcp(Target, Data, Size, Payload, PayloadSize, *Shared);
+		return;
+	}
+#endif
+	Stats.TcpOut(Data[0], Size+PayloadSize);
+	std::size_t limit = SendQueueLimit;
+#ifdef REDRELAY_URING
+	bool Pending = true; //Always queued, sent asynchronously once the loop iteration is over
+	limit = Peer.Submitted ? limit+Peer.Submitted : (std::size_t)-1; //Only data waiting behind a send in flight counts, the rest stands for direct writes
+	bool Coalesce = false;
+#else
+	bool Pending = Peer.Queued() != 0 || Peer.Streamed;
+	bool Coalesce = CoalesceWrites && Size+PayloadSize <= CoalesceSize; //Copied behind the rest, written once the loop iteration is over
+#endif
+	std::size_t sent = 0;
+	if (!Pending && !Coalesce){ //Nothing queued, try to write directly
+		const char* data[2] = {Data, Payload};
+		std::size_t sizes[2] = {Size, PayloadSize};
+		sf::Socket::Status status = SendVector(*Peer.Socket, data, sizes, PayloadSize ? 2 : 1, sent);
+		if (status == sf::Socket::Done) return;
+		if (status != sf::Socket::Partial && status != sf::Socket::NotReady){
+			ScheduleDrop(PeerID);
+			return;
+		}
+	}
+	if (Peer.Queued()+Size+PayloadSize-sent > limit){
+		if (DisconnectSlowPeers || sent){ //Once a part of the message is out, skipping the rest would break the stream
+			sf::Lock lock(StateMutex);
+			Log(std::to_string(PeerID)+" | Peer "+Peer.Name+" dropped, send queue overflow", 4, Logger::Warning);
+			Stats.Count(Metrics::SlowPeerDrops);
+			ScheduleDrop(PeerID);
+		}
+		return;
+	}
+	SendQueue* queue = &Peer.Outgoing; //Rest of a partly written frame has to go first
+	if (sent == 0){
+		uint8_t laneID = LaneOf(Data, Size);
+		if (laneID == ControlLane && Peer.Laned != Peer.Lanes[ControlLane].Data.Size() && ChangesMembership(Data, Size))
+			Peer.PromoteLanes(); //Channel messages sent before a leave must not arrive after it
+		SendLane& lane = Peer.Lanes[laneID];
+		lane.Frames.push_back(Size+PayloadSize);
+		Peer.Laned += Size+PayloadSize;
+		queue = &lane.Data;
+	}
+	if (Shared != &Local && !Coalesce){ //Broadcast, every lagging receiver references the same copy
+		if (!*Shared) *Shared = MakeShared(Data, Size, Payload, PayloadSize);
+		queue->Push(*Shared, sent, (std::size_t)-1);
+	} else if (sent < Size){
+		queue->Push(&Data[sent], Size-sent, (std::size_t)-1);
+		queue->Push(Payload, PayloadSize, (std::size_t)-1);
+	} else queue->Push(&Payload[sent-Size], Size+PayloadSize-sent, (std::size_t)-1);
+	Stats.Adjust(Metrics::QueuedBytes, Size+PayloadSize-sent);
+#ifdef REDRELAY_URING
+	if (!Peer.Sending){
+		Peer.Sending = true;
+		Reactors[Peer.ReactorID]->Unsent.push_back(PeerID);
+	}
+#else
+	if (Coalesce && !Peer.Sending && !Peer.Blocked){
+	#ifdef REDRELAY_EPOLL
+		Peer.Sending = true;
+		Reactors[Peer.ReactorID]->Unsent.push_back(PeerID);
+	#else
+		PendingData = true;
+	#endif
+	} else if (!Pending && !Coalesce) WaitWritable(PeerID);
+	if (Peer.Sending && Peer.Queued() >= CoalesceLimit) WriteCoalesced(PeerID); //Bounds the delay and the memory held by chatty channels
+#endif
+}
+
+uint8_t RedRelayServer::LaneOf(const char* Frame, std::size_t Size) const {
+	uint8_t type = (uint8_t)Frame[0]>>4;
+	if (type < 1 || type > 3) return ControlLane; //Anything but relayed messages
+	std::size_t offset = Size > 1 ? ((uint8_t)Frame[1] < 254 ? 2 : (uint8_t)Frame[1] == 254 ? 4 : 6) : Size;
+	if (offset >= Size) return BulkLane;
+	return SubchannelPriorities[(uint8_t)Frame[offset]] != 0 ? PriorityLane : BulkLane;
+}
+
+void RedRelayServer::WaitWritable(uint16_t PeerID){
+#ifdef REDRELAY_EPOLL
+	Peer& Peer = PeersPool[PeerID];
+	if (Peer.Blocked) return;
+	Peer.Blocked = true;
+	SelectorOf(PeerID).mod(*Peer.Socket, PeerID|0x20000, true, true, !Peer.Throttled);
+#else
+	(void)PeerID; //Every peer is polled for writability
+	PendingData = true;
+#endif
 }
 
+void RedRelayServer::WriteCoalesced(uint16_t PeerID){
+	Peer& Peer = PeersPool[PeerID];
+	if (Peer.Blocked || Peer.Dropping.load(std::memory_order_acquire)) return; //Written once the socket is writable again
+	FlushPeer(PeerID);
+	if (Peer.Queued() != 0 && !Peer.Dropping.load(std::memory_order_acquire) && !Peer.Sending) WaitWritable(PeerID);
+}
+
+void RedRelayServer::BroadcastTcp(uint16_t ChannelID, uint16_t Sender, const char* Header, std::size_t HeaderSize, const char* Payload, std::size_t PayloadSize){
+	SharedBuffer Shared; //Copied once, only if some receiver can't take the message right away
+	for (uint16_t peerID : ChannelsPool[ChannelID].Peers) if (peerID!=Sender)
+		SendTcp(peerID, Header, HeaderSize, Payload, PayloadSize, &Shared);
+}
+
+void RedRelayServer::FlushPeer(uint16_t PeerID){
+	Peer& Peer = PeersPool[PeerID];
+	uint32_t budget = WriteBudget;
+	for (;;){
+		if (Peer.Outgoing.Empty()) Peer.ScheduleLanes();
+		if (Peer.Outgoing.Empty()) break;
+		if (budget == 0){ //Other peers get their turn first
+		#ifdef REDRELAY_EPOLL
+			if (!Peer.Sending){
+				Peer.Sending = true;
+				Reactors[Peer.ReactorID]->Unsent.push_back(PeerID);
+			}
+		#else
+			PendingData = true;
+		#endif
+			return;
+		}
+		const char* data[16];
+		std::size_t sizes[16], sent;
+		std::size_t count = Peer.Outgoing.Gather(data, sizes, 16);
+		sf::Socket::Status status = SendVector(*Peer.Socket, data, sizes, count, sent);
+		Peer.Outgoing.Pop(sent);
+		Stats.Adjust(Metrics::QueuedBytes, -(int64_t)sent);
+		budget -= std::min<std::size_t>(sent, budget);
+		if (status == sf::Socket::Partial || status == sf::Socket::NotReady) return;
+		if (status != sf::Socket::Done){
+			Stats.Adjust(Metrics::QueuedBytes, -(int64_t)Peer.Queued());
+			Peer.ClearOutgoing();
+			ScheduleDrop(PeerID);
+			return;
+		}
+	}
+#ifdef REDRELAY_EPOLL
+	if (Peer.Blocked){
+		Peer.Blocked = false;
+		SelectorOf(PeerID).mod(*Peer.Socket, PeerID|0x20000, false, true, !Peer.Throttled);
+	}
+#endif
+}
+
+#ifdef REDRELAY_URING
+void RedRelayServer::FlushPeer(uint16_t PeerID, int Sent){ //Asynchronous send completed
+	Peer& Peer = PeersPool[PeerID];
+	if (Sent < 0){
+		Stats.Adjust(Metrics::QueuedBytes, -(int64_t)Peer.Queued());
+		Peer.ClearOutgoing();
+		ScheduleDrop(PeerID);
+		return;
+	}
+	Peer.Outgoing.Pop(Sent);
+	Peer.Submitted = 0;
+	Stats.Adjust(Metrics::QueuedBytes, -(int64_t)Sent);
+	if (Peer.Queued() == 0) Peer.Sending = false;
+	else Reactors[Peer.ReactorID]->Unsent.push_back(PeerID); //The rest goes with the next submission
+}
+#endif
+
 void RedRelayServer::HandleTCP(uint16_t ID, char* Msg, std::size_t Size, uint8_t Type){
 	Peer& Client = PeersPool[ID];
 	switch (Type>>4){
@@ -130,14 +553,16 @@ void RedRelayServer::HandleTCP(uint16_t ID, char* Msg, std::size_t Size, uint8_t
 					return;
 				}
 				if (Client.Name!=Name){
-					for (uint16_t channelID : Client.Channels) for (uint16_t peerID : ChannelsPool[channelID].Peers)
-						if (PeersPool[peerID].Name==Name){
+					for (uint16_t channelID : Client.Channels)
+						if (ChannelsPool[channelID].Names.count(Name)){
 							DenyNameChange(ID, Name, "Name already taken in channel "+ChannelsPool[channelID].Name);
 							return;
 						}
 					if (Callbacks.NameSet!=NULL){
 						std::string DenyReason;
-						if (!Callbacks.NameSet(ID, Name, DenyReason)){
+						int8_t decision = Settle(ID, Verdict.Ticket != 0 || Callbacks.NameSet(ID, Name, DenyReason), DenyReason, Msg, Size, Type);
+						if (decision < 0) return; //Parked until the host decides
+						if (!decision){
 							DenyNameChange(ID, Name, DenyReason);
 							return;
 						}
@@ -151,9 +576,10 @@ void RedRelayServer::HandleTCP(uint16_t ID, char* Msg, std::size_t Size, uint8_t
 							packet.AddShort(ID);
 							packet.AddByte(ChannelsPool[channelID].Master==ID);
 							packet.AddString(Name);
-							PeersPool[peerID].Socket->send(packet.GetPacket(), packet.GetPacketSize());
+							SendTcp(peerID, packet.GetPacket(), packet.GetPacketSize());
 						}
 				}
+				for (uint16_t channelID : Client.Channels) ChannelsPool[channelID].RenamePeer(ID, Client.Name, Name);
 				Client.Name=Name;
 				packet.Clear();
 				packet.SetType(0);
@@ -161,7 +587,7 @@ void RedRelayServer::HandleTCP(uint16_t ID, char* Msg, std::size_t Size, uint8_t
 				packet.AddByte(true);
 				packet.AddByte(Name.length());
 				packet.AddString(Name);
-				Client.Socket->send(packet.GetPacket(), packet.GetPacketSize());
+				SendTcp(ID, packet.GetPacket(), packet.GetPacketSize());
 			}
 			break;
 		case 2:
@@ -181,22 +607,35 @@ void RedRelayServer::HandleTCP(uint16_t ID, char* Msg, std::size_t Size, uint8_t
 					return;
 				}
 				if (ChannelNames.count(ChannelName) == 0){
-					if (ChannelsPool.GetAllocated().size()>=ChannelsLimit){
+					uint16_t channelID=ReservedChannel(Verdict.Ticket);
+					bool reserved=channelID<ChannelsLimit; //Created when the join was deferred, settings made by the host are kept
+					if (!reserved && ChannelsPool.GetAllocated().size()>=ChannelsLimit){
 						DenyChannelJoin(ID, ChannelName, "Channels limit reached");
 						return;
 					}
-					for (uint16_t channelID=0; channelID<ChannelsLimit; ++channelID) if (!ChannelsPool.Allocated(channelID)){
-						ChannelsPool.Allocate(channelID);
+					if (!reserved) channelID=ChannelsPool.FreeIndex(ChannelsLimit);
+					if (channelID<ChannelsLimit){
+						if (!reserved) ChannelsPool.Allocate(channelID);
+						ChannelsPool[channelID].Ticket=0;
 						ChannelNames[ChannelName]=channelID;
 						ChannelsPool[channelID].Name=ChannelName;
 						ChannelsPool[channelID].Master=ID;
 						ChannelsPool[channelID].HideFromList=HideFromList;
 						ChannelsPool[channelID].CloseOnLeave=CloseOnLeave;
-						ChannelsPool[channelID].AddPeer(ID);
+						ChannelsPool[channelID].Conflated=ConflatedSubchannels;
+						ChannelsPool[channelID].AddPeer(ID, Client.Name);
+						if (BlastTickRate != 0 && !reserved) SetChannelTickRate(channelID, BlastTickRate); //Callback may still change it
 
 						if (Callbacks.ChannelJoin!=NULL){
 							std::string DenyReason;
-							if (!Callbacks.ChannelJoin(ID, channelID, DenyReason)){
+							int8_t decision = Settle(ID, Verdict.Ticket != 0 || Callbacks.ChannelJoin(ID, channelID, DenyReason), DenyReason, Msg, Size, Type);
+							if (decision < 0){ //Channel ID stays reserved, but unnamed and empty, until the host decides
+								ChannelsPool[channelID].ErasePeer(ID, Client.Name);
+								ChannelsPool[channelID].Ticket=Parked.back().Ticket;
+								ChannelNames.erase(ChannelName);
+								return;
+							}
+							if (!decision){
 								DenyChannelJoin(ID, ChannelName, DenyReason);
 								ChannelsPool.Deallocate(channelID);
 								ChannelNames.erase(ChannelName);
@@ -204,6 +643,7 @@ void RedRelayServer::HandleTCP(uint16_t ID, char* Msg, std::size_t Size, uint8_t
 							}
 						}
 
+						Stats.Adjust(Metrics::Channels, 1);
 						Log("Created channel " + ChannelName + (HideFromList ? std::string(", hidden") : "") + (CloseOnLeave ? std::string(", closed on leave") : ""), 11);
 						Log(std::to_string(ID)+" | Peer "+PeersPool[ID].Name+" joined channel "+ChannelName, 3);
 
@@ -217,7 +657,7 @@ void RedRelayServer::HandleTCP(uint16_t ID, char* Msg, std::size_t Size, uint8_t
 						packet.AddByte(ChannelName.length());
 						packet.AddString(ChannelName);
 						packet.AddShort(channelID);
-						Client.Socket->send(packet.GetPacket(), packet.GetPacketSize());
+						SendTcp(ID, packet.GetPacket(), packet.GetPacketSize());
 						return;
 					}
 				} else {
@@ -226,14 +666,16 @@ void RedRelayServer::HandleTCP(uint16_t ID, char* Msg, std::size_t Size, uint8_t
 						DenyChannelJoin(ID, ChannelName, "You are in this channel already");
 						return;
 					}
-					for (uint16_t peerID : ChannelsPool[channelID].Peers) if (PeersPool[peerID].Name==Client.Name){
+					if (ChannelsPool[channelID].Names.count(Client.Name)){
 						DenyChannelJoin(ID, ChannelName, "Name already taken");
 						return;
 					}
 
 					if (Callbacks.ChannelJoin!=NULL){
 						std::string DenyReason;
-						if (!Callbacks.ChannelJoin(ID, channelID, DenyReason)){
+						int8_t decision = Settle(ID, Verdict.Ticket != 0 || Callbacks.ChannelJoin(ID, channelID, DenyReason), DenyReason, Msg, Size, Type);
+						if (decision < 0) return;
+						if (!decision){
 							DenyChannelJoin(ID, ChannelName, DenyReason);
 							return;
 						}
@@ -248,7 +690,7 @@ void RedRelayServer::HandleTCP(uint16_t ID, char* Msg, std::size_t Size, uint8_t
 					packet.AddByte(false);
 					packet.AddString(Client.Name);
 					for (uint16_t peerID : ChannelsPool[channelID].Peers)
-						PeersPool[peerID].Socket->send(packet.GetPacket(), packet.GetPacketSize());
+						SendTcp(peerID, packet.GetPacket(), packet.GetPacketSize());
 
 					packet.Clear();
 					packet.SetType(0);
@@ -266,9 +708,9 @@ void RedRelayServer::HandleTCP(uint16_t ID, char* Msg, std::size_t Size, uint8_t
 					}
 
 					Client.AddChannel(channelID);
-					ChannelsPool[channelID].AddPeer(ID);
+					ChannelsPool[channelID].AddPeer(ID, Client.Name);
 
-					Client.Socket->send(packet.GetPacket(), packet.GetPacketSize());
+					SendTcp(ID, packet.GetPacket(), packet.GetPacketSize());
 				}
 
 			}
@@ -281,20 +723,22 @@ void RedRelayServer::HandleTCP(uint16_t ID, char* Msg, std::size_t Size, uint8_t
 				if (Client.IsInChannel(channelID)){
 					if (Callbacks.ChannelLeave!=NULL){
 						std::string DenyReason;
-						if (!Callbacks.ChannelLeave(ID, channelID, DenyReason)){
+						int8_t decision = Settle(ID, Verdict.Ticket != 0 || Callbacks.ChannelLeave(ID, channelID, DenyReason), DenyReason, Msg, Size, Type);
+						if (decision < 0) return;
+						if (!decision){
 							packet.Clear();
 							packet.SetType(0);
 							packet.AddByte(3);
 							packet.AddByte(false);
 							packet.AddShort(channelID);
 							packet.AddString(DenyReason);
-							PeersPool[ID].Socket->send(packet.GetPacket(), packet.GetPacketSize());
+							SendTcp(ID, packet.GetPacket(), packet.GetPacketSize());
 							return;
 						}
 					}
 					Log(std::to_string(ID)+" | Peer "+PeersPool[ID].Name+" left the channel "+ChannelsPool[channelID].Name, 8);
 					Client.EraseChannel(channelID);
-                    ChannelsPool[channelID].ErasePeer(ID);
+                    ChannelsPool[channelID].ErasePeer(ID, Client.Name);
 					if (ChannelsPool[channelID].Peers.size()==0 || (ChannelsPool[channelID].CloseOnLeave && ChannelsPool[channelID].Master==ID)){
 						if (Callbacks.ChannelClosed!=NULL) Callbacks.ChannelClosed(channelID);
 						Log("Channel "+ChannelsPool[channelID].Name+" closed", 12);
@@ -305,6 +749,7 @@ void RedRelayServer::HandleTCP(uint16_t ID, char* Msg, std::size_t Size, uint8_t
 						PeerDroppedFromChannel(channelID, ID);
 						ChannelNames.erase(ChannelsPool[channelID].Name);
 						ChannelsPool.Deallocate(channelID);
+						Stats.Adjust(Metrics::Channels, -1);
 					} else {
 						if (ChannelsPool[channelID].Master==ID){
 							if (GiveNewMaster && ChannelsPool[channelID].Peers.size()>0) ChannelsPool[channelID].Master = *ChannelsPool[channelID].Peers.begin();
@@ -319,13 +764,15 @@ void RedRelayServer::HandleTCP(uint16_t ID, char* Msg, std::size_t Size, uint8_t
 		case 4:
 			if (Callbacks.ChannelsListRequest!=NULL){
 				std::string DenyReason;
-				if (!Callbacks.ChannelsListRequest(ID, DenyReason)){
+				int8_t decision = Settle(ID, Verdict.Ticket != 0 || Callbacks.ChannelsListRequest(ID, DenyReason), DenyReason, Msg, Size, Type);
+				if (decision < 0) return;
+				if (!decision){
 					packet.Clear();
 					packet.SetType(0);
 					packet.AddByte(4);
 					packet.AddByte(false);
 					packet.AddString(DenyReason);
-					Client.Socket->send(packet.GetPacket(), packet.GetPacketSize());
+					SendTcp(ID, packet.GetPacket(), packet.GetPacketSize());
 					return;
 				}
 			}
@@ -335,88 +782,25 @@ void RedRelayServer::HandleTCP(uint16_t ID, char* Msg, std::size_t Size, uint8_t
 			packet.AddByte(4);
 			packet.AddByte(true);
 			for (IndexedElement<Channel>it : ChannelsPool.GetAllocated()){
-				if (!it.element->HideFromList){
+				if (!it.element->HideFromList && it.element->Ticket == 0){
 					packet.AddShort(it.element->Peers.size());
 					packet.AddByte(it.element->Name.length());
 					packet.AddString(it.element->Name);
 				}
 			}
-			Client.Socket->send(packet.GetPacket(), packet.GetPacketSize());
+			SendTcp(ID, packet.GetPacket(), packet.GetPacketSize());
 			break;
 		default:
 			break;
 		}
 		break;
-	case 2:
-		{
-			if (Size<3) return;
-			uint16_t channel=(unsigned char)Msg[1]|(unsigned char)Msg[2]<<8;
-            if (Client.IsInChannel(channel)){
-				char header[11];
-				uint8_t headersize;
-				header[0]=Type;
-				if (Size+2<254){
-					header[1]=Size+2;
-					headersize=2;
-				} else if (Size+2<65535){
-					header[1]=(uint8_t)254;
-					header[2]=(Size+2)&255;
-					header[3]=((Size+2)>>8)&255;
-					headersize=4;
-				} else {
-					header[1]=(uint8_t)255;
-					header[2]=(Size+2)&255;
-					header[3]=((Size+2)>>8)&255;
-					header[4]=((Size+2)>>16)&255;
-					header[5]=((Size+2)>>24)&255;
-					headersize=6;
-				}
-				header[headersize++]=Msg[0];
-				header[headersize++]=Msg[1];
-				header[headersize++]=Msg[2];
-				header[headersize++]=ID&255;
-				header[headersize++]=(ID>>8)&255;
-				for (uint16_t peerID : ChannelsPool[channel].Peers) if (peerID!=ID){
-					PeersPool[peerID].Socket->send(header, headersize);
-					if (Size>3) PeersPool[peerID].Socket->send(&Msg[3], Size-3);
-				}
-			}
-		}
+	case 1: //Message to the server itself, handled by the host application
+		if (Size==0) return;
+		if (Callbacks.ServerMessageSent!=NULL) Callbacks.ServerMessageSent(ID, (uint8_t)Msg[0], &Msg[1], Size-1);
 		break;
-	case 3:
-		{
-			if (Size<5) return;
-			uint16_t channel=(unsigned char)Msg[1]|(unsigned char)Msg[2]<<8, peer=(unsigned char)Msg[3]|(unsigned char)Msg[4]<<8;
-			if (PeersPool.Allocated(peer) && Client.IsInChannel(channel) && PeersPool[peer].IsInChannel(channel)){
-				char header[11];
-				uint8_t headersize;
-				header[0]=Type;
-				if (Size<254){
-					header[1]=Size;
-					headersize=2;
-				} else if (Size<65535){
-					header[1]=(uint8_t)254;
-					header[2]=Size&255;
-					header[3]=(Size>>8)&255;
-					headersize=4;
-				} else {
-					header[1]=(uint8_t)255;
-					header[2]=Size&255;
-					header[3]=(Size>>8)&255;
-					header[4]=(Size>>16)&255;
-					header[5]=(Size>>24)&255;
-					headersize=6;
-				}
-				header[headersize++]=Msg[0];
-				header[headersize++]=Msg[1];
-				header[headersize++]=Msg[2];
-				header[headersize++]=ID&255;
-				header[headersize++]=(ID>>8)&255;
-				PeersPool[peer].Socket->send(header, headersize);
-				if (Size>5) PeersPool[peer].Socket->send(&Msg[5], Size-5);
-				return;
-			}
-		}
+	case 2:
+	case 3: //ProcessBuffer relays these after releasing the lock
+		if (CollectReceivers(ID, Msg, Size, Type)) RelayTCP(ID, Msg, Size, Type);
 		break;
 	case 9:
         DebugLog(std::to_string(ID)+" | Ping reply");
@@ -427,47 +811,268 @@ void RedRelayServer::HandleTCP(uint16_t ID, char* Msg, std::size_t Size, uint8_t
 	}
 }
 
+bool RedRelayServer::CollectReceivers(uint16_t ID, const char* Msg, std::size_t Size, uint8_t Type){ //Called under the lock, membership changes on any thread
+	Peer& Client = PeersPool[ID];
+	Relayed.clear();
+	if (Size<(Type>>4 == 2 ? 3u : 5u)) return false;
+	uint16_t channel=(unsigned char)Msg[1]|(unsigned char)Msg[2]<<8;
+	if (!Client.IsInChannel(channel)) return false;
+	if (Type>>4 == 2){
+		for (uint16_t peerID : ChannelsPool[channel].Peers) if (peerID!=ID){
+			RelayTarget Target = {peerID, PeersPool[peerID].Serial, PeersPool[peerID].ReactorID};
+			Relayed.push_back(Target);
+		}
+	} else {
+		uint16_t peer=(unsigned char)Msg[3]|(unsigned char)Msg[4]<<8;
+		if (!PeersPool.Allocated(peer) || !PeersPool[peer].IsInChannel(channel)) return false;
+		RelayTarget Target = {peer, PeersPool[peer].Serial, PeersPool[peer].ReactorID};
+		Relayed.push_back(Target);
+	}
+	return !Relayed.empty();
+}
+
+void RedRelayServer::RelayTCP(uint16_t ID, const char* Msg, std::size_t Size, uint8_t Type){
+#ifndef REDRELAY_EPOLL
+	sf::Lock lock(StateMutex); //Without reactors any thread holding the lock writes to the sockets
+#endif
+	std::size_t routing = Type>>4 == 2 ? 3 : 5; //Subchannel, channel and the receiving peer
+	char header[11];
+	uint8_t headersize = FrameHeader(header, Type, Type>>4 == 2 ? Size+2 : Size);
+	header[headersize++]=Msg[0];
+	header[headersize++]=Msg[1];
+	header[headersize++]=Msg[2];
+	header[headersize++]=ID&255;
+	header[headersize++]=(ID>>8)&255;
+	SharedBuffer Shared; //Copied once, only if some receiver can't take the message right away
+	for (const RelayTarget& Target : Relayed){
+	#ifdef REDRELAY_EPOLL
+		if (Target.ReactorID != CurrentReactor){ //Peers of other reactors aren't looked at without the lock
+			PostTcp(Target, header, headersize, &Msg[routing], Size-routing, Shared);
+			continue;
+		}
+	#endif
+		SendTcp(Target.PeerID, header, headersize, &Msg[routing], Size-routing, &Shared); //Own peers are dropped by this thread only
+	}
+	Relayed.clear();
+}
+
 void RedRelayServer::NewConnection(){
-	uint16_t connectID = ConnectionsPool.GetAllocated().size();
+	for (uint32_t accepted=0; accepted<AcceptBudget; ++accepted){ //Listener is level-triggered, the rest is reported again
+		sf::TcpSocket* Socket = new sf::TcpSocket; //Non-blocking, writes are queued per peer so a slow client must never stall the loop
+	#ifdef __linux__
+		int handle = accept4(TcpListener.GetHandle(), NULL, NULL, SOCK_NONBLOCK|SOCK_CLOEXEC);
+		if (handle < 0){
+			delete Socket;
+			return;
+		}
+		Socket->setBlocking(false); //There's no handle yet, this only sets the mode Adopt() applies
+		Socket->Adopt(handle);
+	#else
+		if (TcpListener.accept(*Socket) != sf::Socket::Done){
+			delete Socket;
+			return;
+		}
+		Socket->setBlocking(false);
+	#endif
+		AddConnection(Socket);
+	}
+}
+
+#ifdef REDRELAY_URING
+void RedRelayServer::NewConnection(int Handle){ //Accepted by the selector already
+	if (Handle < 0) return;
+	sf::TcpSocket* Socket = new sf::TcpSocket;
+	Socket->setBlocking(false);
+	Socket->Adopt(Handle);
+	AddConnection(Socket);
+}
+#endif
+
+void RedRelayServer::AddConnection(sf::TcpSocket* Socket){
+	sf::Lock lock(StateMutex); //Timers are shared with reactors dropping their peers
+	uint16_t connectID = ConnectionsPool.FreeIndex(ConnectionsLimit); //Pool size isn't a free ID once handshakes finish out of order
 	if (connectID>=ConnectionsLimit) connectID=0;
 	if (ConnectionsPool.Allocated(connectID)) DropConnection(connectID);
 	ConnectionsPool.Allocate(connectID);
-	sf::TcpSocket* Socket = new sf::TcpSocket;
-	if (TcpListener.accept(*Socket) == sf::Socket::Done){
+#ifdef REDRELAY_EPOLL
+	Selector.add(*Socket, connectID|0x10000);
+#else
+	Selector.add(*Socket);
+#endif
+	ConnectionsPool[connectID].Socket = Socket;
+	Stats.Adjust(Metrics::Connections, 1);
+	if (HandshakeTimeout != 0) Timers.Schedule(PeersLimit+connectID, Milliseconds()+HandshakeTimeout*1000);
+}
+
+void RedRelayServer::SendUdp(const char* Data, std::size_t Size, uint32_t Address, uint16_t Port){
+	Stats.UdpOut(Data[0], Size);
+#ifdef REDRELAY_MMSG
+	Batch.Send(UdpSocket, Data, Size, Address, Port);
+#else
+	UdpSocket.send(Data, Size, sf::IpAddress(Address), Port);
+#endif
+}
+
+void RedRelayServer::SendUdp(uint16_t PeerID, const char* Data, std::size_t Size, uint8_t Priority){
+	Peer& Peer = PeersPool[PeerID];
+	RateLimit limit;
+	limit.Bytes = Peer.EgressRate != 0 ? Peer.EgressRate : UdpEgressRate;
+	if (limit.Bytes == 0){
+		SendUdp(Data, Size, Peer.IpAddr, Peer.UdpPort);
+		return;
+	}
+	if (Peer.UdpQueue.empty() && Peer.UdpEgress.Ready(limit, Milliseconds(), EgressBurst)){
+		Peer.UdpEgress.Take(Size);
+		SendUdp(Data, Size, Peer.IpAddr, Peer.UdpPort);
+		return;
+	}
+	while (Peer.UdpQueued+Size > UdpQueueLimit && !Peer.UdpQueue.empty()){ //Lowest priority goes first, the oldest one of equals
+		std::deque<QueuedDatagram>::iterator victim = Peer.UdpQueue.begin();
+		for (std::deque<QueuedDatagram>::iterator it = victim+1; it != Peer.UdpQueue.end(); ++it) if (it->Priority < victim->Priority) victim = it;
+		if (victim->Priority > Priority) break; //The new one matters least
+		Peer.UdpQueued -= victim->Data.size();
+		Stats.Adjust(Metrics::PacedBytes, -(int64_t)victim->Data.size());
+		Stats.Count(Metrics::PacedDrops);
+		Peer.UdpQueue.erase(victim);
+	}
+	if (Peer.UdpQueued+Size > UdpQueueLimit){
+		Stats.Count(Metrics::PacedDrops);
+		return;
+	}
+	Peer.UdpQueue.push_back(QueuedDatagram());
+	Peer.UdpQueue.back().Data.assign(Data, Data+Size);
+	Peer.UdpQueue.back().Priority = Priority;
+	Peer.UdpQueued += Size;
+	Stats.Adjust(Metrics::PacedBytes, Size);
+	if (!Peer.Paced){
+		Peer.Paced = true;
+		PacedPeers.push_back(PeerID);
 	#ifdef REDRELAY_EPOLL
-		Selector.add(*Socket, connectID|0x10000);
-	#else
-		Selector.add(*Socket);
+		if (CurrentReactor != 0) Reactors[0]->Wake(); //Main loop may be asleep until its next timer
 	#endif
-		ConnectionsPool[connectID].Socket = Socket;
-	} else {
-		delete Socket;
-		ConnectionsPool.Deallocate(connectID);
 	}
 }
 
+void RedRelayServer::PaceUdp(){
+	if (PacedPeers.empty()) return;
+	uint64_t now = Milliseconds();
+	std::vector<uint32_t> sent(PacedPeers.size(), 0);
+	for (std::size_t i=0; i<PacedPeers.size(); ++i){
+		Peer& Peer = PeersPool[PacedPeers[i]];
+		RateLimit limit;
+		limit.Bytes = Peer.EgressRate != 0 ? Peer.EgressRate : UdpEgressRate;
+		while (sent[i] < Peer.UdpQueue.size() && (limit.Bytes == 0 || Peer.UdpEgress.Ready(limit, now, EgressBurst))){
+			const std::vector<char>& datagram = Peer.UdpQueue[sent[i]++].Data;
+			Peer.UdpEgress.Take(datagram.size());
+			SendUdp(&datagram[0], datagram.size(), Peer.IpAddr, Peer.UdpPort);
+		}
+	}
+#ifdef REDRELAY_MMSG
+	Batch.Flush(UdpSocket); //Queued datagrams point into the peer queues
+#endif
+	uint32_t kept=0;
+	for (std::size_t i=0; i<PacedPeers.size(); ++i){
+		Peer& Peer = PeersPool[PacedPeers[i]];
+		for (uint32_t j=0; j<sent[i]; ++j){
+			Peer.UdpQueued -= Peer.UdpQueue.front().Data.size();
+			Stats.Adjust(Metrics::PacedBytes, -(int64_t)Peer.UdpQueue.front().Data.size());
+			Peer.UdpQueue.pop_front();
+		}
+		if (Peer.UdpQueue.empty()) Peer.Paced = false;
+		else PacedPeers[kept++] = PacedPeers[i];
+	}
+	PacedPeers.resize(kept);
+}
+
+uint64_t RedRelayServer::NextPaced(){
+	uint64_t next = UINT64_MAX;
+	for (uint16_t peerID : PacedPeers){
+		const Peer& Peer = PeersPool[peerID];
+		RateLimit limit;
+		limit.Bytes = Peer.EgressRate != 0 ? Peer.EgressRate : UdpEgressRate;
+		next = std::min(next, Peer.UdpEgress.Updated+Peer.UdpEgress.Wait(limit));
+	}
+	return next;
+}
+
+void RedRelayServer::IntroducePeer(uint16_t PeerID, uint16_t About){
+	const Peer& Other = PeersPool[About];
+	char intro[9] = {(char)(8<<4), (char)(About&255), (char)((About>>8)&255),
+		(char)((Other.IpAddr>>24)&255), (char)((Other.IpAddr>>16)&255), (char)((Other.IpAddr>>8)&255), (char)(Other.IpAddr&255),
+		(char)(Other.UdpPort&255), (char)((Other.UdpPort>>8)&255)};
+	DebugLog(std::to_string(PeerID)+" | Introduced to "+std::to_string(About));
+	SendUdp(intro, 9, PeersPool[PeerID].IpAddr, PeersPool[PeerID].UdpPort);
+#ifdef REDRELAY_MMSG
+	Batch.Flush(UdpSocket); //Introduction lives on the stack
+#endif
+}
+
 void RedRelayServer::ReceiveUdp(){
+#ifdef REDRELAY_MMSG
+	uint32_t count = Batch.Receive(UdpSocket);
+	sf::Lock lock(StateMutex);
+	for (uint32_t i=0; i<count; ++i){
+		uint64_t start = Metrics::Now();
+		if (Batch.Size(i)) Stats.UdpIn(Batch.Data(i)[0], Batch.Size(i));
+		HandleUDP(Batch.Data(i), Batch.Size(i), Batch.Address(i), Batch.Port(i));
+		Stats.Observe(Metrics::UdpHandler, Metrics::Now()-start);
+	}
+	SendConflated(); //Only the newest blast of each sender in the batch is relayed
+	Batch.Flush(UdpSocket); //Whole fan-out of the batch goes out in one go
+#else
 	sf::IpAddress UdpAddress; uint16_t UdpPort;
 	std::size_t received;
 	UdpSocket.receive(UdpBuffer, 65536, received, UdpAddress, UdpPort);
-    if (received < 3) return;
-    uint16_t PeerID = (uint8_t)UdpBuffer[1]|(uint8_t)UdpBuffer[2]<<8;
-    if (!PeersPool.Allocated(PeerID) || PeersPool[PeerID].IpAddr != UdpAddress.toInteger()) return;
-	switch (((uint8_t)UdpBuffer[0])>>4){
+	uint64_t start = Metrics::Now();
+	if (received) Stats.UdpIn(UdpBuffer[0], received);
+	sf::Lock lock(StateMutex);
+	HandleUDP(UdpBuffer, received, UdpAddress.toInteger(), UdpPort);
+	SendConflated();
+	Stats.Observe(Metrics::UdpHandler, Metrics::Now()-start);
+#endif
+}
+
+void RedRelayServer::HandleUDP(char* Msg, std::size_t Size, uint32_t Address, uint16_t Port){
+    if (Size < 3) return;
+    uint16_t PeerID = (uint8_t)Msg[1]|(uint8_t)Msg[2]<<8;
+    if (!PeersPool.Allocated(PeerID) || PeersPool[PeerID].IpAddr != Address) return;
+	PeersPool[PeerID].LastSeen = Milliseconds();
+	uint8_t type = (uint8_t)Msg[0]>>4;
+	int subchannel = ((type >= 1 && type <= 3) || type == 13 || type == 15) && Size >= 4 ? (uint8_t)Msg[3] : -1;
+	if (PeersPool[PeerID].UdpPort == Port && !AdmitIngress(PeerID, true, subchannel, Size)) return;
+	switch (type){
+	case 1: //Identifier 1 means ServerMessage - blast to the server itself, handled by the host application
+	{
+		if (Size < 4) return;
+
+		if (PeersPool[PeerID].UdpPort != Port) return;
+		if (Callbacks.ServerMessageBlast!=NULL) Callbacks.ServerMessageBlast(PeerID, (uint8_t)Msg[3], &Msg[4], Size-4);
+	}
+	break;
+
 	case 2: //Identifier 2 means ChannelMessage - broadcast message to all peers in given channel
 	{
-		if (received < 6) return;
+		if (Size < 6) return;
 		
-		if (PeersPool[PeerID].UdpPort != UdpPort) return;
-		uint16_t DestinationChannel = (uint8_t)UdpBuffer[4]|(uint8_t)UdpBuffer[5]<<8;
+		if (PeersPool[PeerID].UdpPort != Port) return;
+		uint16_t DestinationChannel = (uint8_t)Msg[4]|(uint8_t)Msg[5]<<8;
         if (PeersPool[PeerID].IsInChannel(DestinationChannel)){
-			UdpBuffer[1]=UdpBuffer[3];
-			UdpBuffer[2]=UdpBuffer[4];
-			UdpBuffer[3]=UdpBuffer[5];
-			UdpBuffer[4]=PeerID&255;
-			UdpBuffer[5]=(PeerID>>8)&255;
+			Msg[1]=Msg[3];
+			Msg[2]=Msg[4];
+			Msg[3]=Msg[5];
+			Msg[4]=PeerID&255;
+			Msg[5]=(PeerID>>8)&255;
+			Channel& Channel = ChannelsPool[DestinationChannel];
+			if (Size <= HeldBlastSize && Channel.Conflated[(uint8_t)Msg[1]]){
+				ConflateBlast(DestinationChannel, Msg, Size);
+				return;
+			}
+			if (Size <= HeldBlastSize && Channel.TickRate != 0){
+				AggregateBlast(DestinationChannel, Msg, Size);
+				return;
+			}
 			for (uint16_t Receiver : ChannelsPool[DestinationChannel].Peers) if (Receiver != PeerID)
-				UdpSocket.send(UdpBuffer, received, sf::IpAddress(PeersPool[Receiver].IpAddr), PeersPool[Receiver].UdpPort);
+				SendUdp(Receiver, Msg, Size, SubchannelPriorities[(uint8_t)Msg[1]]);
 			return;
 		}
 	}
@@ -475,16 +1080,16 @@ void RedRelayServer::ReceiveUdp(){
 
 	case 3: //Identifier 3 means PeerMessage - send private message to given peer
 	{
-		if (received < 8) return;
+		if (Size < 8) return;
 
-		if (PeersPool[PeerID].UdpPort != UdpPort) return;
-		uint16_t Receiver = (uint8_t)UdpBuffer[6]|(uint8_t)UdpBuffer[7]<<8;
-		uint16_t DestinationChannel = (uint8_t)UdpBuffer[4]|(uint8_t)UdpBuffer[5]<<8;
+		if (PeersPool[PeerID].UdpPort != Port) return;
+		uint16_t Receiver = (uint8_t)Msg[6]|(uint8_t)Msg[7]<<8;
+		uint16_t DestinationChannel = (uint8_t)Msg[4]|(uint8_t)Msg[5]<<8;
 		if (PeersPool.Allocated(Receiver) && PeersPool[PeerID].IsInChannel(DestinationChannel) && PeersPool[Receiver].IsInChannel(DestinationChannel)){
-			UdpBuffer[6]=UdpBuffer[1];
-			UdpBuffer[7]=UdpBuffer[2];
-			UdpBuffer[2]=UdpBuffer[0];
-			UdpSocket.send(&UdpBuffer[2], received-2, sf::IpAddress(PeersPool[Receiver].IpAddr), PeersPool[Receiver].UdpPort);
+			Msg[6]=Msg[1];
+			Msg[7]=Msg[2];
+			Msg[2]=Msg[0];
+			SendUdp(Receiver, &Msg[2], Size-2, SubchannelPriorities[(uint8_t)Msg[3]]);
 			break;
 		}
 	}
@@ -493,48 +1098,412 @@ void RedRelayServer::ReceiveUdp(){
 	case 7: //Identifier 7 means UDPHello - respond with UDPWelcome
 	{
         DebugLog(std::to_string(PeerID)+" | UDPHello");
-		if (PeersPool[PeerID].UdpPort == 0 || PeersPool[PeerID].UdpPort == UdpPort){
-			PeersPool[PeerID].UdpPort = UdpPort;
-			UdpBuffer[0] = (uint8_t)(10<<4);
-			UdpSocket.send(UdpBuffer, 1, UdpAddress, UdpPort);
+		if (PeersPool[PeerID].UdpPort == 0 || PeersPool[PeerID].UdpPort == Port){
+			PeersPool[PeerID].UdpPort = Port;
+			Msg[0] = (uint8_t)(10<<4);
+			SendUdp(Msg, 1, Address, Port);
 		}
 	}
 	break;
 
+	case 8: //Identifier 8 means Introduction - peers opting into direct UDP ask for addresses of each other
+	{
+		if (Size < 7 || !PeerIntroductions) return;
+
+		if (PeersPool[PeerID].UdpPort != Port) return;
+		uint16_t DestinationChannel = (uint8_t)Msg[3]|(uint8_t)Msg[4]<<8;
+		uint16_t Receiver = (uint8_t)Msg[5]|(uint8_t)Msg[6]<<8; //65535 for everyone in the channel
+		if (!PeersPool[PeerID].IsInChannel(DestinationChannel)) return;
+		PeersPool[PeerID].DirectUdp = true;
+		for (uint16_t peerID : ChannelsPool[DestinationChannel].Peers)
+			if (peerID != PeerID && (Receiver == 65535 || Receiver == peerID) && PeersPool[peerID].DirectUdp && PeersPool[peerID].UdpPort != 0){
+				IntroducePeer(PeerID, peerID); //Both sides punch at the same time
+				IntroducePeer(peerID, PeerID);
+			}
+	}
+	break;
+
+	case 13: //Identifier 13 means ReliableMessage - sequenced blast to the channel or a single peer, acknowledged end to end
+	case 14: //Identifier 14 means ReliableAck - acknowledgement back to the sender of reliable messages
+	case 15: //Identifier 15 means Fragment - part of a large blast, relayed on its own and reassembled by receivers
+	{
+		if (Size < 8) return;
+
+		if (PeersPool[PeerID].UdpPort != Port) return;
+		uint16_t Receiver = (uint8_t)Msg[6]|(uint8_t)Msg[7]<<8;
+		uint16_t DestinationChannel = (uint8_t)Msg[4]|(uint8_t)Msg[5]<<8;
+		if (!PeersPool[PeerID].IsInChannel(DestinationChannel)) return;
+		Msg[6]=Msg[1]; //Same layout as a relayed peer message, the rest is opaque to the server
+		Msg[7]=Msg[2];
+		Msg[2]=Msg[0];
+		uint8_t priority = type == 14 ? 255 : SubchannelPriorities[(uint8_t)Msg[3]]; //Acks are tiny and spare retransmissions
+		if (Receiver == 65535 && type != 14){
+			for (uint16_t peerID : ChannelsPool[DestinationChannel].Peers) if (peerID != PeerID)
+				SendUdp(peerID, &Msg[2], Size-2, priority);
+		} else if (PeersPool.Allocated(Receiver) && PeersPool[Receiver].IsInChannel(DestinationChannel))
+			SendUdp(Receiver, &Msg[2], Size-2, priority);
+	}
+	break;
+
 	default:
 	break;
 	}
 }
 
-void RedRelayServer::ReceiveTcp(uint16_t PeerID){
+void RedRelayServer::ResizeBuffer(Peer& Peer, uint32_t Size){
+	char* buffer = Buffers.Acquire(Size);
+	if (Peer.packetsize) memcpy(buffer, Peer.buffer, Peer.packetsize);
+	Buffers.Release(Peer.buffer, Peer.buffsize);
+	Peer.buffer = buffer;
+	Peer.buffsize = Size;
+}
+
+bool RedRelayServer::PrepareBuffer(uint16_t PeerID){ //Makes room for the frame being received, false if the peer is dropped for its size
 	Peer& Peer = PeersPool[PeerID];
-	std::size_t received;
-	switch (Peer.Socket->receive(&Peer.buffer[Peer.buffbegin+Peer.packetsize], 65536-(Peer.buffbegin+Peer.packetsize), received)){
-	case sf::Socket::Done:
-		Peer.packetsize+=received;
-		while (Peer.MessageReady()){
-			HandleTCP(PeerID, &Peer.buffer[Peer.buffbegin+1+Peer.SizeOffset()], Peer.MessageSize(), Peer.buffer[Peer.buffbegin]);
+	if (Peer.buffer==NULL){
+		Peer.buffsize = BufferPool::MinSize;
+		Peer.buffer = Buffers.Acquire(Peer.buffsize);
+	}
+	if (Peer.Forward.Left == 0 && Peer.SizeOffset()>0 && Peer.packetsize>Peer.SizeOffset()){ //Header is complete, make room for the whole frame
+		uint64_t framesize = 1+Peer.SizeOffset()+(uint64_t)Peer.MessageSize();
+		if (framesize > MaxMessageSize){
+			sf::Lock lock(StateMutex);
+			Log(std::to_string(PeerID)+" | Peer "+Peer.Name+" dropped, message too big", 4, Logger::Warning);
+			Stats.Count(Metrics::OversizedDrops);
+			ScheduleDrop(PeerID);
+			return false;
+		}
+		uint8_t type = (uint8_t)Peer.buffer[Peer.buffbegin]>>4;
+		if (CutThroughSize != 0 && (type == 2 || type == 3) && Peer.MessageSize() >= CutThroughSize && Peer.packetsize < 1+Peer.SizeOffset()+(type == 2 ? 3u : 5u)) return true; //May be forwarded, wait for its routing
+		if (framesize > Peer.buffsize) ResizeBuffer(Peer, framesize);
+	}
+	return true;
+}
+
+void RedRelayServer::ProcessBuffer(uint16_t PeerID){ //Handles complete frames and moves the rest to the front
+	Peer& Peer = PeersPool[PeerID];
+	if (Peer.Forward.Left != 0 || Peer.MessageReady() || (CutThroughSize != 0 && Peer.SizeOffset() != 0 && Peer.MessageSize() >= CutThroughSize)){
+		uint64_t now = Milliseconds();
+		while (!Peer.Throttled){
+			char* msg;
+			uint8_t type;
+			uint64_t start = 0;
+			bool admitted, relayed = false;
+			{
+				sf::Lock lock(StateMutex); //Taken for each frame, channel and peer messages are written to their receivers after it's released
+				Peer.LastSeen = now;
+				if (Peer.Forward.Left != 0){ //Buffer holds payload of the forwarded message
+					ForwardPayload(PeerID);
+					if (Peer.Forward.Left != 0) break;
+					continue;
+				}
+				if (BeginForward(PeerID)) continue;
+				if (!Peer.MessageReady()) break;
+				msg = &Peer.buffer[Peer.buffbegin+1+Peer.SizeOffset()];
+				type = Peer.buffer[Peer.buffbegin];
+				int subchannel = type>>4 >= 1 && type>>4 <= 3 && Peer.MessageSize() > 0 ? (uint8_t)msg[0] : -1;
+				admitted = AdmitIngress(PeerID, false, subchannel, Peer.MessageSize());
+				if (Peer.Throttled) break; //Stays in the buffer until reads resume
+				if (admitted){
+					start = Metrics::Now();
+					Stats.TcpIn(type, Peer.MessageSize());
+					if (type>>4 == 2 || type>>4 == 3) relayed = CollectReceivers(PeerID, msg, Peer.MessageSize(), type);
+					else HandleTCP(PeerID, msg, Peer.MessageSize(), type);
+				}
+			}
+			if (relayed) RelayTCP(PeerID, msg, Peer.MessageSize(), type);
+			if (admitted) Stats.Observe(Metrics::TcpHandler, Metrics::Now()-start);
 			Peer.packetsize -= 1+Peer.SizeOffset()+Peer.MessageSize();
 			Peer.buffbegin += 1+Peer.SizeOffset()+Peer.MessageSize();
 		}
-		if (Peer.buffbegin > 0 && Peer.buffbegin < 65536 && Peer.packetsize != 0){
-			memmove(&Peer.buffer[0], &Peer.buffer[Peer.buffbegin], Peer.packetsize);
+	}
+	if (Peer.buffbegin > 0 && Peer.buffbegin < Peer.buffsize && Peer.packetsize != 0){
+		memmove(&Peer.buffer[0], &Peer.buffer[Peer.buffbegin], Peer.packetsize);
+	}
+	Peer.buffbegin=0;
+	if (Peer.Forward.Left != 0){
+		if (Peer.buffsize < CutThroughChunk) ResizeBuffer(Peer, CutThroughChunk);
+	} else if (Peer.packetsize==0 && Peer.buffsize>BufferPool::MinSize) ResizeBuffer(Peer, BufferPool::MinSize); //Large frame is done, give its buffer back
+}
+
+bool RedRelayServer::BeginForward(uint16_t PeerID){
+	Peer& Peer = PeersPool[PeerID];
+	if (CutThroughSize == 0 || Peer.SizeOffset() == 0 || Peer.MessageReady()) return false;
+	uint8_t type = Peer.buffer[Peer.buffbegin];
+	uint32_t size = Peer.MessageSize();
+	uint32_t routing = type>>4 == 2 ? 3 : type>>4 == 3 ? 5 : 0; //Subchannel, channel and the receiving peer
+	std::size_t consumed = 1+Peer.SizeOffset()+routing;
+	if (routing == 0 || size < CutThroughSize || Peer.packetsize < consumed) return false;
+	const char* msg = &Peer.buffer[Peer.buffbegin+1+Peer.SizeOffset()];
+	uint16_t channel = (uint8_t)msg[1]|(uint8_t)msg[2]<<8;
+	if (!Peer.IsInChannel(channel)) return false; //Ignored once complete, like any misrouted message
+	std::vector<uint16_t> receivers;
+	if (routing == 3){
+		for (uint16_t peerID : ChannelsPool[channel].Peers) if (peerID != PeerID) receivers.push_back(peerID);
+	} else {
+		uint16_t peer = (uint8_t)msg[3]|(uint8_t)msg[4]<<8;
+		if (!PeersPool.Allocated(peer) || !PeersPool[peer].IsInChannel(channel)) return false;
+		receivers.push_back(peer);
+	}
+	for (uint16_t peerID : receivers){
+		if (PeersPool[peerID].Streamed) return false; //One forwarded message per receiver at a time
+	#ifdef REDRELAY_EPOLL
+		if (PeersPool[peerID].ReactorID != CurrentReactor) return false; //Receiver's stream belongs to another thread
+	#endif
+	}
+	if (!AdmitIngress(PeerID, false, (uint8_t)msg[0], size)){
+		if (Peer.Throttled) return false;
+		receivers.clear(); //Rejected, the rest of it is skipped as it arrives
+	}
+	Stats.TcpIn(type, size);
+	char header[11];
+	uint8_t headersize = FrameHeader(header, type, routing == 3 ? size+2 : size);
+	header[headersize++]=msg[0];
+	header[headersize++]=msg[1];
+	header[headersize++]=msg[2];
+	header[headersize++]=PeerID&255;
+	header[headersize++]=(PeerID>>8)&255;
+	SharedBuffer shared = MakeShared(header, headersize, NULL, 0);
+	Peer.Forward.Receivers.clear();
+	Peer.Forward.Serials.clear();
+	for (uint16_t peerID : receivers) if (!PeersPool[peerID].Dropping.load(std::memory_order_acquire)){
+		Stats.TcpOut(type, headersize+size-routing);
+		PeersPool[peerID].Streamed = true;
+		Peer.Forward.Receivers.push_back(peerID);
+		Peer.Forward.Serials.push_back(PeersPool[peerID].Serial);
+		SendStream(peerID, shared);
+	}
+	Peer.Forward.Left = size-routing;
+	Peer.buffbegin += consumed;
+	Peer.packetsize -= consumed;
+	return true;
+}
+
+void RedRelayServer::ForwardPayload(uint16_t PeerID){
+	Peer& Peer = PeersPool[PeerID];
+	ForwardedFrame& Forward = Peer.Forward;
+	bool receiving = false;
+	for (std::size_t i=0; i<Forward.Receivers.size(); ++i){
+		uint16_t peerID = Forward.Receivers[i];
+		if (!PeersPool.Allocated(peerID) || PeersPool[peerID].Serial != Forward.Serials[i] || PeersPool[peerID].Dropping.load(std::memory_order_acquire)) continue;
+		if (PeersPool[peerID].Queued() > CutThroughWindow){ //The slowest receiver sets the pace
+			PauseReads(PeerID, Milliseconds()+ForwardPoll);
+			return;
 		}
-		Peer.buffbegin=0;
-		break;
+		receiving = true;
+	}
+	uint32_t chunk = std::min<uint32_t>(Peer.packetsize, Forward.Left);
+	if (chunk == 0) return;
+	if (receiving){
+		SharedBuffer shared = MakeShared(&Peer.buffer[Peer.buffbegin], chunk, NULL, 0);
+		for (std::size_t i=0; i<Forward.Receivers.size(); ++i){
+			uint16_t peerID = Forward.Receivers[i];
+			if (PeersPool.Allocated(peerID) && PeersPool[peerID].Serial == Forward.Serials[i] && !PeersPool[peerID].Dropping.load(std::memory_order_acquire)) SendStream(peerID, shared);
+		}
+	}
+	Peer.buffbegin += chunk;
+	Peer.packetsize -= chunk;
+	Forward.Left -= chunk;
+	if (Forward.Left == 0) EndForward(PeerID);
+}
 
-	case sf::Socket::Disconnected:
-		DropPeer(PeerID);
-		break;
+void RedRelayServer::EndForward(uint16_t PeerID){
+	ForwardedFrame& Forward = PeersPool[PeerID].Forward;
+	SharedBuffer zeros;
+	for (std::size_t i=0; i<Forward.Receivers.size(); ++i){
+		uint16_t peerID = Forward.Receivers[i];
+		if (!PeersPool.Allocated(peerID) || PeersPool[peerID].Serial != Forward.Serials[i]) continue;
+		for (uint32_t left = Forward.Left; left != 0 && !PeersPool[peerID].Dropping.load(std::memory_order_acquire); ){ //Keeps the stream of the receiver intact
+			if (!zeros) zeros = SharedBuffer(new std::vector<char>(CutThroughChunk, 0));
+			uint32_t chunk = std::min(left, CutThroughChunk);
+			SendStream(peerID, zeros, CutThroughChunk-chunk);
+			left -= chunk;
+		}
+		PeersPool[peerID].Streamed = false;
+		if (PeersPool[peerID].Laned != 0 && !PeersPool[peerID].Dropping.load(std::memory_order_acquire)) WakeWriter(peerID); //Frames held back meanwhile
+	}
+	Forward.Receivers.clear();
+	Forward.Serials.clear();
+	Forward.Left = 0;
+}
+
+void RedRelayServer::SendStream(uint16_t PeerID, const SharedBuffer& Data, std::size_t Offset){
+	Peer& Peer = PeersPool[PeerID];
+	Peer.Outgoing.Push(Data, Offset, (std::size_t)-1);
+	Stats.Adjust(Metrics::QueuedBytes, Data->size()-Offset);
+	WakeWriter(PeerID);
+}
+
+void RedRelayServer::WakeWriter(uint16_t PeerID){
+	Peer& Peer = PeersPool[PeerID];
+#ifdef REDRELAY_URING
+	if (!Peer.Sending){
+		Peer.Sending = true;
+		Reactors[Peer.ReactorID]->Unsent.push_back(PeerID);
+	}
+#else
+	if (!Peer.Sending) WriteCoalesced(PeerID);
+#endif
+}
 
+bool RedRelayServer::AdmitIngress(uint16_t PeerID, bool Udp, int Subchannel, std::size_t Size){
+	Peer& Peer = PeersPool[PeerID];
+	if (Peer.Dropping.load(std::memory_order_acquire)) return false;
+	uint64_t now = Milliseconds();
+	const RateLimit& limit = Udp ? UdpLimit : TcpLimit;
+	TokenBuckets& buckets = Udp ? Peer.UdpIngress : Peer.TcpIngress;
+	TokenBuckets* subchannel = NULL;
+	if (Subchannel >= 0 && (SubchannelLimits[Subchannel].Messages != 0 || SubchannelLimits[Subchannel].Bytes != 0)) subchannel = &Peer.SubchannelIngress[Subchannel];
+	bool ready = buckets.Ready(limit, now);
+	if (subchannel != NULL && !subchannel->Ready(SubchannelLimits[Subchannel], now)) ready = false;
+	if (ready){
+		buckets.Take(Size);
+		if (subchannel != NULL) subchannel->Take(Size);
+		if (Udp){
+			Peer.Ingress.UdpMessages++;
+			Peer.Ingress.UdpBytes += Size;
+		} else {
+			Peer.Ingress.TcpMessages++;
+			Peer.Ingress.TcpBytes += Size;
+		}
+		return true;
+	}
+	switch (FloodAction){
+	case ThrottleReads:
+		if (!Udp){ //Datagrams can't be held back, they are dropped instead
+			uint64_t wait = buckets.Wait(limit);
+			if (subchannel != NULL) wait = std::max(wait, subchannel->Wait(SubchannelLimits[Subchannel]));
+			PauseReads(PeerID, now+wait);
+			Peer.Ingress.Throttles++;
+			Stats.Count(Metrics::FloodThrottles);
+			return false;
+		} //Falls through
+	case DropMessages:
+		Peer.Ingress.DroppedMessages++;
+		Peer.Ingress.DroppedBytes += Size;
+		Stats.Count(Metrics::FloodDrops);
+		return false;
 	default:
-		break;
+		Log(std::to_string(PeerID)+" | Peer "+Peer.Name+" dropped for flooding", 4, Logger::Warning);
+		Stats.Count(Metrics::FloodDisconnects);
+		ScheduleDrop(PeerID);
+		return false;
+	}
+}
+
+void RedRelayServer::PauseReads(uint16_t PeerID, uint64_t Until){
+	Peer& Peer = PeersPool[PeerID];
+	Peer.Throttled = true;
+	Peer.ResumeAt = Until;
+	ThrottledPeers.push_back(PeerID);
+#ifdef REDRELAY_EPOLL
+	SelectorOf(PeerID).mod(*Peer.Socket, PeerID|0x20000, Peer.Blocked, true, false);
+#else
+	Selector.remove(*Peer.Socket);
+#endif
+}
+
+void RedRelayServer::ResumeReads(){ //Each reactor resumes its own peers only
+	std::vector<uint16_t> pending;
+	pending.swap(ThrottledPeers);
+	uint64_t now = Milliseconds();
+	for (uint16_t peerID : pending){
+		if (!PeersPool.Allocated(peerID) || !PeersPool[peerID].Throttled) continue; //Dropped or replaced meanwhile
+		Peer& Peer = PeersPool[peerID];
+	#ifdef REDRELAY_EPOLL
+		if (Peer.ReactorID != CurrentReactor){
+			ThrottledPeers.push_back(peerID);
+			continue;
+		}
+	#endif
+		if (Peer.ResumeAt > now || Peer.Dropping.load(std::memory_order_acquire)){
+			if (!Peer.Dropping.load(std::memory_order_acquire)) ThrottledPeers.push_back(peerID);
+			continue;
+		}
+		Peer.Throttled = false;
+		ProcessBuffer(peerID); //Messages held back go first, they may pause reading again
+		if (Peer.Throttled || Peer.Dropping.load(std::memory_order_acquire)) continue;
+	#ifdef REDRELAY_EPOLL
+		SelectorOf(peerID).mod(*Peer.Socket, peerID|0x20000, Peer.Blocked, true);
+		#ifndef REDRELAY_URING
+		if (!Peer.Backlogged){ //Data which arrived while paused won't raise a new edge
+			Peer.Backlogged = true;
+			Reactors[Peer.ReactorID]->Backlog.push_back(peerID);
+		}
+		#endif
+	#else
+		Selector.add(*Peer.Socket);
+	#endif
 	}
 }
 
+uint64_t RedRelayServer::NextResume(){
+	uint64_t next = UINT64_MAX;
+	for (uint16_t peerID : ThrottledPeers) if (PeersPool.Allocated(peerID) && PeersPool[peerID].Throttled) next = std::min(next, PeersPool[peerID].ResumeAt);
+	return next;
+}
+
+bool RedRelayServer::ReceiveTcp(uint16_t PeerID){ //Reads until the socket is drained, returns true if the budget ran out first
+	Peer& Peer = PeersPool[PeerID];
+	uint32_t budget = ReadBudget;
+	while (!Peer.Dropping.load(std::memory_order_acquire) && !Peer.Throttled){
+		if (!PrepareBuffer(PeerID)) return false;
+		std::size_t received;
+		switch (Peer.Socket->receive(&Peer.buffer[Peer.packetsize], Peer.buffsize-Peer.packetsize, received)){
+		case sf::Socket::Done:
+			Peer.packetsize+=received;
+			ProcessBuffer(PeerID);
+			if (received < budget){
+				budget -= received;
+				break;
+			}
+		#ifdef REDRELAY_EPOLL
+			if (!Peer.Backlogged){ //Come back after the other peers had their turn
+				Peer.Backlogged = true;
+				Reactors[Peer.ReactorID]->Backlog.push_back(PeerID);
+			}
+		#endif
+			return true;
+
+		case sf::Socket::Disconnected:
+			{
+				sf::Lock lock(StateMutex);
+				DropPeer(PeerID);
+			}
+			return false;
+
+		default: //Drained
+			return false;
+		}
+	}
+	return false;
+}
+
+#ifdef REDRELAY_URING
+void RedRelayServer::ReceiveTcp(uint16_t PeerID, const char* Data, std::size_t Size){ //Data received by the selector
+	Peer& Peer = PeersPool[PeerID];
+	while (Size && !Peer.Dropping.load(std::memory_order_acquire)){
+		if (!PrepareBuffer(PeerID)) return;
+		if (Peer.packetsize == Peer.buffsize) ResizeBuffer(Peer, Peer.buffsize*2); //Reads are paused, keep what was in flight
+		std::size_t chunk = std::min<std::size_t>(Size, Peer.buffsize-Peer.packetsize);
+		memcpy(&Peer.buffer[Peer.packetsize], Data, chunk);
+		Peer.packetsize += chunk;
+		Data += chunk;
+		Size -= chunk;
+		ProcessBuffer(PeerID);
+	}
+}
+#endif
+
 void RedRelayServer::HandleConnection(uint16_t ConnectionID){
+	sf::Lock lock(StateMutex);
 	Connection& Connection = ConnectionsPool[ConnectionID];
 	std::size_t received;
+	if (Connection.Ticket != 0){ //Waiting for its connect decision, only a hang up matters
+		char tmp[64];
+		if (Connection.Socket->receive(tmp, sizeof(tmp), received) == sf::Socket::Disconnected) DropConnection(ConnectionID);
+		return;
+	}
 	switch (Connection.Socket->receive(&Connection.buffer[Connection.received], 14-Connection.received, received)){
 	case sf::Socket::Done:
 		Connection.received+=received;
@@ -542,35 +1511,8 @@ void RedRelayServer::HandleConnection(uint16_t ConnectionID){
 			DropConnection(ConnectionID);
 			break;
 		}
-		if (Connection.received==14 && Connection.buffer[1]>>4==0 && Connection.buffer[2]==11 && Connection.buffer[3]==0 && std::string(&Connection.buffer[4], 10)=="revision 3"){
-			uint16_t peerID=0;
-			for (peerID=0; peerID<PeersLimit; ++peerID) if (!PeersPool.Allocated(peerID)){
-				if (Callbacks.PeerConnect!=NULL){
-					std::string DenyReason;
-					if (!Callbacks.PeerConnect(peerID, Connection.Socket->getRemoteAddress(), DenyReason)){
-						DenyConnection(ConnectionID, DenyReason);
-						break;
-					}
-				}
-				Log(std::to_string(peerID)+" | Peer connected from "+Connection.Socket->getRemoteAddress().toString(), 14);
-				PeersPool.Allocate(peerID);
-				PeersPool[peerID].Socket=Connection.Socket;
-                PeersPool[peerID].IpAddr=Connection.Socket->getRemoteAddress().toInteger();
-				packet.Clear();
-				packet.SetType(0);
-				packet.AddByte(0);
-				packet.AddByte(true);
-				packet.AddShort(peerID);
-				packet.AddString(WelcomeMessage);
-			#ifdef REDRELAY_EPOLL
-				Selector.mod(*Connection.Socket, peerID|0x20000);
-			#endif
-				Connection.Socket->send(packet.GetPacket(), packet.GetPacketSize());
-				ConnectionsPool.Deallocate(ConnectionID);
-				break;
-			}
-			if (peerID==PeersLimit) DenyConnection(ConnectionID, "Server is full");
-		}
+		if (Connection.received==14 && Connection.buffer[1]>>4==0 && Connection.buffer[2]==11 && Connection.buffer[3]==0 && std::string(&Connection.buffer[4], 10)=="revision 3")
+			AdmitConnection(ConnectionID);
 		break;
 
 	case sf::Socket::Disconnected:
@@ -583,6 +1525,129 @@ void RedRelayServer::HandleConnection(uint16_t ConnectionID){
 }
 
 
+void RedRelayServer::AdmitConnection(uint16_t ConnectionID){
+	Connection& Connection = ConnectionsPool[ConnectionID];
+	uint16_t peerID = Connection.Ticket != 0 ? Connection.PeerID : FreePeerID();
+	if (peerID>=PeersLimit){
+		DenyConnection(ConnectionID, "Server is full");
+		return;
+	}
+	if (Callbacks.PeerConnect!=NULL){
+		std::string DenyReason;
+		int8_t decision = Settle(ConnectionID, Verdict.Ticket != 0 || Callbacks.PeerConnect(peerID, Connection.Socket->getRemoteAddress(), DenyReason), DenyReason, NULL, 0, 0);
+		if (decision < 0){ //Peer ID stays reserved until the host decides, the handshake is over so it can't time out
+			Connection.Ticket = Parked.back().Ticket;
+			Connection.PeerID = peerID;
+			Timers.Cancel(PeersLimit+ConnectionID);
+			return;
+		}
+		if (!decision){
+			DenyConnection(ConnectionID, DenyReason);
+			return;
+		}
+	}
+	Log(std::to_string(peerID)+" | Peer connected from "+Connection.Socket->getRemoteAddress().toString(), 14);
+	PeersPool.Allocate(peerID);
+	PeersPool[peerID].Socket=Connection.Socket;
+	PeersPool[peerID].IpAddr=Connection.Socket->getRemoteAddress().toInteger();
+	PeersPool[peerID].Serial=++NextSerial;
+	PeersPool[peerID].LastSeen=Milliseconds();
+	if (PingInterval != 0) //Offset by ID, so peers connecting at once aren't pinged at once
+		Timers.Schedule(peerID, PeersPool[peerID].LastSeen+PingInterval*1000+(peerID%64)*PingInterval*1000/64);
+	packet.Clear();
+	packet.SetType(0);
+	packet.AddByte(0);
+	packet.AddByte(true);
+	packet.AddShort(peerID);
+	packet.AddString(WelcomeMessage);
+#ifdef REDRELAY_EPOLL
+	AssignReactor(peerID);
+#endif
+	ConnectionsPool.Deallocate(ConnectionID);
+	Timers.Cancel(PeersLimit+ConnectionID);
+	Stats.Adjust(Metrics::Connections, -1);
+	Stats.Adjust(Metrics::Peers, 1);
+	Stats.Count(Metrics::Connects);
+	SendTcp(peerID, packet.GetPacket(), packet.GetPacketSize());
+}
+
+uint16_t RedRelayServer::FreePeerID(){
+	std::vector<bool> held;
+	for (IndexedElement<Connection>& it : ConnectionsPool.GetAllocated()) if (it.element->Ticket != 0){
+		if (held.empty()) held.assign(PeersLimit, false);
+		held[it.element->PeerID] = true;
+	}
+	uint16_t peerID = PeersPool.FreeIndex(PeersLimit);
+	if (peerID < PeersLimit && !held.empty() && held[peerID])
+		for (peerID=0; peerID<PeersLimit && (PeersPool.Allocated(peerID) || held[peerID]); ++peerID);
+	return peerID;
+}
+
+int8_t RedRelayServer::Settle(uint16_t ID, bool Accept, std::string& DenyReason, const char* Msg, std::size_t Size, uint8_t Type){
+	if (Verdict.Ticket != 0){ //Parked request handled again, the callback wasn't asked
+		Verdict.Ticket = 0;
+		DenyReason = Verdict.DenyReason;
+		return Verdict.Accept;
+	}
+	if (DeferredTicket == 0) return Accept;
+	Parked.push_back(ParkedRequest());
+	ParkedRequest& request = Parked.back();
+	request.Ticket = DeferredTicket;
+	request.ID = ID;
+	request.Serial = Msg != NULL ? PeersPool[ID].Serial : 0;
+	request.Type = Type;
+	if (Msg != NULL) request.Message.assign(Msg, Msg+Size);
+	DeferredTicket = 0;
+	Stats.Adjust(Metrics::PendingDecisions, 1);
+	return -1;
+}
+
+void RedRelayServer::Unpark(uint16_t ID, uint32_t Serial){
+	uint32_t kept=0;
+	for (uint32_t i=0; i<Parked.size(); ++i){
+		if (Parked[i].ID == ID && Parked[i].Serial == Serial){
+			Stats.Adjust(Metrics::PendingDecisions, -1);
+			ReleaseChannel(Parked[i].Ticket);
+			continue;
+		}
+		if (kept != i) Parked[kept] = std::move(Parked[i]);
+		++kept;
+	}
+	Parked.resize(kept);
+}
+
+void RedRelayServer::HandleDecisions(){
+	std::vector<Decision> decided;
+	{
+		sf::Lock lock(DecidedMutex);
+		decided.swap(Decided);
+	}
+	for (Decision& decision : decided){
+		std::vector<ParkedRequest>::iterator it = Parked.begin();
+		while (it != Parked.end() && it->Ticket != decision.Ticket) ++it;
+		if (it == Parked.end()) continue; //Requester is gone, or the ticket was completed twice
+		ParkedRequest request = std::move(*it);
+		Parked.erase(it);
+		Stats.Adjust(Metrics::PendingDecisions, -1);
+		Verdict = decision;
+		if (request.Serial == 0){
+			if (ConnectionsPool.Allocated(request.ID) && ConnectionsPool[request.ID].Ticket == request.Ticket) AdmitConnection(request.ID);
+		} else if (PeersPool.Allocated(request.ID) && PeersPool[request.ID].Serial == request.Serial && !PeersPool[request.ID].Dropping.load(std::memory_order_acquire))
+			HandleTCP(request.ID, &request.Message[0], request.Message.size(), request.Type);
+		Verdict.Ticket = 0; //Unused if the request failed an earlier check this time
+		ReleaseChannel(decision.Ticket); //Still reserved if the join was denied or went to another channel
+	}
+}
+
+uint16_t RedRelayServer::ReservedChannel(uint32_t Ticket){
+	if (Ticket != 0) for (IndexedElement<Channel>& it : ChannelsPool.GetAllocated()) if (it.element->Ticket == Ticket) return it.index;
+	return ChannelsLimit;
+}
+
+void RedRelayServer::ReleaseChannel(uint32_t Ticket){
+	uint16_t channelID = ReservedChannel(Ticket);
+	if (channelID < ChannelsLimit) ChannelsPool.Deallocate(channelID);
+}
 
 RedRelayServer::RedRelayServer(){
 	Callbacks = {NULL};
@@ -590,9 +1655,25 @@ RedRelayServer::RedRelayServer(){
 	PeersLimit=128;
 	ChannelsLimit=32;
 	PeerChannelsLimit=4;
+	SendQueueLimit=1048576;
+	MaxMessageSize=16777216;
+	WorkerThreads=1;
+	HandshakeTimeout=5;
+	MetricsPort=0;
 	PingInterval=3;
 	GiveNewMaster=true;
 	LoggingEnabled=true;
+	DisconnectSlowPeers=true;
+	CoalesceWrites=false;
+	PeerIntroductions=false;
+	BlastTickRate=0;
+	ConflatedSubchannels.reset();
+	SubchannelLimits.assign(256, RateLimit());
+	FloodAction=DropMessages;
+	UdpEgressRate=0;
+	UdpQueueLimit=65536;
+	SubchannelPriorities.assign(256, 0);
+	CutThroughSize=0;
 	WelcomeMessage="RedRelay Server #"+std::to_string(REDRELAY_SERVER_BUILD)+" ("+OPERATING_SYSTEM+"/"+ARCHITECTURE+")";
 	Running=false;
 	Destructible=true;
@@ -603,7 +1684,17 @@ std::string RedRelayServer::GetVersion() const {
 }
 
 void RedRelayServer::SetPingInterval(uint8_t Interval){
+	sf::Lock lock(StateMutex);
+	bool enabled = PingInterval == 0 && Interval != 0;
 	PingInterval = Interval;
+	if (!enabled || !Running) return;
+	uint64_t now = Milliseconds(); //Peers connected while pings were off have no timer yet
+	for (IndexedElement<Peer>& it : PeersPool.GetAllocated())
+		Timers.Schedule(it.index, now+Interval*1000+(it.index%64)*Interval*1000/64);
+}
+
+void RedRelayServer::SetHandshakeTimeout(uint8_t Seconds){
+	HandshakeTimeout=Seconds;
 }
 
 void RedRelayServer::SetConnectionsLimit(uint16_t Limit){
@@ -622,14 +1713,138 @@ void RedRelayServer::SetChannelsPerPeerLimit(uint16_t Limit){
 	if (Limit>0) PeerChannelsLimit=Limit;
 }
 
+void RedRelayServer::SetSendQueueLimit(uint32_t Bytes){
+	if (Bytes>0) SendQueueLimit=Bytes;
+}
+
+void RedRelayServer::SetMaxMessageSize(uint32_t Bytes){
+	if (Bytes>0) MaxMessageSize=Bytes;
+}
+
+void RedRelayServer::SetDisconnectSlowPeers(bool Flag){
+	DisconnectSlowPeers=Flag;
+}
+
+void RedRelayServer::SetCoalesceWrites(bool Flag){
+	CoalesceWrites=Flag;
+}
+
+void RedRelayServer::SetBlastTickRate(uint16_t Rate){
+	BlastTickRate=std::min<uint16_t>(Rate, 1000);
+}
+
+void RedRelayServer::SetPeerIntroductions(bool Flag){
+	PeerIntroductions=Flag;
+}
+
+void RedRelayServer::SetTcpRateLimit(uint32_t Messages, uint32_t Bytes){
+	TcpLimit.Messages=Messages;
+	TcpLimit.Bytes=Bytes;
+}
+
+void RedRelayServer::SetUdpRateLimit(uint32_t Messages, uint32_t Bytes){
+	UdpLimit.Messages=Messages;
+	UdpLimit.Bytes=Bytes;
+}
+
+void RedRelayServer::SetSubchannelRateLimit(uint8_t Subchannel, uint32_t Messages, uint32_t Bytes){
+	SubchannelLimits[Subchannel].Messages=Messages;
+	SubchannelLimits[Subchannel].Bytes=Bytes;
+}
+
+void RedRelayServer::SetFloodAction(uint8_t Action){
+	if (Action <= Disconnect) FloodAction=Action;
+}
+
+void RedRelayServer::SetUdpEgressRate(uint32_t Bytes){
+	UdpEgressRate=Bytes;
+}
+
+void RedRelayServer::SetPeerEgressRate(uint16_t PeerID, uint32_t Bytes){
+	sf::Lock lock(StateMutex);
+	if (PeersPool.Allocated(PeerID)) PeersPool[PeerID].EgressRate = Bytes;
+}
+
+void RedRelayServer::SetUdpQueueLimit(uint32_t Bytes){
+	UdpQueueLimit=Bytes;
+}
+
+void RedRelayServer::SetCutThroughSize(uint32_t Bytes){
+	CutThroughSize=Bytes;
+}
+
+void RedRelayServer::SetSubchannelPriority(uint8_t Subchannel, uint8_t Priority){
+	SubchannelPriorities[Subchannel]=Priority;
+}
+
+void RedRelayServer::SetConflatedSubchannel(uint8_t Subchannel, bool Flag){
+	ConflatedSubchannels[Subchannel]=Flag;
+}
+
+void RedRelayServer::SetChannelConflated(uint16_t ChannelID, uint8_t Subchannel, bool Flag){
+	sf::Lock lock(StateMutex);
+	if (ChannelsPool.Allocated(ChannelID)) ChannelsPool[ChannelID].Conflated[Subchannel] = Flag; //Blasts held already go out with the next flush
+}
+
+void RedRelayServer::SetChannelTickRate(uint16_t ChannelID, uint16_t Rate){
+	sf::Lock lock(StateMutex);
+	if (!ChannelsPool.Allocated(ChannelID)) return;
+	Channel& Channel = ChannelsPool[ChannelID];
+	Rate = std::min<uint16_t>(Rate, 1000);
+	if (Rate == 0) SendTick(ChannelID); //Blasts collected so far aren't lost
+	else if (std::find(TickChannels.begin(), TickChannels.end(), ChannelID) == TickChannels.end()) TickChannels.push_back(ChannelID);
+	if (Channel.TickRate == 0 && Rate != 0) Channel.NextTick = Milliseconds()+1000/Rate;
+	Channel.TickRate = Rate;
+}
+
+void RedRelayServer::SetWorkerThreads(uint8_t Threads){
+	if (Threads>0) WorkerThreads=Threads;
+}
+
 void RedRelayServer::SetWelcomeMessage(const std::string& String){
 	WelcomeMessage=String;
 }
 
+void RedRelayServer::SetMetricsPort(uint16_t Port){
+	MetricsPort=Port;
+}
+
+void RedRelayServer::SetMetricsFile(const std::string& Path){
+	MetricsFile=Path;
+}
+
+std::string RedRelayServer::GetMetrics() const {
+	return Stats.Export();
+}
+
 void RedRelayServer::SetLogEnabled(bool Flag){
 	LoggingEnabled=Flag;
 }
 
+void RedRelayServer::SetLogLevel(uint8_t Level){
+	Logs.SetLevel(Level);
+}
+
+void RedRelayServer::SetLogConsole(bool Flag){
+	Logs.SetConsole(Flag);
+}
+
+void RedRelayServer::SetLogFile(const std::string& Path){
+	Logs.SetFile(Path);
+}
+
+void RedRelayServer::SetLogRotation(uint32_t Size, uint8_t Count){
+	Logs.SetRotation(Size, Count);
+}
+
+void RedRelayServer::SetLogQueueLimit(uint32_t Lines){
+	Logs.SetQueueLimit(Lines);
+}
+
+void RedRelayServer::SetLogDropOnOverflow(bool Flag){
+	Logs.SetDropOnOverflow(Flag);
+}
+
 const Peer& RedRelayServer::GetPeer(uint16_t PeerID){
 	return PeersPool[PeerID];
 }
@@ -682,12 +1897,52 @@ void RedRelayServer::SetServerBlastCallback(void(*ServerMessageBlast)(uint16_t,
 	Callbacks.ServerMessageBlast = ServerMessageBlast;
 }
 
+uint32_t RedRelayServer::DeferDecision(){
+	sf::Lock lock(StateMutex);
+	if (DeferredTicket == 0){
+		DeferredTicket = NextTicket++;
+		if (NextTicket == 0) NextTicket = 1; //0 means nothing is deferred
+	}
+	return DeferredTicket;
+}
+
+void RedRelayServer::CompleteDecision(uint32_t Ticket, bool Accept, const std::string& DenyReason){
+	{
+		sf::Lock lock(DecidedMutex);
+		Decided.push_back(Decision());
+		Decided.back().Ticket = Ticket;
+		Decided.back().Accept = Accept;
+		Decided.back().DenyReason = DenyReason;
+	}
+#ifdef REDRELAY_EPOLL
+	sf::Lock lock(StateMutex); //Reactors are created and deleted by Start() under the lock
+	if (Running && !Reactors.empty() && CurrentReactor != 0) Reactors[0]->Wake();
+#endif
+}
+
 void RedRelayServer::DropPeer(uint16_t ID){
+	sf::Lock lock(StateMutex);
 	if (!PeersPool.Allocated(ID)) return;
+#ifdef REDRELAY_EPOLL
+	if (PeersPool[ID].ReactorID != CurrentReactor){ //Only the owning reactor may close the socket
+		ScheduleDrop(ID);
+		return;
+	}
+#endif
 	if (Callbacks.PeerDisconnect!=NULL) Callbacks.PeerDisconnect(ID);
 	Log(std::to_string(ID)+" | Peer "+PeersPool[ID].Name+" disconnected", 4);
+	Stats.Count(Metrics::Disconnects);
+	Timers.Cancel(ID);
+	Stats.Adjust(Metrics::Peers, -1);
+	if (PeersPool[ID].Forward.Left != 0) EndForward(ID);
+	if (!Parked.empty()) Unpark(ID, PeersPool[ID].Serial);
+	Stats.Adjust(Metrics::QueuedBytes, -(int64_t)PeersPool[ID].Queued());
+	if (PeersPool[ID].Paced){ //Its ID may be taken again before the next pacing pass
+		Stats.Adjust(Metrics::PacedBytes, -(int64_t)PeersPool[ID].UdpQueued);
+		PacedPeers.erase(std::find(PacedPeers.begin(), PacedPeers.end(), ID));
+	}
 	for (uint16_t channelID : PeersPool[ID].Channels){
-        ChannelsPool[channelID].ErasePeer(ID);
+        ChannelsPool[channelID].ErasePeer(ID, PeersPool[ID].Name);
 		if (ChannelsPool[channelID].Peers.size()==0 || (ChannelsPool[channelID].CloseOnLeave && ChannelsPool[channelID].Master==ID)){
 			if (Callbacks.ChannelClosed!=NULL) Callbacks.ChannelClosed(channelID);
 			Log("Channel "+ChannelsPool[channelID].Name+" closed", 12);
@@ -697,6 +1952,7 @@ void RedRelayServer::DropPeer(uint16_t ID){
 			}
 			ChannelNames.erase(ChannelsPool[channelID].Name);
 			ChannelsPool.Deallocate(channelID);
+			Stats.Adjust(Metrics::Channels, -1);
 		} else {
 			if (ChannelsPool[channelID].Master==ID){
 				if (GiveNewMaster && ChannelsPool[channelID].Peers.size()>0) ChannelsPool[channelID].Master = *ChannelsPool[channelID].Peers.begin();
@@ -705,11 +1961,212 @@ void RedRelayServer::DropPeer(uint16_t ID){
 			PeerLeftChannel(channelID, ID);
 		}
 	}
+#ifdef REDRELAY_EPOLL
+	Reactors[PeersPool[ID].ReactorID]->Owned[ID]=0;
+	SelectorOf(ID).remove(*PeersPool[ID].Socket);
+#else
 	Selector.remove(*PeersPool[ID].Socket);
+#endif
 	delete PeersPool[ID].Socket;
+	if (PeersPool[ID].buffer!=NULL) Buffers.Release(PeersPool[ID].buffer, PeersPool[ID].buffsize);
 	PeersPool.Deallocate(ID);
 }
 
+void RedRelayServer::ServeMetrics(sf::TcpListener& Listener){
+	sf::TcpSocket Client;
+	if (Listener.accept(Client) != sf::Socket::Done) return;
+	sf::SocketSelector selector; //Request is read with a timeout, a stuck scraper must not hold the thread
+	selector.add(Client);
+	std::string request;
+	char tmp[1024];
+	std::size_t received;
+	while (request.find("\r\n\r\n") == std::string::npos && request.size() < 8192 && selector.wait(sf::seconds(1))
+		&& Client.receive(tmp, sizeof(tmp), received) == sf::Socket::Done) request.append(tmp, received);
+	std::string body = Stats.Export();
+	std::string response = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: "+std::to_string(body.size())+"\r\nConnection: close\r\n\r\n"+body;
+	Client.send(response.data(), response.size());
+}
+
+void RedRelayServer::WriteMetrics(){ //Written aside and renamed, readers never see a partial file
+	std::string path = MetricsFile+".tmp";
+	std::ofstream file(path.c_str(), std::ofstream::trunc);
+	if (!file.is_open()) return;
+	file<<Stats.Export();
+	file.close();
+	std::remove(MetricsFile.c_str()); //rename() doesn't overwrite on Windows
+	std::rename(path.c_str(), MetricsFile.c_str());
+}
+
+void RedRelayServer::MetricsHandler(){
+	sf::TcpListener listener;
+	sf::SocketSelector selector;
+	bool listening = false;
+	if (MetricsPort != 0){
+		listening = listener.listen(MetricsPort, sf::IpAddress::LocalHost) == sf::Socket::Done;
+		sf::Lock lock(StateMutex);
+		if (listening){
+			selector.add(listener);
+			Log("Metrics available at http://127.0.0.1:"+std::to_string(MetricsPort)+"/metrics", 12);
+		} else Log("Error: Could not bind metrics port "+std::to_string(MetricsPort), 4, Logger::Error);
+	}
+	sf::Clock clock;
+	while (Running){
+		if (!listening) sf::sleep(sf::seconds(1));
+		else if (selector.wait(sf::seconds(1))) ServeMetrics(listener);
+		if (!MetricsFile.empty() && clock.getElapsedTime() >= sf::seconds(1)){
+			clock.restart();
+			WriteMetrics();
+		}
+	}
+	if (!MetricsFile.empty()) WriteMetrics();
+}
+
+uint32_t RedRelayServer::WaitTime(){
+	sf::Lock lock(StateMutex);
+	uint64_t now = Milliseconds(), next = Timers.NextExpiry();
+	for (uint16_t channelID : TickChannels) if (ChannelsPool.Allocated(channelID) && ChannelsPool[channelID].TickRate != 0)
+		next = std::min(next, ChannelsPool[channelID].NextTick);
+	next = std::min(next, NextResume());
+	next = std::min(next, NextPaced());
+#ifndef REDRELAY_EPOLL
+	if (!Parked.empty()) next = std::min(next, now+DecisionPoll);
+#endif
+	return next > now ? next-now : 1;
+}
+
+void RedRelayServer::AggregateBlast(uint16_t ChannelID, const char* Msg, std::size_t Size){
+	Channel& Channel = ChannelsPool[ChannelID];
+	if (Channel.Blasts.size()+Channel.SlotBytes+Size > TickBacklogLimit) SendTick(ChannelID);
+	AppendBlast(Channel, Msg, Size);
+}
+
+void RedRelayServer::AppendBlast(Channel& Channel, const char* Msg, std::size_t Size){ //Takes a blast in relayed form
+	uint16_t channelID = (uint8_t)Msg[2]|(uint8_t)Msg[3]<<8, peerID = (uint8_t)Msg[4]|(uint8_t)Msg[5]<<8;
+	std::size_t payload = Size-6;
+	if (Channel.Datagrams.empty() || (Channel.Blasts.size()-Channel.Datagrams.back() > 3 && Channel.Blasts.size()-Channel.Datagrams.back()+6+payload > TickDatagramSize)){
+		char header[3] = {(char)(12<<4), (char)(channelID&255), (char)(channelID>>8)};
+		Channel.Datagrams.push_back(Channel.Blasts.size());
+		Channel.Owners.push_back(peerID);
+		Channel.Priorities.push_back(0);
+		Channel.Blasts.insert(Channel.Blasts.end(), header, header+3);
+	} else if (Channel.Owners.back() != peerID) Channel.Owners.back() = 65535;
+	Channel.Priorities.back() = std::max(Channel.Priorities.back(), SubchannelPriorities[(uint8_t)Msg[1]]);
+	//Variant, subchannel, sender and payload size, then the payload
+	char entry[6] = {(char)(Msg[0]&15), Msg[1], Msg[4], Msg[5], (char)(payload&255), (char)(payload>>8)};
+	Channel.Blasts.insert(Channel.Blasts.end(), entry, entry+6);
+	Channel.Blasts.insert(Channel.Blasts.end(), &Msg[6], &Msg[Size]);
+}
+
+void RedRelayServer::ConflateBlast(uint16_t ChannelID, const char* Msg, std::size_t Size){
+	Channel& Channel = ChannelsPool[ChannelID];
+	if (Channel.TickRate != 0 && Channel.Blasts.size()+Channel.SlotBytes+Size > TickBacklogLimit) SendTick(ChannelID);
+	uint32_t key = ((uint8_t)Msg[4]|(uint8_t)Msg[5]<<8)<<8|(uint8_t)Msg[1];
+	std::pair<std::unordered_map<uint32_t, uint32_t>::iterator, bool> slot = Channel.SlotIndex.insert(std::make_pair(key, Channel.SlotsUsed));
+	if (slot.second){ //First blast of this sender and subchannel since the last flush
+		if (Channel.SlotsUsed == Channel.Slots.size()) Channel.Slots.push_back(std::vector<char>());
+		if (Channel.SlotsUsed++ == 0 && Channel.TickRate == 0) Conflating.push_back(ChannelID);
+	} else {
+		Channel.SlotBytes -= Channel.Slots[slot.first->second].size();
+		Stats.Count(Metrics::ConflatedBlasts);
+	}
+	Channel.Slots[slot.first->second].assign(Msg, Msg+Size);
+	Channel.SlotBytes += Size;
+}
+
+void RedRelayServer::SendTick(uint16_t ChannelID){
+	Channel& Channel = ChannelsPool[ChannelID];
+	for (uint32_t i=0; i<Channel.SlotsUsed; ++i) AppendBlast(Channel, &Channel.Slots[i][0], Channel.Slots[i].size());
+	Channel.ClearSlots();
+	if (Channel.Blasts.empty()) return;
+	Channel.Datagrams.push_back(Channel.Blasts.size()); //End of the last datagram
+	for (uint16_t receiver : Channel.Peers) if (PeersPool[receiver].UdpPort != 0)
+		for (std::size_t i=0; i<Channel.Owners.size(); ++i) if (Channel.Owners[i] != receiver) //Nobody gets back a datagram of only their own blasts
+			SendUdp(receiver, &Channel.Blasts[Channel.Datagrams[i]], Channel.Datagrams[i+1]-Channel.Datagrams[i], Channel.Priorities[i]);
+#ifdef REDRELAY_MMSG
+	Batch.Flush(UdpSocket); //Queued datagrams point into the channel buffer
+#endif
+	Channel.Blasts.clear();
+	Channel.Datagrams.clear();
+	Channel.Owners.clear();
+	Channel.Priorities.clear();
+}
+
+void RedRelayServer::SendConflated(){ //Newest blasts of the receive batch, for channels without a tick
+	if (Conflating.empty()) return;
+	for (uint16_t channelID : Conflating){
+		Channel& Channel = ChannelsPool[channelID];
+		for (uint32_t i=0; i<Channel.SlotsUsed; ++i){
+			const std::vector<char>& blast = Channel.Slots[i];
+			uint16_t sender = (uint8_t)blast[4]|(uint8_t)blast[5]<<8;
+			for (uint16_t receiver : Channel.Peers) if (receiver != sender)
+				SendUdp(receiver, &blast[0], blast.size(), SubchannelPriorities[(uint8_t)blast[1]]);
+		}
+	}
+#ifdef REDRELAY_MMSG
+	Batch.Flush(UdpSocket); //Queued datagrams point into the slots
+#endif
+	for (uint16_t channelID : Conflating) ChannelsPool[channelID].ClearSlots();
+	Conflating.clear();
+}
+
+void RedRelayServer::HandleTicks(){
+	uint64_t now = Milliseconds();
+	for (std::size_t i=0; i<TickChannels.size(); ){
+		uint16_t channelID = TickChannels[i];
+		if (!ChannelsPool.Allocated(channelID) || ChannelsPool[channelID].TickRate == 0){ //Closed or switched back to immediate relaying
+			TickChannels[i] = TickChannels.back();
+			TickChannels.pop_back();
+			continue;
+		}
+		Channel& Channel = ChannelsPool[channelID];
+		if (now >= Channel.NextTick){
+			SendTick(channelID);
+			Channel.NextTick += 1000/Channel.TickRate;
+			if (Channel.NextTick <= now) Channel.NextTick = now+1000/Channel.TickRate; //Fell behind, don't burst to catch up
+		}
+		++i;
+	}
+}
+
+void RedRelayServer::HandleTimers(){
+	uint64_t now = Milliseconds();
+	Expired.clear();
+	Timers.Advance(now, Expired);
+	for (uint32_t key : Expired){
+		if (key >= PeersLimit){ //Connection didn't complete the handshake in time
+			if (!ConnectionsPool.Allocated(key-PeersLimit)) continue;
+			DebugLog(std::to_string(key-PeersLimit)+" | Handshake timeout");
+			Stats.Count(Metrics::HandshakeTimeouts);
+			DropConnection(key-PeersLimit);
+			continue;
+		}
+		uint16_t peerID = key;
+		if (!PeersPool.Allocated(peerID) || PeersPool[peerID].Dropping.load(std::memory_order_acquire) || PingInterval == 0) continue;
+		Peer& Peer = PeersPool[peerID];
+		if (now-Peer.LastSeen < PingInterval*1000u){ //Recent traffic proves the peer alive, no ping needed
+			Peer.PingTries = 0;
+			Timers.Schedule(peerID, Peer.LastSeen+PingInterval*1000);
+			continue;
+		}
+		if (Peer.PingTries > 2){
+			DebugLog(std::to_string(peerID)+" | Ping timeout");
+			Stats.Count(Metrics::PingTimeouts);
+			ScheduleDrop(peerID);
+			continue;
+		}
+		DebugLog(std::to_string(peerID)+" | Ping request");
+		packet.Clear();
+		packet.SetType(11);
+		if (Peer.UdpPort != 0){
+			UdpSocket.send(packet.GetPacket(), 1, sf::IpAddress(Peer.IpAddr), Peer.UdpPort);
+			Stats.UdpOut(packet.GetPacket()[0], 1);
+		}
+		SendTcp(peerID, packet.GetPacket(), packet.GetPacketSize());
+		Peer.PingTries++;
+		Timers.Schedule(peerID, now+PingInterval*1000);
+	}
+}
+
 #ifdef REDRELAY_MULTITHREAD
 void RedRelayServer::UdpHandler(){
     while (Running){
@@ -718,17 +2175,56 @@ void RedRelayServer::UdpHandler(){
 }
 #endif
 
+void RedRelayServer::SendToPeer(uint16_t PeerID, uint8_t Subchannel, const char* Data, std::size_t Size, uint8_t Variant){
+	SendToMany(&PeerID, 1, Subchannel, Data, Size, Variant);
+}
+
+void RedRelayServer::SendToMany(const uint16_t* PeerIDs, std::size_t Count, uint8_t Subchannel, const char* Data, std::size_t Size, uint8_t Variant){
+	sf::Lock lock(StateMutex);
+	char header[7];
+	uint8_t headersize = FrameHeader(header, 1<<4|(Variant&15), Size+1);
+	header[headersize++]=Subchannel;
+	SharedBuffer Shared; //Copied once, only if some receiver can't take the message right away
+	for (std::size_t i=0; i<Count; ++i) if (PeersPool.Allocated(PeerIDs[i]))
+		SendTcp(PeerIDs[i], header, headersize, Data, Size, &Shared);
+}
+
+void RedRelayServer::SendToChannel(uint16_t ChannelID, uint8_t Subchannel, const char* Data, std::size_t Size, uint8_t Variant){
+	sf::Lock lock(StateMutex);
+	if (!ChannelsPool.Allocated(ChannelID)) return;
+	char header[7];
+	uint8_t headersize = FrameHeader(header, 1<<4|(Variant&15), Size+1);
+	header[headersize++]=Subchannel;
+	BroadcastTcp(ChannelID, 65535, header, headersize, Data, Size);
+}
+
+void RedRelayServer::BlastToChannel(uint16_t ChannelID, uint8_t Subchannel, const char* Data, std::size_t Size, uint8_t Variant){
+	sf::Lock lock(StateMutex);
+	if (!ChannelsPool.Allocated(ChannelID) || Size > 65505) return;
+	std::vector<char> datagram(2+Size);
+	datagram[0]=1<<4|(Variant&15);
+	datagram[1]=Subchannel;
+	if (Size) memcpy(&datagram[2], Data, Size);
+	for (uint16_t peerID : ChannelsPool[ChannelID].Peers) if (PeersPool[peerID].UdpPort != 0)
+		SendUdp(peerID, &datagram[0], datagram.size(), SubchannelPriorities[Subchannel]);
+#ifdef REDRELAY_MMSG
+	Batch.Flush(UdpSocket); //Datagram is gone once this returns
+#endif
+}
+
 void RedRelayServer::Start(uint16_t Port){
 	{
 		std::streambuf* previous = sf::err().rdbuf();
 		sf::err().rdbuf(NULL);
 		if (TcpListener.listen(Port) != sf::Socket::Done || UdpSocket.bind(Port) != sf::Socket::Done){
 			if (Callbacks.Error!=NULL) Callbacks.Error("Could not bind port "+std::to_string(Port));
-			Log("Error: Could not bind port "+std::to_string(Port), 4);
+			Log("Error: Could not bind port "+std::to_string(Port), 4, Logger::Error);
+			Logs.Flush();
 			return;
 		}
 		sf::err().rdbuf(previous);
 	}
+	TcpListener.setBlocking(false); //Accepted in batches until the backlog is empty
         #ifdef SIGPIPE
 	signal(SIGPIPE, SIG_IGN); //Ignore writes to closed socket
         #endif
@@ -749,6 +2245,9 @@ void RedRelayServer::Start(uint16_t Port){
 	#ifdef _WIN32
 		WelcomeMessage+=", libwepoll";
 		Log("Extended polling enabled (github.com/piscisaureus/wepoll)", 12);
+	#elif defined(REDRELAY_URING)
+		WelcomeMessage+=", io_uring";
+		Log("Extended polling enabled (io_uring)", 12);
 	#elif KQUEUE
         WelcomeMessage+=", kqueue";
 		Log("Extended polling enabled (kqueue)", 12);
@@ -757,7 +2256,11 @@ void RedRelayServer::Start(uint16_t Port){
 		Log("Extended polling enabled", 12);
 	#endif
 
+	#ifdef REDRELAY_URING
+	Selector.listen(TcpListener, 0);
+	#else
 	Selector.add(TcpListener, 0);
+	#endif
 
 	#ifndef REDRELAY_MULTITHREAD
 	Selector.add(UdpSocket, 1);
@@ -770,19 +2273,41 @@ void RedRelayServer::Start(uint16_t Port){
 	#endif
 #endif
 
-	float WaitTime = PingInterval, LastPing;
+	Timers.Reset(PeersLimit+ConnectionsLimit, Milliseconds()); //Peer IDs first, then connection IDs
 	Running = true;
     Destructible = false;
 
+#ifdef REDRELAY_EPOLL
+	PeersPool.Reserve(PeersLimit); //Reactors access their own peers without locking, storage must not move
+	{
+		sf::Lock lock(StateMutex);
+		Reactors.push_back(new Reactor(&Selector));
+		for (uint8_t i=1; i<WorkerThreads; ++i) Reactors.push_back(new Reactor);
+		for (Reactor* it : Reactors) it->Owned.assign(PeersLimit, 0);
+	}
+	CurrentReactor = 0;
+	if (WorkerThreads > 1){
+		Log(std::to_string(WorkerThreads)+" reactor threads enabled", 12);
+		for (uint8_t i=1; i<Reactors.size(); ++i) Reactors[i]->Thread = std::thread(&RedRelayServer::RunReactor, this, i);
+	}
+#else
+	if (WorkerThreads > 1) Log("Worker threads require extended polling, running in a single thread", 12);
+#endif
+
 #ifdef REDRELAY_MULTITHREAD
 	Log("Multi-threading enabled", 12);
     std::thread UdpThread(&RedRelayServer::UdpHandler, this);
 #endif
 
+	std::thread MetricsThread;
+	if (MetricsPort != 0 || !MetricsFile.empty()) MetricsThread = std::thread(&RedRelayServer::MetricsHandler, this);
+
 	while (Running){
 
 	#ifdef REDRELAY_EPOLL
-		uint32_t events = Selector.wait(WaitTime*1000);
+		SubmitSends(0);
+		uint32_t events = Selector.wait(Reactors[0]->Backlog.empty() && Reactors[0]->Unsent.empty() ? WaitTime() : 0);
+		uint64_t start = Metrics::Now();
 		for (uint32_t i=0; i<events; ++i){
 
             #ifndef REDRELAY_MULTITHREAD
@@ -790,16 +2315,28 @@ void RedRelayServer::Start(uint16_t Port){
 			else
             #endif
 
-			if ((Selector.at(i)&0x20000) != 0) ReceiveTcp(Selector.at(i)&65535);
+			if ((Selector.at(i)&0x20000) != 0) PeerEvent(Selector, i);
 			else
 
+            #ifdef REDRELAY_URING
+			if (Selector.at(i) == 0) NewConnection(Selector.accepted(i));
+			else
+            #else
 			if (Selector.at(i) == 0) NewConnection();
 			else
+            #endif
+
+			if (Selector.at(i) == 2) Reactors[0]->Drain();
+			else
 
 			if ((Selector.at(i)&0x10000) != 0) HandleConnection(Selector.at(i)&65535);
 		}
+		ReadBacklog(0);
+		HandleInbox(0);
 	#else
-		if (Selector.wait(sf::seconds(WaitTime))){
+		bool ready = Selector.wait(sf::milliseconds(PendingData ? 1 : WaitTime()));
+		uint64_t start = Metrics::Now();
+		if (ready){
 
             #ifndef REDRELAY_MULTITHREAD
 			if (Selector.isReady(UdpSocket)) ReceiveUdp();
@@ -811,46 +2348,70 @@ void RedRelayServer::Start(uint16_t Port){
 
 			for (uint32_t i=0; i<ConnectionsPool.Size(); ++i) if (Selector.isReady(*ConnectionsPool.GetAllocated().at(i).element->Socket)) HandleConnection(ConnectionsPool.GetAllocated().at(i).index);
 		}
-	#endif
 
-		if (PingInterval != 0){
-			WaitTime -= DeltaTime();
-			if (WaitTime <= 0.1f){
-				WaitTime = PingInterval;
-				packet.Clear();
-				packet.SetType(11);
-				const char* tmp = packet.GetPacket();
-                DebugLog("Ping tick");
-				for (uint32_t i=0; i<PeersPool.Size(); ++i){
-                    uint16_t peerID = PeersPool.GetAllocated().at(i).index;
-                    if (PeersPool[peerID].PingTries > 2){
-                        DebugLog(std::to_string(peerID)+" | Ping timeout");
-						DropPeer(peerID);
-					} else {
-						if (PeersPool[peerID].PingTries > 0) {
-							DebugLog(std::to_string(PeersPool.GetAllocated().at(i).index)+" | Ping request");
-							UdpSocket.send(tmp, 1, PeersPool[peerID].Socket->getRemoteAddress(), PeersPool[peerID].UdpPort);
-							PeersPool[peerID].Socket->send(tmp, packet.GetPacketSize());
-						}
-						PeersPool[peerID].PingTries++;
-					}
-				}
+		if (PendingData){
+			PendingData = false;
+			for (uint32_t i=0; i<PeersPool.Size(); ++i) if (PeersPool.GetAllocated().at(i).element->Queued() != 0){
+				FlushPeer(PeersPool.GetAllocated().at(i).index);
+				if (PeersPool.GetAllocated().at(i).element->Queued() != 0) PendingData = true;
 			}
 		}
+	#endif
+
+		sf::Lock lock(StateMutex);
+		HandleDecisions();
+		HandleTimers();
+		HandleTicks();
+		PaceUdp();
+		DropScheduled();
+		ResumeReads();
+		Stats.Observe(Metrics::LoopTime, Metrics::Now()-start);
 	}
 	Log("Stopping the server...", 12);
+#ifdef REDRELAY_EPOLL
+	for (uint8_t i=1; i<Reactors.size(); ++i){
+		Reactors[i]->Wake();
+		Reactors[i]->Thread.join();
+	}
+#endif
     UdpSocket.unbind(); //this should have unblocked the UDP thread
 #ifdef REDRELAY_MULTITHREAD
     UdpThread.join(); //waiting for thread to close
 #endif
+	if (MetricsThread.joinable()) MetricsThread.join();
 	for (IndexedElement<Connection>&it : ConnectionsPool.GetAllocated()) delete it.element->Socket;
-	for (IndexedElement<Peer>&it : PeersPool.GetAllocated()) delete it.element->Socket;
+	for (IndexedElement<Peer>&it : PeersPool.GetAllocated()){
+		delete it.element->Socket;
+		if (it.element->buffer!=NULL) Buffers.Release(it.element->buffer, it.element->buffsize);
+	}
 	ConnectionsPool.Clear();
 	PeersPool.Clear();
 	ChannelsPool.Clear();
 	ChannelNames.clear();
+	DropQueue.clear();
+	TickChannels.clear();
+	Conflating.clear();
+	ThrottledPeers.clear();
+	PacedPeers.clear();
+	Parked.clear();
+	Verdict.Ticket = 0;
+	DeferredTicket = 0;
+	{
+		sf::Lock lock(DecidedMutex);
+		Decided.clear();
+	}
+	Stats.ResetGauges();
+#ifdef REDRELAY_EPOLL
+	{
+		sf::Lock lock(StateMutex);
+		for (Reactor* it : Reactors) delete it;
+		Reactors.clear();
+	}
+	NextReactor=0;
+#endif
 	TcpListener.close();
     Log("Server closed", 12);
+	Logs.Flush(); //Embedding application may exit right after Start() returns
     Destructible=true;
 }
 
@@ -0,0 +1,121 @@
+////////////////////////////////////////////////////////////
+//
+// RedRelay - a Lacewing Relay protocol reimplementation
+// Copyright (c) 2019 LekKit (LekKit#4400 in Discord)
+//
+// This software is provided 'as-is', without any express or implied
+// warranty. In no event will the authors be held liable for any damages
+// arising from the use of this software.
+//
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+//
+// 1. The origin of this software must not be misrepresented; you must not
+//   claim that you wrote the original software. If you use this software
+//   in a product, an acknowledgment in the product documentation would be
+//   appreciated but is not required.
+// 2. Altered source versions must be plainly marked as such, and must not be
+//   misrepresented as being the original software.
+// 3. This notice may not be removed or altered from any source distribution.
+//
+////////////////////////////////////////////////////////////
+
+
+#include "RedRelayServer.hpp"
+#include <cstring>
+#include <algorithm>
+
+namespace rs{
+
+static const std::size_t SegmentSize = 65536; //Small copied messages are packed together up to this size
+
+bool SendQueue::Push(const char* Data, std::size_t Size, std::size_t Limit){
+	if (size+Size > Limit) return false;
+	if (Size == 0) return true;
+	if (segments.empty() || segments.back().Shared || segments.back().Sealed || segments.back().Owned.size()+Size > SegmentSize) segments.emplace_back();
+	segments.back().Owned.insert(segments.back().Owned.end(), Data, Data+Size);
+	size += Size;
+	return true;
+}
+
+bool SendQueue::Push(const SharedBuffer& Data, std::size_t Offset, std::size_t Limit){
+	if (Offset >= Data->size()) return true;
+	if (size+Data->size()-Offset > Limit) return false;
+	segments.emplace_back();
+	segments.back().Shared = Data;
+	segments.back().Begin = Offset;
+	size += Data->size()-Offset;
+	return true;
+}
+
+const char* SendQueue::Front(std::size_t& Size) const {
+	if (segments.empty()){
+		Size = 0;
+		return NULL;
+	}
+	const Segment& segment = segments.front();
+	const std::vector<char>& data = segment.Shared ? *segment.Shared : segment.Owned;
+	Size = data.size()-segment.Begin;
+	return &data[segment.Begin];
+}
+
+std::size_t SendQueue::Gather(const char** Data, std::size_t* Sizes, std::size_t Count) const {
+	std::size_t i=0;
+	for (; i<Count && i<segments.size(); ++i){
+		const Segment& segment = segments[i];
+		const std::vector<char>& data = segment.Shared ? *segment.Shared : segment.Owned;
+		Data[i] = &data[segment.Begin];
+		Sizes[i] = data.size()-segment.Begin;
+	}
+	return i;
+}
+
+void SendQueue::Pop(std::size_t Size){
+	if (Size >= size){
+		Clear();
+		return;
+	}
+	size -= Size;
+	while (Size){
+		Segment& segment = segments.front();
+		std::size_t left = (segment.Shared ? segment.Shared->size() : segment.Owned.size())-segment.Begin;
+		if (Size < left){
+			segment.Begin += Size;
+			return;
+		}
+		Size -= left;
+		segments.pop_front();
+	}
+}
+
+void SendQueue::Move(SendQueue& To, std::size_t Size){
+	while (Size && !segments.empty()){
+		Segment& segment = segments.front();
+		const std::vector<char>& data = segment.Shared ? *segment.Shared : segment.Owned;
+		std::size_t chunk = std::min(Size, data.size()-segment.Begin);
+		if (segment.Shared && chunk == data.size()-segment.Begin) To.Push(segment.Shared, segment.Begin, (std::size_t)-1);
+		else To.Push(&data[segment.Begin], chunk, (std::size_t)-1);
+		Pop(chunk);
+		Size -= chunk;
+	}
+}
+
+void SendQueue::Seal(){
+	if (!segments.empty()) segments.back().Sealed = true;
+}
+
+std::size_t SendQueue::Size() const {
+	return size;
+}
+
+bool SendQueue::Empty() const {
+	return size == 0;
+}
+
+void SendQueue::Clear(){ //Drained queues give their memory back, idle peers shouldn't hold it
+	std::deque<Segment>().swap(segments);
+	size = 0;
+}
+
+}
@@ -0,0 +1,105 @@
+////////////////////////////////////////////////////////////
+//
+// RedRelay - a Lacewing Relay protocol reimplementation
+// Copyright (c) 2019 LekKit (LekKit#4400 in Discord)
+//
+// This software is provided 'as-is', without any express or implied
+// warranty. In no event will the authors be held liable for any damages
+// arising from the use of this software.
+//
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+//
+// 1. The origin of this software must not be misrepresented; you must not
+//   claim that you wrote the original software. If you use this software
+//   in a product, an acknowledgment in the product documentation would be
+//   appreciated but is not required.
+// 2. Altered source versions must be plainly marked as such, and must not be
+//   misrepresented as being the original software.
+// 3. This notice may not be removed or altered from any source distribution.
+//
+////////////////////////////////////////////////////////////
+
+
+#include "TimingWheel.hpp"
+
+const uint32_t TimingWheel::Tick;
+const uint32_t TimingWheel::Slots;
+const uint32_t TimingWheel::None;
+
+void TimingWheel::Reset(uint32_t Keys, uint64_t Now){
+	nodes.assign(Keys, Node());
+	heads.assign(2*Slots, None);
+	current = Now/Tick;
+}
+
+void TimingWheel::Place(uint32_t Key){
+	Node& node = nodes[Key];
+	uint64_t tick = node.tick < current ? current : node.tick;
+	if (tick-current < Slots) node.slot = tick%Slots;
+	else if (tick-current < (uint64_t)Slots*Slots) node.slot = Slots+(tick/Slots)%Slots;
+	else node.slot = Slots+(current/Slots+Slots-1)%Slots; //Too far, parked in the last outer slot and placed again on cascade
+	node.prev = None;
+	node.next = heads[node.slot];
+	if (node.next != None) nodes[node.next].prev = Key;
+	heads[node.slot] = Key;
+}
+
+void TimingWheel::Unlink(uint32_t Key){
+	Node& node = nodes[Key];
+	if (node.slot == None) return;
+	if (node.prev != None) nodes[node.prev].next = node.next;
+	else heads[node.slot] = node.next;
+	if (node.next != None) nodes[node.next].prev = node.prev;
+	node.slot = None;
+}
+
+void TimingWheel::Schedule(uint32_t Key, uint64_t Time){
+	if (Key >= nodes.size()) return;
+	Unlink(Key);
+	nodes[Key].tick = (Time+Tick-1)/Tick; //Rounded up, a deadline never fires early
+	Place(Key);
+}
+
+void TimingWheel::Cancel(uint32_t Key){
+	if (Key < nodes.size()) Unlink(Key);
+}
+
+bool TimingWheel::Scheduled(uint32_t Key) const {
+	return Key < nodes.size() && nodes[Key].slot != None;
+}
+
+void TimingWheel::Advance(uint64_t Now, std::vector<uint32_t>& Expired){
+	if (heads.empty()) return;
+	uint64_t target = Now/Tick;
+	for (; current <= target; ++current){
+		if (current%Slots == 0){ //Inner level wrapped, move the next outer slot down
+			uint32_t slot = Slots+(current/Slots)%Slots;
+			uint32_t key = heads[slot];
+			heads[slot] = None;
+			while (key != None){
+				uint32_t next = nodes[key].next;
+				nodes[key].slot = None;
+				Place(key);
+				key = next;
+			}
+		}
+		uint32_t slot = current%Slots;
+		uint32_t key = heads[slot];
+		heads[slot] = None;
+		while (key != None){
+			uint32_t next = nodes[key].next;
+			nodes[key].slot = None;
+			if (nodes[key].tick <= current) Expired.push_back(key);
+			else Place(key);
+			key = next;
+		}
+	}
+}
+
+uint64_t TimingWheel::NextExpiry() const {
+	uint64_t cascade = (current+Slots-1)/Slots*Slots; //Current tick itself if its cascade is still due
+	if (!heads.empty()) for (uint64_t tick = current; tick < cascade; ++tick) if (heads[tick%Slots] != None) return tick*Tick;
+	return cascade*Tick;
+}
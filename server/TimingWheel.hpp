@@ -0,0 +1,59 @@
+////////////////////////////////////////////////////////////
+//
+// RedRelay - a Lacewing Relay protocol reimplementation
+// Copyright (c) 2019 LekKit (LekKit#4400 in Discord)
+//
+// This software is provided 'as-is', without any express or implied
+// warranty. In no event will the authors be held liable for any damages
+// arising from the use of this software.
+//
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+//
+// 1. The origin of this software must not be misrepresented; you must not
+//   claim that you wrote the original software. If you use this software
+//   in a product, an acknowledgment in the product documentation would be
+//   appreciated but is not required.
+// 2. Altered source versions must be plainly marked as such, and must not be
+//   misrepresented as being the original software.
+// 3. This notice may not be removed or altered from any source distribution.
+//
+////////////////////////////////////////////////////////////
+
+
+#ifndef TIMING_WHEEL
+#define TIMING_WHEEL
+
+#include <vector>
+#include <cstdint>
+
+//Two level hashed timing wheel, one pending deadline per key, keys are small integers
+class TimingWheel{
+private:
+    static const uint32_t Tick = 16; //Milliseconds per slot
+    static const uint32_t Slots = 256; //Per level, so the inner level spans ~4 s and the outer one ~17 min
+    static const uint32_t None = 0xFFFFFFFF;
+    struct Node{
+        uint32_t prev=None, next=None;
+        uint32_t slot=None; //Index in heads, None when the key isn't scheduled
+        uint64_t tick=0;
+    };
+    std::vector<Node> nodes;
+    std::vector<uint32_t> heads; //Inner level slots followed by outer level ones
+    uint64_t current=0; //Next tick to be processed
+
+    void Place(uint32_t Key);
+    void Unlink(uint32_t Key);
+public:
+    void Reset(uint32_t Keys, uint64_t Now); //Drops every deadline
+    void Schedule(uint32_t Key, uint64_t Time); //Replaces a pending deadline, times are in milliseconds
+    void Cancel(uint32_t Key);
+    bool Scheduled(uint32_t Key) const;
+    //Collects keys whose deadline has passed, they are no longer scheduled
+    void Advance(uint64_t Now, std::vector<uint32_t>& Expired);
+    //Time worth waking up at, either the nearest deadline or the next cascade of the outer level
+    uint64_t NextExpiry() const;
+};
+
+#endif
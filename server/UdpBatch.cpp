@@ -0,0 +1,92 @@
+////////////////////////////////////////////////////////////
+//
+// RedRelay - a Lacewing Relay protocol reimplementation
+// Copyright (c) 2019 LekKit (LekKit#4400 in Discord)
+//
+// This software is provided 'as-is', without any express or implied
+// warranty. In no event will the authors be held liable for any damages
+// arising from the use of this software.
+//
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+//
+// 1. The origin of this software must not be misrepresented; you must not
+//   claim that you wrote the original software. If you use this software
+//   in a product, an acknowledgment in the product documentation would be
+//   appreciated but is not required.
+// 2. Altered source versions must be plainly marked as such, and must not be
+//   misrepresented as being the original software.
+// 3. This notice may not be removed or altered from any source distribution.
+//
+////////////////////////////////////////////////////////////
+
+
+#include "ModSocket.hpp"
+#include "UdpBatch.hpp"
+#include <cstring>
+#include <cerrno>
+#include <arpa/inet.h>
+
+static const std::size_t SlotSize = 65536;
+
+UdpBatch::UdpBatch(unsigned int Slots, unsigned int Queue) : buffers(Slots*SlotSize), inmsgs(Slots), inlist(Slots), inaddrs(Slots),
+    outmsgs(Queue), outlist(Queue), outaddrs(Queue), queued(0){
+	memset(inmsgs.data(), 0, inmsgs.size()*sizeof(mmsghdr));
+	memset(outmsgs.data(), 0, outmsgs.size()*sizeof(mmsghdr));
+	for (unsigned int i=0; i<Slots; ++i){
+		inlist[i].iov_base = &buffers[i*SlotSize];
+		inlist[i].iov_len = SlotSize;
+		inmsgs[i].msg_hdr.msg_iov = &inlist[i];
+		inmsgs[i].msg_hdr.msg_iovlen = 1;
+		inmsgs[i].msg_hdr.msg_name = &inaddrs[i];
+	}
+	for (unsigned int i=0; i<Queue; ++i){
+		outmsgs[i].msg_hdr.msg_iov = &outlist[i];
+		outmsgs[i].msg_hdr.msg_iovlen = 1;
+		outmsgs[i].msg_hdr.msg_name = &outaddrs[i];
+		outmsgs[i].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+	}
+}
+
+unsigned int UdpBatch::Receive(const sf::UdpSocket& Socket){
+	for (std::size_t i=0; i<inmsgs.size(); ++i) inmsgs[i].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+	int count = recvmmsg(Socket.GetHandle(), inmsgs.data(), inmsgs.size(), MSG_WAITFORONE, NULL);
+	return count > 0 ? count : 0;
+}
+
+char* UdpBatch::Data(unsigned int Index){
+	return (char*)inlist[Index].iov_base;
+}
+
+std::size_t UdpBatch::Size(unsigned int Index) const {
+	return inmsgs[Index].msg_len;
+}
+
+uint32_t UdpBatch::Address(unsigned int Index) const {
+	return ntohl(inaddrs[Index].sin_addr.s_addr);
+}
+
+uint16_t UdpBatch::Port(unsigned int Index) const {
+	return ntohs(inaddrs[Index].sin_port);
+}
+
+void UdpBatch::Send(const sf::UdpSocket& Socket, const char* Data, std::size_t Size, uint32_t Address, uint16_t Port){
+	if (queued == outmsgs.size()) Flush(Socket);
+	outlist[queued].iov_base = (void*)Data;
+	outlist[queued].iov_len = Size;
+	outaddrs[queued].sin_family = AF_INET;
+	outaddrs[queued].sin_addr.s_addr = htonl(Address);
+	outaddrs[queued].sin_port = htons(Port);
+	queued++;
+}
+
+void UdpBatch::Flush(const sf::UdpSocket& Socket){
+	unsigned int sent = 0;
+	while (sent < queued){
+		int count = sendmmsg(Socket.GetHandle(), &outmsgs[sent], queued-sent, 0);
+		if (count > 0) sent += count;
+		else if (errno != EINTR) sent++; //Skip the datagram that failed, like a single send would
+	}
+	queued = 0;
+}
@@ -0,0 +1,59 @@
+////////////////////////////////////////////////////////////
+//
+// RedRelay - a Lacewing Relay protocol reimplementation
+// Copyright (c) 2019 LekKit (LekKit#4400 in Discord)
+//
+// This software is provided 'as-is', without any express or implied
+// warranty. In no event will the authors be held liable for any damages
+// arising from the use of this software.
+//
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+//
+// 1. The origin of this software must not be misrepresented; you must not
+//   claim that you wrote the original software. If you use this software
+//   in a product, an acknowledgment in the product documentation would be
+//   appreciated but is not required.
+// 2. Altered source versions must be plainly marked as such, and must not be
+//   misrepresented as being the original software.
+// 3. This notice may not be removed or altered from any source distribution.
+//
+////////////////////////////////////////////////////////////
+
+
+#ifndef UDP_BATCH
+#define UDP_BATCH
+
+#include <vector>
+#include <cstdint>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <SFML/Network.hpp>
+
+//Batched UDP I/O via recvmmsg/sendmmsg, one syscall per burst of datagrams
+class UdpBatch{
+private:
+    std::vector<char> buffers;
+    std::vector<mmsghdr> inmsgs;
+    std::vector<iovec> inlist;
+    std::vector<sockaddr_in> inaddrs;
+
+    std::vector<mmsghdr> outmsgs;
+    std::vector<iovec> outlist;
+    std::vector<sockaddr_in> outaddrs;
+    unsigned int queued;
+public:
+    UdpBatch(unsigned int Slots=32, unsigned int Queue=1024);
+    //Receives up to Slots datagrams, blocking only for the first one
+    unsigned int Receive(const sf::UdpSocket& Socket);
+    char* Data(unsigned int Index);
+    std::size_t Size(unsigned int Index) const;
+    uint32_t Address(unsigned int Index) const;
+    uint16_t Port(unsigned int Index) const;
+    //Data is not copied, it must stay valid until the next Flush
+    void Send(const sf::UdpSocket& Socket, const char* Data, std::size_t Size, uint32_t Address, uint16_t Port);
+    void Flush(const sf::UdpSocket& Socket);
+};
+
+#endif
@@ -0,0 +1,393 @@
+////////////////////////////////////////////////////////////
+//
+// RedRelay - a Lacewing Relay protocol reimplementation
+// Copyright (c) 2019 LekKit (LekKit#4400 in Discord)
+//
+// This software is provided 'as-is', without any express or implied
+// warranty. In no event will the authors be held liable for any damages
+// arising from the use of this software.
+//
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+//
+// 1. The origin of this software must not be misrepresented; you must not
+//   claim that you wrote the original software. If you use this software
+//   in a product, an acknowledgment in the product documentation would be
+//   appreciated but is not required.
+// 2. Altered source versions must be plainly marked as such, and must not be
+//   misrepresented as being the original software.
+// 3. This notice may not be removed or altered from any source distribution.
+//
+////////////////////////////////////////////////////////////
+
+
+#include <iostream>
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+#include <csignal>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "ModSocket.hpp"
+#include "EpollSelector.hpp"
+
+//io_uring backend: plain sockets are watched by multishot polls, edge-triggered ones get their data from
+//multishot recv into provided buffers and are written by asynchronous sendmsg. Requests queued between
+//waits are submitted together with the wait for completions, so a whole fan-out costs one syscall.
+
+static const uint16_t BufferCount = 1024; //Power of two
+static const uint32_t BufferSize = 4096;
+
+enum Operation{Poll, Recv, Accept, Send, Cancel};
+enum EventType{None, Ready, Data, Closed, Accepted, Sent};
+
+struct EpollSelector::Registration{
+    uint32_t id=0;
+    uint32_t serial=0; //Completions of requests from an earlier registration of the descriptor are ignored
+    bool active=false;
+    bool stream=false; //Data comes from multishot recv, not readiness
+    bool write=false;
+    bool accept=false;
+    bool sending=false;
+    bool read=true; //Multishot recv is cancelled while reads are paused
+    msghdr message; //Read by the kernel until the send completes
+    iovec buffers[16];
+};
+
+static uint64_t Key(int fd, uint32_t serial, uint8_t op){
+    return (uint32_t)fd|(uint64_t)(serial&0xFFFFFF)<<32|(uint64_t)op<<56;
+}
+
+EpollSelector::EpollSelector(std::size_t Size){
+    maxevents = Size;
+    events = new Event[Size];
+    count = 0;
+    sqes = NULL;
+    sq_ring = cq_ring = NULL;
+    buffer_ring = NULL;
+    buffers = NULL;
+    buffer_tail = 0;
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = Size*4; //Multishot requests post several completions each
+    ring_fd = syscall(__NR_io_uring_setup, Size, &params);
+    if (ring_fd < 0){
+        std::cout<<"Failed to create io_uring instance"<<std::endl;
+        return;
+    }
+    sq_ring_size = params.sq_off.array+params.sq_entries*sizeof(unsigned);
+    cq_ring_size = params.cq_off.cqes+params.cq_entries*sizeof(io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) sq_ring_size = cq_ring_size = std::max(sq_ring_size, cq_ring_size);
+    sq_ring = mmap(NULL, sq_ring_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+    cq_ring = params.features & IORING_FEAT_SINGLE_MMAP ? sq_ring : mmap(NULL, cq_ring_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+    void* entries = mmap(NULL, params.sq_entries*sizeof(io_uring_sqe), PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+    if (sq_ring == MAP_FAILED || cq_ring == MAP_FAILED || entries == MAP_FAILED){
+        std::cout<<"Failed to map io_uring queues"<<std::endl;
+        return;
+    }
+    sqes = (io_uring_sqe*)entries;
+    cqes = (io_uring_cqe*)((char*)cq_ring+params.cq_off.cqes);
+    sq_head = (unsigned*)((char*)sq_ring+params.sq_off.head);
+    sq_tail = (unsigned*)((char*)sq_ring+params.sq_off.tail);
+    sq_mask = (unsigned*)((char*)sq_ring+params.sq_off.ring_mask);
+    cq_head = (unsigned*)((char*)cq_ring+params.cq_off.head);
+    cq_tail = (unsigned*)((char*)cq_ring+params.cq_off.tail);
+    cq_mask = (unsigned*)((char*)cq_ring+params.cq_off.ring_mask);
+    unsigned* array = (unsigned*)((char*)sq_ring+params.sq_off.array);
+    for (unsigned i=0; i<params.sq_entries; ++i) array[i] = i; //Entries are always submitted in ring order
+    sq_entries = params.sq_entries;
+    tail = *sq_tail;
+
+    void* ring = mmap(NULL, BufferCount*sizeof(io_uring_buf), PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (ring == MAP_FAILED){
+        std::cout<<"Failed to allocate io_uring receive buffers"<<std::endl;
+        return;
+    }
+    buffer_ring = (io_uring_buf_ring*)ring;
+    buffers = new char[BufferCount*BufferSize];
+    io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)buffer_ring;
+    reg.ring_entries = BufferCount;
+    reg.bgid = 0;
+    if (syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+        std::cout<<"Failed to register io_uring receive buffers"<<std::endl;
+    for (uint16_t i=0; i<BufferCount; ++i) recycle(i);
+    __atomic_store_n(&buffer_ring->tail, buffer_tail, __ATOMIC_RELEASE);
+}
+
+EpollSelector::~EpollSelector(){
+    if (ring_fd >= 0 && close(ring_fd)) std::cout<<"Failed to close io_uring descriptor"<<std::endl; //Cancels whatever is still pending
+    if (sqes != NULL) munmap(sqes, sq_entries*sizeof(io_uring_sqe));
+    if (cq_ring != NULL && cq_ring != MAP_FAILED && cq_ring != sq_ring) munmap(cq_ring, cq_ring_size);
+    if (sq_ring != NULL && sq_ring != MAP_FAILED) munmap(sq_ring, sq_ring_size);
+    if (buffer_ring != NULL) munmap(buffer_ring, BufferCount*sizeof(io_uring_buf));
+    delete[] buffers;
+    delete[] events;
+    for (Registration* it : registrations) delete it;
+}
+
+io_uring_sqe* EpollSelector::sqe(){
+    if (tail-__atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= sq_entries) submit(); //Queue is full, hand it over first
+    io_uring_sqe* entry = &sqes[tail & *sq_mask];
+    memset(entry, 0, sizeof(io_uring_sqe));
+    ++tail;
+    return entry;
+}
+
+void EpollSelector::submit(unsigned wait, int timeout){
+    __atomic_store_n(sq_tail, tail, __ATOMIC_RELEASE);
+    unsigned pending = tail-__atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+    unsigned flags = wait ? IORING_ENTER_GETEVENTS : 0;
+    io_uring_getevents_arg arg;
+    __kernel_timespec ts;
+    void* argp = NULL;
+    std::size_t argsize = 0;
+    if (wait && timeout >= 0){
+        memset(&arg, 0, sizeof(arg));
+        ts.tv_sec = timeout/1000;
+        ts.tv_nsec = (timeout%1000)*1000000;
+        arg.ts = (uint64_t)&ts;
+        arg.sigmask_sz = _NSIG/8;
+        argp = &arg;
+        argsize = sizeof(arg);
+        flags |= IORING_ENTER_EXT_ARG;
+    }
+    if (pending == 0 && flags == 0) return;
+    syscall(__NR_io_uring_enter, ring_fd, pending, wait, flags, argp, argsize);
+}
+
+void EpollSelector::arm(int fd){
+    Registration& reg = *registrations[fd];
+    io_uring_sqe* entry = sqe();
+    entry->fd = fd;
+    if (reg.accept){
+        entry->opcode = IORING_OP_ACCEPT;
+        entry->ioprio = IORING_ACCEPT_MULTISHOT;
+        entry->accept_flags = SOCK_NONBLOCK|SOCK_CLOEXEC;
+        entry->user_data = Key(fd, reg.serial, Accept);
+    } else if (reg.stream){
+        entry->opcode = IORING_OP_RECV;
+        entry->ioprio = IORING_RECV_MULTISHOT;
+        entry->flags = IOSQE_BUFFER_SELECT;
+        entry->buf_group = 0;
+        entry->user_data = Key(fd, reg.serial, Recv);
+    } else {
+        entry->opcode = IORING_OP_POLL_ADD;
+        //One-shot, rearmed after every completion: arming checks the current state, so it's level-triggered
+        entry->poll32_events = POLLIN|POLLRDHUP|(reg.write ? POLLOUT : 0);
+        entry->user_data = Key(fd, reg.serial, Poll);
+    }
+}
+
+void EpollSelector::cancel(int fd){ //Stops every request of the descriptor, their completions are ignored from now on
+    Registration& reg = *registrations[fd];
+    io_uring_sqe* entry = sqe();
+    entry->opcode = IORING_OP_ASYNC_CANCEL;
+    entry->fd = fd;
+    entry->cancel_flags = IORING_ASYNC_CANCEL_FD|IORING_ASYNC_CANCEL_ALL;
+    entry->user_data = Key(fd, 0, Cancel);
+    reg.active = false;
+    reg.sending = false;
+    ++reg.serial;
+    for (uint32_t i=0; i<count; ++i) if (events[i].fd == fd) events[i].type = None; //Not yet handled events are void too
+}
+
+void EpollSelector::recycle(uint16_t bid){
+    io_uring_buf& buffer = ((io_uring_buf*)buffer_ring)[buffer_tail & (BufferCount-1)]; //Not bufs[], C++ puts it after a 1 byte empty struct
+    buffer.addr = (uint64_t)&buffers[bid*BufferSize];
+    buffer.len = BufferSize;
+    buffer.bid = bid;
+    ++buffer_tail;
+}
+
+EpollSelector::Registration& EpollSelector::slot(int fd){ //Fresh registration of the descriptor
+    if ((std::size_t)fd >= registrations.size()) registrations.resize(fd+1, NULL);
+    if (registrations[fd] == NULL) registrations[fd] = new Registration;
+    if (registrations[fd]->active) cancel(fd);
+    registrations[fd]->active = true;
+    return *registrations[fd];
+}
+
+void EpollSelector::add(const sf::Socket& sock, uint32_t id, bool write, bool edge){
+    Registration& reg = slot(sock.GetHandle());
+    reg.id = id;
+    reg.stream = edge;
+    reg.write = write;
+    reg.accept = false;
+    reg.read = true;
+    arm(sock.GetHandle());
+}
+
+void EpollSelector::listen(const sf::Socket& sock, uint32_t id){
+    Registration& reg = slot(sock.GetHandle());
+    reg.id = id;
+    reg.stream = false;
+    reg.write = false;
+    reg.accept = true;
+    arm(sock.GetHandle());
+}
+
+void EpollSelector::remove(const sf::Socket& sock){
+    int fd = sock.GetHandle();
+    if ((std::size_t)fd >= registrations.size() || registrations[fd] == NULL || !registrations[fd]->active) return;
+    cancel(fd);
+    submit(); //Cancellation looks the descriptor up, it has to happen before the caller closes it
+}
+
+void EpollSelector::mod(const sf::Socket& sock, uint32_t id, bool write, bool edge, bool read){
+    int fd = sock.GetHandle();
+    if ((std::size_t)fd < registrations.size() && registrations[fd] != NULL && registrations[fd]->active){
+        Registration& reg = *registrations[fd];
+        if (reg.id == id && reg.stream && edge){ //Streams are written by send(), only reads may need a change
+            if (reg.read == read) return;
+            reg.read = read;
+            if (read){
+                arm(fd);
+                return;
+            }
+            io_uring_sqe* entry = sqe(); //Only the recv, a send in flight carries on
+            entry->opcode = IORING_OP_ASYNC_CANCEL;
+            entry->addr = Key(fd, reg.serial, Recv);
+            entry->user_data = Key(fd, 0, Cancel);
+            return;
+        }
+        if (reg.id == id && reg.stream == edge && reg.write == write) return;
+    }
+    add(sock, id, write, edge);
+}
+
+bool EpollSelector::send(const sf::Socket& sock, const char** Data, const std::size_t* Sizes, std::size_t Count){
+    int fd = sock.GetHandle();
+    if ((std::size_t)fd >= registrations.size() || registrations[fd] == NULL) return false;
+    Registration& reg = *registrations[fd];
+    if (!reg.active || reg.sending) return false;
+    if (Count > 16) Count = 16;
+    for (std::size_t i=0; i<Count; ++i){
+        reg.buffers[i].iov_base = (void*)Data[i];
+        reg.buffers[i].iov_len = Sizes[i];
+    }
+    memset(&reg.message, 0, sizeof(reg.message));
+    reg.message.msg_iov = reg.buffers;
+    reg.message.msg_iovlen = Count;
+    io_uring_sqe* entry = sqe();
+    entry->opcode = IORING_OP_SENDMSG;
+    entry->fd = fd;
+    entry->addr = (uint64_t)&reg.message;
+    entry->len = 1;
+    entry->msg_flags = MSG_NOSIGNAL;
+    entry->user_data = Key(fd, reg.serial, Send);
+    reg.sending = true;
+    return true;
+}
+
+void EpollSelector::complete(const io_uring_cqe& cqe){
+    int fd = (uint32_t)cqe.user_data;
+    uint32_t serial = (cqe.user_data>>32)&0xFFFFFF;
+    uint8_t op = cqe.user_data>>56;
+    bool more = (cqe.flags & IORING_CQE_F_MORE) != 0;
+    const char* data = NULL;
+    if (cqe.flags & IORING_CQE_F_BUFFER){ //Given back at the next wait(), whether the event is used or not
+        uint16_t bid = cqe.flags>>IORING_CQE_BUFFER_SHIFT;
+        consumed.push_back(bid);
+        data = &buffers[bid*BufferSize];
+    }
+    if (op == Cancel || (std::size_t)fd >= registrations.size() || registrations[fd] == NULL) return;
+    Registration& reg = *registrations[fd];
+    if (!reg.active || (reg.serial&0xFFFFFF) != serial) return; //Request of an earlier registration
+    Event& event = events[count];
+    event.id = reg.id;
+    event.fd = fd;
+    event.result = cqe.res;
+    event.data = NULL;
+    switch (op){
+    case Poll:
+        if (!more) arm(fd);
+        event.type = Ready;
+        if (cqe.res < 0) event.result = POLLERR;
+        break;
+    case Recv:
+        if (cqe.res == -ECANCELED || (!reg.read && cqe.res <= 0)) return; //Cancelled by pausing, a closed connection shows up once reads resume
+        if (cqe.res == -ENOBUFS){ //Every buffer is in use, retried once this batch is handed back
+            if (reg.read) arm(fd);
+            return;
+        }
+        if (cqe.res <= 0){ //Connection is closed, the request is over
+            event.type = Closed;
+            break;
+        }
+        if (!more && reg.read) arm(fd);
+        event.type = Data;
+        event.data = data;
+        break;
+    case Accept:
+        if (!more) arm(fd);
+        if (cqe.res < 0) return;
+        event.type = Accepted;
+        break;
+    case Send:
+        reg.sending = false;
+        event.type = Sent;
+        break;
+    default:
+        return;
+    }
+    ++count;
+}
+
+int EpollSelector::wait(int timeout){
+    if (ring_fd < 0) return 0;
+    if (!consumed.empty()){ //Caller is done with the previous batch
+        for (uint16_t bid : consumed) recycle(bid);
+        __atomic_store_n(&buffer_ring->tail, buffer_tail, __ATOMIC_RELEASE);
+        consumed.clear();
+    }
+    count = 0;
+    bool ready = *cq_head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+    submit(ready || timeout == 0 ? 0 : 1, timeout);
+    unsigned head = *cq_head;
+    unsigned end = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != end && count < maxevents; ++head) complete(cqes[head & *cq_mask]);
+    __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+    return count;
+}
+
+uint32_t EpollSelector::at(uint32_t index) const {
+    return events[index].id;
+}
+
+bool EpollSelector::readable(uint32_t index) const {
+    switch (events[index].type){
+    case Ready:
+        return (events[index].result & (POLLIN|POLLHUP|POLLRDHUP|POLLERR)) != 0;
+    case Data:
+    case Closed:
+    case Accepted:
+        return true;
+    default:
+        return false;
+    }
+}
+
+bool EpollSelector::writable(uint32_t index) const {
+    return events[index].type == Ready && (events[index].result & POLLOUT) != 0;
+}
+
+int EpollSelector::accepted(uint32_t index) const {
+    return events[index].type == Accepted ? events[index].result : -1;
+}
+
+const char* EpollSelector::data(uint32_t index, std::size_t& size) const {
+    size = events[index].type == Data ? events[index].result : 0;
+    return events[index].type == Data ? events[index].data : NULL;
+}
+
+bool EpollSelector::sent(uint32_t index, int& result) const {
+    result = events[index].result;
+    return events[index].type == Sent;
+}